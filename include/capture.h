@@ -0,0 +1,190 @@
+/*``````````````````Pre/post-trigger waveform capture``````````````````````````
+ * Records of an array PV are acquired directly into a ring of preallocated
+ * records, the source PV always points to the latest one.
+ * When the trigger condition is met, the window of npre records before the
+ * trigger and npost records from the trigger on is frozen by swapping the
+ * ring with a spare one, so the acquisition continues without copying.
+ * The window is copied out of the frozen ring only when the window PV is
+ * read, i.e. outside of the acquisition path.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include "pv.h"
+
+enum CAPTURE_STATE {
+    CAPTURE_FILLING = 0,// not enough pre-trigger records since last freeze
+    CAPTURE_ARMED = 1,  // waiting for trigger
+    CAPTURE_POST = 2,   // triggered, recording post-trigger records
+};
+
+template <typename T>
+static bool rising_edge(const T* samples, uint32_t n, int64_t threshold,
+  int64_t* prev){
+    // Check if samples cross the threshold upwards. *prev is the last sample
+    // of the previous record, it is updated on return.
+    bool crossed = false;
+    int64_t p = *prev;
+    for (uint32_t i=0; i<n; i++){
+        int64_t s = samples[i];
+        crossed |= (p < threshold) & (s >= threshold);
+        p = s;
+    }
+    *prev = p;
+    return crossed;
+}
+
+class WaveformCapture {
+  public:
+    PV* source;         // array PV, its value points to the latest record
+    PV* window;         // PV of the frozen window, shape [npre+npost, ...]
+    uint32_t nrecords;  // capacity of the ring
+    uint32_t npre;      // number of records before the trigger
+    uint32_t npost;     // number of records from the trigger on
+    int channel = -1;   // channel of the threshold trigger, -1: disabled
+    int32_t threshold = 0;
+    uint32_t triggers = 0;// number of frozen windows
+    uint8_t state = CAPTURE_FILLING;
+
+    WaveformCapture(PV* asource, PV* awindow, uint32_t anrecords,
+      uint32_t anpre, uint32_t anpost){
+        source = asource;
+        window = awindow;
+        nrecords = anrecords;
+        npre = anpre;
+        npost = anpost;
+    }
+    int init(){
+        /* Allocate the ring for the current shape of the source, from the
+         * array pool of the plant. Should be called after the source shape is
+         * set, again when it is reshaped: the captured records are dropped,
+         * the source points to the first, zeroed, record of the new ring.
+         */
+        if (npre + npost == 0 or npre + npost > nrecords){
+            printf("ERR: capture window of %s does not fit in %u records\n",
+              source->name, nrecords);
+            return 1;
+        }
+        uint32_t size = element_size(source->type)*array_length(source->shape);
+        uint8_t* new_ring = (uint8_t*) plant_array_alloc(nrecords*size);
+        uint8_t* new_frozen = (uint8_t*) plant_array_alloc(nrecords*size);
+        uint8_t* new_window = (uint8_t*) plant_array_alloc((npre+npost)*size);
+        if (new_ring == NULL or new_frozen == NULL or new_window == NULL){
+            printf("ERR: no memory for capture of %s\n", source->name);
+            plant_array_free(new_ring);
+            plant_array_free(new_frozen);
+            plant_array_free(new_window);
+            return 1;
+        }
+        // workers may still read the old records
+        plant_array_free(ring);
+        plant_array_free(frozen);
+        recsize = size;
+        ring = new_ring;
+        frozen = new_frozen;
+        head = 0;
+        filled = 0;
+        frozen_pending = false;
+        state = CAPTURE_FILLING;
+        memset(ring, 0, recsize);
+        source->value.Bptr = ring;
+
+        // window PV: records of the source, prepended by the record axis
+        window->write_begin();
+        window->type = source->type;
+        window->set_shape(npre + npost);
+        for (int ii=0; ii<MAX_DIMENSION-1 and source->shape[ii] > 0; ii++){
+            window->shape[ii+1] = source->shape[ii];}
+        if (source->shape[MAX_DIMENSION-1] > 0){// no room, flatten
+            window->set_shape(npre + npost, array_length(source->shape));}
+        memset(new_window, 0, (npre+npost)*recsize);
+        window->value.Bptr = new_window;
+        window->write_end();
+        plant_array_free(window_buf);
+        window_buf = new_window;
+        return 0;
+    }
+    void* next_record(){
+        // Buffer for the next record, the acquisition should write into it
+        return ring + head*recsize;
+    }
+    void commit(const struct timespec* ts){
+        // Publish the record, written into next_record(), and check trigger
+        uint8_t* rec = ring + head*recsize;
+        source->value.Bptr = rec;
+        source->update_timestamp(ts);
+        head = (head + 1 == nrecords)? 0: head + 1;
+        if (filled < nrecords) filled++;
+
+        bool triggered = check_trigger(rec);
+        if (state == CAPTURE_FILLING and filled > npre){
+            state = CAPTURE_ARMED;}
+        if (state == CAPTURE_ARMED and triggered){
+            state = CAPTURE_POST;
+            post_left = npost;
+            trigger_time = source->timestamp;
+        }
+        if (state == CAPTURE_POST and --post_left == 0){
+            freeze();}
+    }
+    void trigger(){
+        // Software trigger, can be called from any thread
+        __atomic_store_n(&soft_trigger, true, __ATOMIC_RELEASE);
+    }
+    int linearize(){
+        // Copy the last frozen window out of the frozen ring, if not yet
+        if (not frozen_pending){
+            return 0;}
+        uint32_t w = npre + npost;
+        uint32_t start = (frozen_head + nrecords - w) % nrecords;
+        uint32_t n1 = nrecords - start;
+        if (n1 > w) n1 = w;
+        memcpy(window_buf, frozen + start*recsize, n1*recsize);
+        memcpy(window_buf + n1*recsize, frozen, (w - n1)*recsize);
+        frozen_pending = false;
+        return 0;
+    }
+  private:
+    uint32_t recsize = 0;   // bytes per record
+    uint32_t head = 0;      // ring index of the next record
+    uint32_t filled = 0;    // records in the ring since last freeze
+    uint32_t post_left = 0; // post-trigger records to wait for
+    uint8_t* ring = NULL;
+    uint8_t* frozen = NULL;
+    uint8_t* window_buf = NULL;
+    uint32_t frozen_head = 0;
+    bool frozen_pending = false;
+    bool soft_trigger = false;
+    TD_timestamp trigger_time = {0, 0};
+    int64_t prev_sample = 0;
+
+    bool check_trigger(const uint8_t* rec){
+        bool triggered = __atomic_exchange_n(&soft_trigger, false, __ATOMIC_ACQ_REL);
+        if (channel < 0){
+            return triggered;}
+        uint32_t nch = source->shape[1] > 0? source->shape[0]: 1;
+        if ((uint32_t)channel >= nch){
+            return triggered;}
+        uint32_t n = array_length(source->shape)/nch;
+        const uint8_t* samples = rec + channel*n*element_size(source->type);
+        switch (source->type){
+        case T_Bptr: {triggered |= rising_edge((const uint8_t*)samples, n, threshold, &prev_sample); break;}
+        case T_u2ptr:{triggered |= rising_edge((const uint16_t*)samples, n, threshold, &prev_sample); break;}
+        case T_i2ptr:{triggered |= rising_edge((const int16_t*)samples, n, threshold, &prev_sample); break;}
+        case T_u4ptr:{triggered |= rising_edge((const uint32_t*)samples, n, threshold, &prev_sample); break;}
+        case T_i4ptr:{triggered |= rising_edge((const int32_t*)samples, n, threshold, &prev_sample); break;}
+        }
+        return triggered;
+    }
+    void freeze(){
+        // Swap the ring with the spare one, the window stays in the frozen ring
+        uint8_t* tmp = ring; ring = frozen; frozen = tmp;
+        frozen_head = head;
+        frozen_pending = true;
+        head = 0;
+        filled = 0;
+        state = CAPTURE_FILLING;
+        triggers++;
+        window->timestamp = trigger_time;
+    }
+};
+#endif //CAPTURE_H
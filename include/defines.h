@@ -3,6 +3,7 @@
 #ifndef DEFINES_H
 #define DEFINES_H
 #include "../../tinycbor/src/cbor.h"
+#include <time.h>
 
 #define PLATFORM_LINUX 1
 #define PLATFORM_STM32 2
@@ -43,7 +44,10 @@ enum VALUETYPE {
 
 //``````````````````Helper functions```````````````````````````````````````````
 bool starts_with(const char *str1, const char *str2);
+bool glob_match(const char *pattern, const char *str);
 int array_length(uint32_t* shape);
+void minmax_i64(const int64_t* v, uint32_t n, int64_t* pmin, int64_t* pmax);
+void prefault(void* ptr, size_t len);
 void dumpbytes(const uint8_t *buf, size_t len);
 void encode_error(CborEncoder* encoder, const char* key, const char* value);
 
@@ -57,18 +61,348 @@ int transport_init(uint8_t *buf, uint32_t bufsz);
 int transport_recv(uint8_t **msg);
 int transport_send(uint8_t *msg, size_t msgsz);
 
+//``````````````````Archive functions``````````````````````````````````````````
+// Segment file: ARCHIVE_HEADER, then records: ARCHIVE_RECORD followed by
+// the CBOR frame, padded to 8 bytes.
+#define ARCHIVE_MAGIC "P2PARCH1"
+#define ARCHIVE_INDEX_SIZE 1024 // sparse index entries per segment
+#define ARCHIVE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+struct ARCHIVE_INDEX{
+    TD_timestamp t;
+    uint64_t offset;
+};
+struct ARCHIVE_HEADER{
+    char magic[8];
+    uint32_t header_size;
+    uint32_t nindex;    // used index entries
+    uint64_t used;      // bytes used in the segment, including header
+    uint64_t nrecords;
+    TD_timestamp first; // timestamp of the first record
+    TD_timestamp last;  // timestamp of the last record
+    ARCHIVE_INDEX index[ARCHIVE_INDEX_SIZE];
+};
+struct ARCHIVE_RECORD{
+    uint32_t length;    // of the CBOR frame
+    uint32_t reserved;  // keeps the frame 8-byte aligned
+    TD_timestamp t;
+};
+
+int archive_init(const char* dir, uint32_t segment_size);
+int archive_append(const uint8_t* frame, size_t len, const TD_timestamp* t);
+void archive_close();
+bool archive_active();
+uint64_t archive_find(const uint8_t* segment, const TD_timestamp* t);
+
+//``````````````````Traffic capture````````````````````````````````````````````
+/* Incoming requests can be captured into a file, plant_traffic_capture(),
+ * and replayed later through src/transport_replay.cpp. The file is a
+ * TRAFFIC_HEADER followed by records: TRAFFIC_RECORD, then the request.
+ */
+#define TRAFFIC_MAGIC "P2PTRAF1"
+struct TRAFFIC_HEADER{
+    char magic[8];
+    uint64_t start;     // CLOCK_REALTIME of the start of capture, ns
+};
+struct __attribute__((packed)) TRAFFIC_RECORD{
+    uint64_t t;         // arrival, CLOCK_MONOTONIC ns since the start
+    uint32_t length;    // of the request
+};
+
+//``````````````````Plant context``````````````````````````````````````````````
+/* All state of a plant: PV table, encoder, parser, transport, groups,
+ * snapshot and archive. A process may run several plants, e.g. one per ADC
+ * board, each on its own thread. All plant functions operate on the plant,
+ * which has been selected for the calling thread by plant_select().
+ * Single-plant programs need not to care, the default plant is selected.
+ */
+class PV;
+#define MAX_GROUPS 16
+#define MAX_GLOBS 16 // cached glob patterns of gets
+struct PVGroup {// published groups are not modified, see create_group()
+    char name[32];
+    PV** members;       // follow the group in the same block
+    uint16_t nmembers;
+    bool shared_timestamp;// encode one timestamp for all members
+};
+#define MAX_PENDING_SETTERS 16
+struct PendingSetter {
+    PV* pv;
+    bool silent;// started by snapshot restore, no reply to client
+    bool request_id_present;
+    int64_t request_id;
+};
+struct ArchiveWriter {
+    char dir[256];
+    uint32_t segment_size = 0;
+    uint32_t seq = 0;           // sequence number of the current segment
+    int fd = -1;
+    uint8_t* map = NULL;        // mapped segment
+    uint64_t last_indexed = 0;  // offset of the last indexed record
+};
+struct PlantSession {// state of request processing, one per thread
+    // Reply encoder
+    uint8_t* encoder_buffer = NULL;
+    uint32_t encoder_bufsize = 0;
+    bool encoder_owned = false; // allocated by the plant, may be reallocated
+    CborEncoder root_encoder;
+    CborEncoder branch_encoder;
+    CborEncoder* reply_encoder = NULL;// PV functions encode the reply here
+    // Request parser
+    CborParser root_parser;
+    int parm_cmd = 0;
+    CborTag parm_tag = 0;
+    char par_name[80];
+    bool group_pending = false; // group par_name is redefined by its first pattern
+    bool request_id_expected = false;
+    bool request_id_present = false;// client-assigned request ID
+    int64_t request_id = 0;
+    int64_t* int_array = NULL;  // scratch for array values, grows as needed
+    size_t int_array_size = 0;
+    char* text = NULL;          // scratch for strings, see plant_session_reserve()
+    size_t text_size = 0;
+    uint8_t* send_buf = NULL;   // allocated by transport on first send
+    uint32_t send_bufsize = 0;  // grows with the replies
+    bool read_only = false;     // worker session, must not modify the plant
+};
+struct PVIndex {// hot attributes of the PV table, in arrays
+    PV** pvs;           // table, for which the index was built
+    uint16_t npv;
+    uint32_t generation;// of plant->pvs_generation
+    uint16_t nmeasured;
+    uint32_t hash_mask;
+    uint16_t* fbits;    // features of pvs[i]
+    uint32_t* hash;     // hash of the name of pvs[i]
+    uint16_t* slots;    // open addressing table of i+1, 0 if empty
+    uint16_t* measured; // indexes of F_M PVs
+};
+struct WorkerPool;
+struct EncoderPool;
+struct ArrayPool;
+struct PlantStats;
+struct RealtimeState;
+struct Plant {
+    uint8_t id = 0;             // IPC queues of the plant use ftok id 65+id
+    // PV table
+    PV** pvs = NULL;
+    uint16_t npv = 0;
+    PVIndex* index = NULL;      // of the PV table, see index_pvs() in pv.h
+    uint32_t pvs_generation = 0;// bumped by plant_pvs_changed()
+    ArrayPool* arrays = NULL;   // storage of reshaped array PVs
+    // Request processing of the thread, which runs the plant
+    PlantSession session;
+    // Client and transport
+    bool client_alive = true;   // if not, then subscription will be suspended
+    uint32_t transport_send_failure = 0;
+    int msgid_rcv = -1;
+    int msgid_snd = -1;
+    uint8_t* recv_buf = NULL;
+    uint32_t recv_bufsize = 0;
+    // Groups and asynchronous setters, defined in pv.h
+    PVGroup* groups[MAX_GROUPS] = {};
+    int ngroups = 0;
+    PVGroup* globs[MAX_GLOBS] = {};// see encode_glob() in pv.h
+    int next_glob = 0;          // slot, which is evicted next
+    PV** globs_pvs = NULL;      // PV table, which the globs are resolved from
+    uint16_t globs_npv = 0;
+    PendingSetter pending_setters[MAX_PENDING_SETTERS];
+    int npending = 0;
+    // Snapshot, mirror and archive
+    char snapshot_path[256] = "";
+    uint32_t snapshot_interval_ms = 0;
+    struct timespec snapshot_last_save = {0, 0};
+    bool snapshot_dirty = false;// a savable PV changed since last snapshot
+    bool snapshot_restoring = false;
+    char mirror_name[64] = "";
+    ArchiveWriter archive;
+    int traffic_fd = -1;        // capture of requests, see plant_traffic_capture()
+    uint64_t traffic_start = 0; // CLOCK_MONOTONIC ns
+    // Workers for read-only requests, see plant_start_workers()
+    WorkerPool* pool = NULL;
+    uint64_t epoch = 1;         // for reclamation of memory, read by workers
+    // Latency histograms and counters, see plant_stats_pvs() in pv.h
+    PlantStats* stats = NULL;
+    // Real-time mode and cycle latency, see plant_realtime()
+    RealtimeState* rt = NULL;
+    TD_timestamp frame_acquired = {0, 0};// newest timestamp of the last frame
+    // Threads for encoding of large frames, see plant_start_encoders()
+    EncoderPool* encoders = NULL;
+    uint32_t parallel_frame_min = 0;// smaller frames are encoded serially
+    PV** frame_pvs = NULL;      // measured PVs of the frame being built
+    uint32_t* frame_offsets = NULL;// their offsets in the frame
+    uint16_t frame_capacity = 0;
+};
+extern thread_local Plant* plant;// plant of the calling thread
+extern thread_local PlantSession* session;// request processing of the thread
+
+Plant* plant_create(uint8_t id);
+void plant_select(Plant* p);
+int plant_start_workers(int nworkers);
+void plant_retire(void* ptr);
+void plant_reclaim();
+int plant_start_encoders(int nthreads, uint32_t min_frame_size);
+void plant_parallel_for(int njobs, void (*job)(void* ctx, int i), void* ctx);
+
+//  Storage of array PVs, see PV::reshape() and the pool in p2plant.cpp
+#define ARRAY_MIN_BLOCK 64
+#define ARRAY_NCLASSES 24       // blocks of 64 B to 512 MB
+#define ARRAY_HUGE_BLOCK (2*1024*1024)// and larger blocks are mapped
+#define ARRAY_KEEP_FREE 2       // free blocks kept per size class
+void* plant_array_alloc(uint32_t nbytes);
+void plant_array_free(void* ptr);
+uint32_t plant_array_capacity(const void* ptr);
+size_t plant_array_bytes(size_t* cached=NULL);
+
+//``````````````````Real-time mode```````````````````````````````````````````
+/* Opt-in mode for a deterministic acquisition cycle, plant_realtime():
+ * the plant thread is pinned to the first of the configured CPUs and runs
+ * under SCHED_FIFO, workers and encoders, which are started later, are
+ * pinned to the other CPUs in turn; encoders get the priority of the plant
+ * thread, workers one less, so acquisition preempts requests. All memory is
+ * locked, buffers of PVs and sessions are prefaulted and the heap is not
+ * trimmed. The main loop marks the acquisition path by plant_cycle_begin()
+ * and plant_cycle_end(); after RT_WARMUP_CYCLES, in which buffers reach
+ * their steady sizes, the worst cycle latency and heap allocations of the
+ * plant thread within cycles are published by plant_realtime_pvs() in pv.h.
+ */
+#define RT_MAX_CPUS 16
+#define RT_WARMUP_CYCLES 1000
+#define RT_STACK_PREFAULT (256*1024)// bytes of the stack touched in advance
+struct RealtimeConfig {
+    int priority = 0;       // SCHED_FIFO priority, 0: the policy is not changed
+    int cpus[RT_MAX_CPUS];  // plant thread, then workers and encoders
+    int ncpus = 0;          // 0: threads are not pinned
+    bool lock_memory = true;// mlockall() and prefault
+};
+enum RT_VALUE {// published by rt_cycle
+    RT_WORST_CYCLE, // ns, since the warm-up or rt_reset
+    RT_LAST_CYCLE,  // ns
+    RT_CYCLES,      // measured cycles
+    RT_ALLOCATIONS, // heap allocations within measured cycles
+    RT_NVALUES
+};
+struct RealtimeState {
+    RealtimeConfig config;
+    bool enabled;           // plant_realtime() has been called
+    int next_cpu;           // index in config.cpus of the next started thread
+    uint64_t cycle_start;   // CLOCK_MONOTONIC ns
+    uint64_t ncycles;       // including the warm-up
+    uint32_t values[RT_NVALUES];
+    PV* pvs;                // RT_NPV PVs, which publish the above
+};
+int plant_realtime(const RealtimeConfig* config);
+void plant_cycle_begin();
+void plant_cycle_end();
+int plant_session_reserve(uint32_t msglen);
+uint64_t plant_heap_allocations();
+
+//``````````````````Statistics```````````````````````````````````````````````
+/* Low-overhead instrumentation of a plant, published as PVs by
+ * plant_stats_pvs(). Histograms are HDR-style: values below
+ * STATS_SUB_BUCKETS have their own buckets, each higher power of two is split
+ * into STATS_SUB_BUCKETS buckets, so a bucket is at most 1/8 of its values
+ * wide. Bucket b counts values from stats_bucket_low(b) to
+ * stats_bucket_low(b+1)-1, the last bucket also counts all larger values.
+ * Times are in nanoseconds.
+ */
+#define STATS_SUB_BUCKETS 8
+#define STATS_NBUCKETS 256// up to 16 s
+enum STATS_HISTOGRAM {
+    H_REQUEST,      // decode, dispatch and encode of a request
+    H_QUEUE_WAIT,   // time of a request in the worker queue
+    H_SEND,         // transport_send()
+    H_FRAME_ENCODE, // encoding of a frame of measurements
+    H_FRAME_LATENCY,// from acquisition (newest timestamp) to sent frame
+    H_FRAME_SIZE,   // bytes
+    H_QUEUE_DEPTH,  // requests in the worker queue, when one is added
+    STATS_NHISTOGRAMS
+};
+enum STATS_COUNTER {
+    C_REQUESTS,
+    C_WORKER_REQUESTS,// passed to workers
+    C_QUEUE_FULL,   // processed by the writer, because the queue was full
+    C_FRAMES,
+    C_SEND_FAILURES,
+    STATS_NCOUNTERS
+};
+struct PlantStats {
+    uint32_t hist[STATS_NHISTOGRAMS][STATS_NBUCKETS];
+    uint32_t counters[STATS_NCOUNTERS];
+    PV* pvs;        // STATS_NPV PVs, which publish the above
+};
+static inline uint32_t stats_bucket(uint64_t v){
+    if (v < STATS_SUB_BUCKETS) return v;
+    uint32_t e = 63 - __builtin_clzll(v);// v >= 2^e, e >= 3
+    uint32_t b = (e - 2)*STATS_SUB_BUCKETS + ((v >> (e - 3)) & (STATS_SUB_BUCKETS - 1));
+    return b < STATS_NBUCKETS? b: STATS_NBUCKETS - 1;
+}
+static inline uint64_t stats_bucket_low(uint32_t b){
+    if (b < STATS_SUB_BUCKETS) return b;
+    uint32_t e = b/STATS_SUB_BUCKETS + 2;
+    return (uint64_t)(STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS) << (e - 3);
+}
+static inline uint64_t stats_now_ns(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+static inline void stats_record(int h, uint64_t v){
+    if (plant->stats != NULL){
+        __atomic_fetch_add(&plant->stats->hist[h][stats_bucket(v)], 1, __ATOMIC_RELAXED);}
+}
+static inline void stats_count(int c, uint32_t n = 1){
+    if (plant->stats != NULL){
+        __atomic_fetch_add(&plant->stats->counters[c], n, __ATOMIC_RELAXED);}
+}
+
 //``````````````````Firmware-specific functions````````````````````````````````
 //  entries for main loop
 void plant_process_request(const uint8_t* msg, int msglen);
+int plant_traffic_capture(const char* path);
+void plant_traffic_close();
+void plant_deliver_completions();
+int plant_snapshot_init(const char* path, uint32_t interval_ms);
+int plant_snapshot_update(bool force=false);
+int plant_mirror_init(const char* shm_name);
+void plant_mirror_close();
+
+//  Reply encoder, defined in p2plant.cpp.
+/* An entry of a reply (a PV, a group, info of "*"), which does not fit into
+ * the encoder buffer, is rolled back to its mark and encoded again into a
+ * larger buffer:
+ *     CborEncoder mark;
+ *     encoder_mark(&mark);
+ *     do {...encode into session->reply_encoder...
+ *     } while (encoder_retry(&mark, name));
+ * The buffer grows in powers of two and is kept by the session, so replies
+ * of steady size do not allocate. An entry larger than ENCODER_MAX_SIZE is
+ * replaced by an error. Each mark leaves ENCODER_RESERVE bytes for entries,
+ * which are not retried, e.g. replies of setters and errors.
+ */
+#define ENCODER_RESERVE 256
+#define ENCODER_MAX_SIZE (16*1024*1024)
+void encoder_mark(CborEncoder* mark);
+bool encoder_retry(CborEncoder* mark, const char* name);
 
 //  Plant's internal functions, defined in pv.h
 int parm_init_reply(CborEncoder* encoder);
+void plant_pvs_changed();
+void plant_prefault_pvs();
+bool parm_read_only(const char* name);
 int parm_info(const char* parmName);
 int parm_get(const char* parmName);
+int parm_history(const char* parmName, uint32_t nlast, const void* since,
+                    unsigned int n);
+int parm_group(const char* groupName);
+int parm_group_define(const char* groupName);
+int parm_group_add(const char* groupName, const char* pattern);
+int parm_group_share_timestamp(const char* groupName, bool shared);
+int parm_get_if_newer(const char* parmName, const void* t, unsigned int n);
 int parm_set(const char* parmName, CborType type, const void* pvalue,
                     unsigned int count);
 int parm_set_tagged(const char* parmName, CborTag tag, const void* pvalue,
                     unsigned int count);
+int parm_pending();
+int parm_complete_pending(CborEncoder* encoder);
 //int parm_subscribe(const char* parmName);
 
 #endif //DEFINES_H
@@ -0,0 +1,113 @@
+/*``````````````````Shared-memory mirror of PVs`````````````````````````````````
+ * The plant publishes the PV table in a POSIX shared memory object, so local
+ * readers can sample PVs without requests, syscalls or server CPU.
+ * Layout: MIRROR_HEADER, directory of npv MIRROR_ENTRYs, then one
+ * MIRROR_SLOT per PV, followed by its data area of entry.capacity bytes.
+ * Each slot is protected by a sequence lock: the writer makes seq odd while
+ * it is updating the slot, a reader retries if seq was odd or has changed.
+ * This header does not depend on the rest of the plant, readers include
+ * only it.
+ */
+#ifndef MIRROR_H
+#define MIRROR_H
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIRROR_MAGIC "P2PMIRR1"
+#define MIRROR_MAX_DIMENSION 4
+#define MIRROR_ALIGN(n) (((n) + 63) & ~(size_t)63)// slots on separate cache lines
+#define MIRROR_ERROR UINT32_MAX     // of mirror_read(), the slot stays locked
+#define MIRROR_CHECK_SPINS 4096     // spins on a locked slot between checks
+#define MIRROR_MAX_SPINS (1u << 24) // spins on a locked slot before giving up
+
+struct MIRROR_HEADER{
+    char magic[8];
+    uint32_t npv;
+    uint32_t size;      // of the whole shared memory object
+    uint32_t pid;       // of the writer
+    uint32_t reserved;
+};
+struct MIRROR_ENTRY{// static metadata of a PV
+    char name[32];
+    char units[8];
+    uint8_t type;       // VALUETYPE
+    uint8_t reserved;
+    uint16_t fbits;     // FEATURES
+    uint32_t capacity;  // size of the data area
+    uint64_t offset;    // of the MIRROR_SLOT from the beginning of the mirror
+};
+struct MIRROR_SLOT{// dynamic part of a PV
+    uint32_t seq;       // odd while the slot is being written
+    uint32_t nbytes;    // valid bytes in the data area
+    uint32_t t_sec;     // timestamp
+    uint32_t t_nsec;
+    uint32_t shape[MIRROR_MAX_DIMENSION];
+    // data area follows
+};
+
+//``````````````````Reader functions```````````````````````````````````````````
+static inline const MIRROR_HEADER* mirror_open(const char* shm_name){
+    // Map the mirror read-only, return NULL if not published
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 and st.st_size >= (off_t)sizeof(MIRROR_HEADER)){
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);}
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    const MIRROR_HEADER* h = (const MIRROR_HEADER*)map;
+    if (memcmp(h->magic, MIRROR_MAGIC, sizeof(h->magic)) != 0){
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    return h;
+}
+static inline const MIRROR_ENTRY* mirror_entries(const MIRROR_HEADER* h){
+    return (const MIRROR_ENTRY*)(h + 1);
+}
+static inline const MIRROR_ENTRY* mirror_find(const MIRROR_HEADER* h,
+  const char* pvname){
+    const MIRROR_ENTRY* e = mirror_entries(h);
+    for (uint32_t i=0; i < h->npv; i++){
+        if (strncmp(e[i].name, pvname, sizeof(e[i].name)) == 0) return &e[i];
+    }
+    return NULL;
+}
+static inline uint32_t mirror_read(const MIRROR_HEADER* h, const MIRROR_ENTRY* e,
+  void* buf, uint32_t bufsize, MIRROR_SLOT* meta = NULL){
+    /* Copy a consistent value of the PV into buf, return its size in bytes.
+     * If meta is provided, it receives timestamp and shape of the value.
+     * Returns MIRROR_ERROR if the slot stays locked: the writer has died
+     * while updating it or did not finish within MIRROR_MAX_SPINS.
+     */
+    const MIRROR_SLOT* slot = (const MIRROR_SLOT*)((const uint8_t*)h + e->offset);
+    const uint8_t* data = (const uint8_t*)(slot + 1);
+    uint32_t spins = 0;
+    for (;;){
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1){// writer is active
+            if (++spins % MIRROR_CHECK_SPINS == 0){
+                if (spins >= MIRROR_MAX_SPINS
+                  or (kill(h->pid, 0) != 0 and errno == ESRCH)){
+                    return MIRROR_ERROR;}
+                sched_yield();
+            }
+            continue;
+        }
+        uint32_t n = slot->nbytes;
+        if (n > bufsize) n = bufsize;
+        memcpy(buf, data, n);
+        if (meta != NULL) memcpy(meta, slot, sizeof(MIRROR_SLOT));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) return n;
+    }
+}
+#endif //MIRROR_H
@@ -0,0 +1,190 @@
+/*``````````````````Native client of P2Plant```````````````````````````````````
+ * Requests are built by P2Request; several commands and a request id may be
+ * batched in one message. Replies and "Subscription" frames are decoded by
+ * p2c_decode() in a single pass into P2Items, which point into the receive
+ * buffer: names, strings and typed arrays are not copied. Typed arrays
+ * (T_u2ptr, T_i4ptr...) are read through P2Array<T> views, with their shape.
+ * The views are valid until the next message is received.
+ * The transport is a pair of functions in P2Transport, p2c_open_ipc()
+ * provides the IPC one (src/transport_ipc.cpp is its server side).
+ * This header does not depend on the rest of the plant and on TinyCBOR,
+ * clients link only src/p2client.cpp.
+ */
+#ifndef P2CLIENT_H
+#define P2CLIENT_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define P2C_MAX_DIMENSION 4
+#define P2C_REQUEST_SIZE 1500   // receive buffer of the plant
+#define P2C_MESSAGE_SIZE 65536  // initial receive buffer, grows with the replies
+#define P2C_MAX_MESSAGE_SIZE (16*1024*1024)// ENCODER_MAX_SIZE of the plant
+
+//``````````````````Transport``````````````````````````````````````````````````
+struct P2Transport {
+    void* ctx;
+    int (*send)(void* ctx, const uint8_t* msg, size_t len);// 0 on success
+    // Receive a message, wait up to timeout_ms, -1: forever.
+    // Return its length, *msg points to it until the next recv, 0: timeout.
+    int (*recv)(void* ctx, const uint8_t** msg, int timeout_ms);
+    void (*close)(void* ctx);
+};
+int p2c_open_ipc(P2Transport* t, uint8_t plant_id=0);// IPC queues of ftok id 65+plant_id
+void p2c_close(P2Transport* t);
+
+//``````````````````Requests```````````````````````````````````````````````````
+class P2Request {
+  public:
+    uint8_t buf[P2C_REQUEST_SIZE];
+    size_t len = 0;
+    bool overflow = false;// did not fit into buf, send() refuses it
+    bool has_id = false;
+    int64_t request_id = 0;
+
+    P2Request(){clear();}
+    void clear();
+    // Start a command: info, get, set, history or group. Names and values
+    // follow, the command is closed by the next one or by finish().
+    P2Request& command(const char* cmd);
+    P2Request& name(const char* pvname);    // info, get
+    P2Request& set(const char* pvname, int64_t value);
+    P2Request& set(const char* pvname, const char* value);
+    P2Request& set(const char* pvname, const int64_t* values, size_t n);// array
+    P2Request& history(const char* pvname, uint32_t nlast);
+    P2Request& id(int64_t request_id);      // echoed in the reply
+    size_t finish();                        // return the length of the message
+  private:
+    bool in_list = false;
+    bool finished = false;
+    void put_byte(uint8_t b);
+    void put_head(uint8_t major, uint64_t arg);
+    void put_text(const char* s);
+    void close_list();
+};
+
+//``````````````````Replies````````````````````````````````````````````````````
+enum P2C_KIND {
+    P2K_NONE = 0,   // no value, e.g. info
+    P2K_INT,        // i
+    P2K_FLOAT,      // f
+    P2K_TEXT,       // text, text_len
+    P2K_ARRAY,      // typed array: tag, data, nbytes, shape
+    P2K_ERROR,      // text, text_len: the error message
+    P2K_OTHER,      // not decoded, see map
+};
+struct P2Timestamp { uint32_t tv_sec; uint32_t tv_nsec;};
+struct P2Item {// one PV of a reply or a frame
+    const char* name;   // not NUL-terminated
+    uint32_t name_len;
+    const uint8_t* map; // encoded map of the PV, for the keys not decoded
+    size_t map_len;
+    uint8_t kind;       // P2C_KIND of the value "v"
+    uint8_t ndim;
+    int64_t i;
+    double f;
+    const char* text;
+    uint32_t text_len;
+    uint64_t tag;       // of a typed array, RFC 8746
+    const uint8_t* data;
+    uint32_t nbytes;
+    uint32_t shape[P2C_MAX_DIMENSION];
+    const uint8_t* times;// timestamps "t", several in history replies
+    uint32_t ntimes;
+    bool is(const char* aname) const {
+        return strlen(aname) == name_len and memcmp(name, aname, name_len) == 0;
+    }
+    P2Timestamp time(uint32_t index=0) const {
+        P2Timestamp t = {0, 0};
+        if (index < ntimes) memcpy(&t, times + index*sizeof(t), sizeof(t));
+        return t;
+    }
+};
+struct P2Reply {
+    bool subscription;  // a frame of measurements, not a reply
+    bool has_id;
+    int64_t id;
+    const char* error;  // top-level error of the request, e.g. wrong command
+    uint32_t error_len;
+    int nitems;         // decoded into items
+    int nskipped;       // did not fit into items
+};
+// Decode a message into at most capacity items. Return 0, -1 if malformed.
+int p2c_decode(const uint8_t* msg, size_t len, P2Reply* reply, P2Item* items,
+  int capacity);
+const P2Item* p2c_find(const P2Item* items, int nitems, const char* name);
+// Text and integer fields of the map of an item, e.g. "units" of info
+bool p2c_map_text(const P2Item* item, const char* key, const char** text,
+  uint32_t* len);
+bool p2c_map_int(const P2Item* item, const char* key, int64_t* value);
+
+//``````````````````Typed-array views``````````````````````````````````````````
+// RFC 8746 little-endian tags. There is no int8_t view: the plant uses 72,
+// the tag of int8 arrays, for char* values.
+template <typename T> struct P2ArrayTag;
+template <> struct P2ArrayTag<uint8_t>  {static const uint64_t tag = 64;};
+template <> struct P2ArrayTag<uint16_t> {static const uint64_t tag = 69;};
+template <> struct P2ArrayTag<uint32_t> {static const uint64_t tag = 70;};
+template <> struct P2ArrayTag<uint64_t> {static const uint64_t tag = 71;};
+template <> struct P2ArrayTag<int16_t>  {static const uint64_t tag = 77;};
+template <> struct P2ArrayTag<int32_t>  {static const uint64_t tag = 78;};
+template <> struct P2ArrayTag<int64_t>  {static const uint64_t tag = 79;};
+template <> struct P2ArrayTag<float>    {static const uint64_t tag = 85;};
+template <> struct P2ArrayTag<double>   {static const uint64_t tag = 86;};
+
+template <typename T>
+struct P2Array {// view of a typed array in the receive buffer
+    const uint8_t* bytes = NULL;
+    uint32_t count = 0;
+    const uint32_t* shape = NULL;// of ndim dimensions
+    uint8_t ndim = 0;
+
+    explicit operator bool() const {return bytes != NULL;}
+    uint32_t size() const {return count;}
+    T operator[](uint32_t i) const {
+        // The array may be unaligned in the message, memcpy is a plain load
+        T v;
+        memcpy(&v, bytes + i*sizeof(T), sizeof(T));
+        return v;
+    }
+    bool aligned() const {return ((uintptr_t)bytes % alignof(T)) == 0;}
+    const T* data() const {return aligned()? (const T*)bytes: NULL;}
+};
+template <typename T>
+P2Array<T> p2c_array(const P2Item* item){
+    // View of the value of item, empty if it is not an array of T
+    P2Array<T> a;
+    if (item == NULL or item->kind != P2K_ARRAY or item->tag != P2ArrayTag<T>::tag
+      or item->nbytes % sizeof(T) != 0){
+        return a;}
+    a.bytes = item->data;
+    a.count = item->nbytes/sizeof(T);
+    a.shape = item->shape;
+    a.ndim = item->ndim;
+    return a;
+}
+
+//``````````````````Client`````````````````````````````````````````````````````
+class P2Client {
+  public:
+    P2Transport transport = {NULL, NULL, NULL, NULL};
+    P2Reply reply;
+    P2Item* items;
+    int capacity;
+
+    P2Client(P2Item* aitems, int acapacity){items = aitems; capacity = acapacity;}
+    int open_ipc(uint8_t plant_id=0){return p2c_open_ipc(&transport, plant_id);}
+    void close(){p2c_close(&transport);}
+    int send(P2Request* r);
+    // Receive and decode the next message, reply and items are valid until
+    // the next receive. Return its length, 0 on timeout, -1 on error.
+    int receive(int timeout_ms=-1);
+    // Send r and receive messages until its reply, frames and replies with
+    // other ids are skipped
+    int request(P2Request* r, int timeout_ms=-1);
+    const P2Item* find(const char* name) const {
+        return p2c_find(items, reply.nitems, name);}
+    template <typename T>
+    P2Array<T> array(const char* name) const {return p2c_array<T>(find(name));}
+};
+#endif //P2CLIENT_H
@@ -6,10 +6,12 @@
 #define PV_H
 #include "defines.h"
 #include <stdlib.h>
+#include <new>// for placement new
 #include <time.h>
+#include "mirror.h"
+#include "trace.h"
 
 extern uint8_t DBG; //defined in parmain
-extern uint16_t NPV; //defined in firmware part
 
 #if PLATFORM == PLATFORM_STM32
     #include <cstdint>
@@ -44,7 +46,7 @@ uint32_t*   u4ptr;
 };
 
 //CBOR Tag map, it should be enumerated synchronously with the VALUETYPE
-struct CBORTagDType {
+static const struct CBORTagDType {
     uint32_t tag;
     uint8_t valueType;
     char    txt[8];
@@ -79,26 +81,29 @@ enum FEATURES {// feature bits like in ADO architecture
     F_W = 0x0001, //writable
     F_R = 0x0002, //readable
     F_D = 0x0004, //discrete.   Not used, PV is discrete if it has legal values.
-    F_A = 0x0008, //archivable. Not used
+    F_A = 0x0008, //archivable, streamed measurements are appended to archive
     F_C = 0x0010, //config
     F_I = 0x0020, //diagnostic
-    F_s = 0x0040, //savable.    Not used yet.
-    F_r = 0x0080, //restorable. Not used yet.
+    F_s = 0x0040, //savable, saved to snapshot file
+    F_r = 0x0080, //restorable, restored from snapshot file at startup
     F_E = 0x0100, //editable
-    F_M = (0x0200 | F_R), //Continuous measurements
+    F_Mbit = 0x0200, //the bit of F_M, clear it to stop streaming of a readable PV
+    F_M = (F_Mbit | F_R), //Continuous measurements
 };
-char FEATURE_LETTERS[] = "WRDACIsrEM";
+static const char FEATURE_LETTERS[] = "WRDACIsrEM";
 
 #define F_WE  (F_R | F_W | F_E | F_s | F_r)
 #define F_WED (F_R | F_W | F_E | F_s | F_r | F_D )
 #define F_WEI (F_R | F_W | F_E | F_I)
 #define F_RI  (F_R | F_I)
 
-CborEncoder* pRootEncoder;
 void encode_error(CborEncoder* encoder, const char* key, const char* value){
     /* Encode one map entry to root_encoder map.
      * This is main function to report an error by sreaming it to client.
+     * Without encoder, e.g. at snapshot restore, there is no one to reply.
      */
+    if (encoder == NULL){
+        return;}
     cbor_encode_text_stringz(encoder, key);
     CborEncoder amap;
     cbor_encoder_create_map(encoder, &amap, 1);
@@ -118,7 +123,6 @@ void encode_shape(CborEncoder* encoder, uint32_t* shape){
 }
 void encode_taggedBuffer(CborEncoder* encoder, uint32_t tag, 
         const void* byteString, int n){
-    if(DBG>=2) printf(">tagged buffer %i %i\n", tag, n);
     cbor_encode_tag(encoder, (CborTag)tag);
     cbor_encode_byte_string(encoder, (const uint8_t*) byteString, n);
 }
@@ -134,6 +138,7 @@ void encode_ndarray(CborEncoder* encoder, void* arr, uint type, uint32_t* shape)
     encode_shape(encoder, shape);
     cbor_encode_text_stringz(encoder, "v");
     switch (type){
+    case T_Bptr: break;
     case T_u2ptr:
     case T_i2ptr:{ n *= 2; break;} 
     case T_u4ptr:
@@ -142,27 +147,97 @@ void encode_ndarray(CborEncoder* encoder, void* arr, uint type, uint32_t* shape)
     }
     encode_taggedBuffer(encoder, tagTxt[type].tag, (uint8_t*)arr, n);
 }
+//``````````````````History of values``````````````````````````````````````````
+/* Optional ring of the last values and their timestamps. Each record is
+ * written twice, at i and i+depth, so that any run of the last records is
+ * contiguous and can be encoded as a typed array without copying.
+ * Scalars are stored as one-element arrays, T_b is widened to int16.
+ */
+struct PVHistory {
+    uint32_t depth;     // capacity in records
+    uint32_t count;     // number of valid records, <= depth
+    uint32_t head;      // index of the next record
+    uint32_t itemsize;  // bytes per record
+    uint8_t arraytype;  // VALUETYPE of the stored elements
+    uint8_t* values;    // [2*depth*itemsize]
+    TD_timestamp* times;// [2*depth]
+};
+static uint8_t history_type(uint8_t type){
+    switch (type){
+    case T_b:
+    case T_i2:  return T_i2ptr;
+    case T_B:   return T_Bptr;
+    case T_u2:  return T_u2ptr;
+    case T_i4:  return T_i4ptr;
+    case T_u4:  return T_u4ptr;
+    case T_str: return T_str;// not supported
+    default:    return type;
+    }
+}
+static uint element_size(uint8_t type){
+    switch (type){
+    case T_Bptr: return 1;
+    case T_u2ptr:
+    case T_i2ptr:return 2;
+    default:     return 4;
+    }
+}
+
+//``````````````````Asynchronous setters```````````````````````````````````````
+// A setter may return SETTER_PENDING and finish later, in another thread,
+// by calling PV::setter_done(). The reply is then sent by
+// plant_deliver_completions() from the main loop. At most
+// MAX_PENDING_SETTERS may be pending, while all slots are taken, sets of PVs,
+// whose setter has gone asynchronous before, are refused with "Too many
+// pending setters". A setter, which goes asynchronous for the first time
+// while all slots are taken, is waited for. Synchronous setters are not
+// affected.
+// The value is stored before the setter runs. If the setter fails,
+// setter_done(status != 0), the client gets "Setter failed", but the value
+// is not rolled back, the setter should restore it if needed.
+#define SETTER_PENDING (-1)
+enum ASYNC_STATE {
+    ASYNC_IDLE = 0,
+    ASYNC_PENDING = 1,
+    ASYNC_DONE = 2,
+};
+static bool register_pending_setter(PV* pv);
 
 class PV { // Parameter object
   public:
-	char name[32];
-	char desc[128];
+    // Hot attributes, used by each encoding of the value, share a cache line
 	uint8_t type;   // VALUETYPE
+	uint16_t fbits; // FEATURES, change them by set_features()
+    uint32_t seq = 0;// odd while the value is being modified, see write_begin()
+	VALUE value;
+    TD_timestamp timestamp = {0, 0};// seconds, nanoseconds
     uint32_t shape[MAX_DIMENSION] = {1,0,0,0};   // shape of the parameter value array
+    int (*getter)() = NULL; //Called before the value is encoded
+    CborError (*encode_value)(PV* pv, CborEncoder* map) = NULL;// of typed PVs
+    int (*set_value)(PV* pv, int64_t v) = NULL;// integer sets of typed PVs
+    MIRROR_SLOT* mirror_slot = NULL;// slot in shared-memory mirror
+    // Cold attributes
+	char name[32];
+	char desc[128];
     uint32_t bufsize = 0; //for writable parameter it is size of the bytestring 
-	uint16_t fbits; // FEATURES
+    void* storage = NULL;// of plant_array_alloc(), owned by reshape()
 	char units[8];  // Units
 	int32_t opLow;  // Lower limit of the value 
 	int32_t opHigh; // High limit of the value
 	char *legalValues;
-	VALUE value;
-    TD_timestamp timestamp = {0, 0};// seconds, nanoseconds
     bool subscribed = false;
     int (*setter)() = NULL; //Setter function
+    uint8_t async_state = ASYNC_IDLE;// ASYNC_STATE, shared with setter thread
+    int async_status = 0;// status passed to setter_done()
+    bool setter_async = false;// the setter has returned SETTER_PENDING
+    uint32_t history_depth = 0;// number of values kept in history
+    PVHistory* history = NULL;
+    uint32_t mirror_capacity = 0;
 
 	PV(const char *aname, const char *adesc, const uint8_t atype,
 			const uint16_t afbits = F_R, const char *aunits = "",
-			int32_t aopLow = MinI32, int32_t aopHi = MaxI32, char *lv = NULL){
+			int32_t aopLow = MinI32, int32_t aopHi = MaxI32, char *lv = NULL,
+            uint32_t ahistory = 0){
 		value.u4 = 0;
         strncpy(name, aname, 16);
 		strncpy(desc, adesc, 128);
@@ -174,6 +249,9 @@ class PV { // Parameter object
 			opLow = 0;
 		opHigh = aopHi;
 		legalValues = lv;
+        history_depth = ahistory;
+        if (type < T_Bptr){// arrays allocate it when their shape is set
+            history_alloc();}
         
         // initiate timestamp
         struct timespec tim;
@@ -182,33 +260,347 @@ class PV { // Parameter object
         timestamp.tv_nsec = tim.tv_nsec;
         //printf("t of %s: %li, %li\n",name, tim.tv_sec, tim.tv_nsec);
 	};
+    void set_features(uint16_t afbits){
+        // The index of the PV table keeps features, e.g. the list of F_M PVs,
+        // a direct write of fbits would not be seen by the scans
+        if (afbits != fbits){
+            fbits = afbits;
+            plant_pvs_changed();
+        }
+    }
+    void update_timestamp(const struct timespec* ts = NULL){
+        // Stamp the value with ts or, if not provided, with current time
+        struct timespec tim;
+        if (ts == NULL){
+            clock_gettime(CLOCK_REALTIME, &tim);
+            ts = &tim;
+        }
+        write_begin();
+        timestamp.tv_sec = ts->tv_sec;
+        timestamp.tv_nsec = ts->tv_nsec;
+        if (history_depth != 0){
+            record_history();}
+        write_end();
+        if (fbits & F_s){
+            plant->snapshot_dirty = true;}
+        if (mirror_slot != NULL){
+            publish_mirror();}
+    }
+    void publish_mirror(){
+        // Copy value into the shared-memory slot under its sequence lock
+        const void* data = (type >= T_str)? (const void*)value.Bptr: &value;
+        uint32_t n = value_nbytes();
+        uint32_t mshape[MAX_DIMENSION];
+        memcpy(mshape, shape, sizeof(mshape));
+        if (n > mirror_capacity){
+            // The slot keeps the size of plant_mirror_init(), a grown array
+            // is truncated to the records of its first axis, which fit, or,
+            // if none fits, to a flat array; the shape follows
+            n = mirror_capacity;
+            if (type >= T_Bptr){
+                uint32_t record = value_nbytes()/shape[0];
+                if (n >= record){
+                    mshape[0] = n/record;
+                    n = mshape[0]*record;
+                }else{
+                    mshape[0] = n/element_size(type);
+                    mshape[1] = mshape[2] = mshape[3] = 0;
+                    n = mshape[0]*element_size(type);
+                }
+            }
+        }
+        uint32_t mseq = mirror_slot->seq;
+        __atomic_store_n(&mirror_slot->seq, mseq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (n != 0){
+            memcpy(mirror_slot + 1, data, n);
+            if (type == T_str){// keep it terminated if truncated
+                ((char*)(mirror_slot + 1))[n-1] = 0;}
+        }
+        mirror_slot->nbytes = n;
+        mirror_slot->t_sec = timestamp.tv_sec;
+        mirror_slot->t_nsec = timestamp.tv_nsec;
+        memcpy(mirror_slot->shape, mshape, sizeof(mirror_slot->shape));
+        __atomic_store_n(&mirror_slot->seq, mseq + 2, __ATOMIC_RELEASE);
+    }
+    /* Values are modified only by the thread, which runs the plant, but they
+     * may be read concurrently by workers. The writer calls write_begin()
+     * before it modifies the value in place, update_timestamp() ends the
+     * modification. Readers retry if the sequence was odd or has changed.
+     */
+    void write_begin(){
+        __atomic_store_n(&seq, seq | 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    void write_end(){
+        __atomic_store_n(&seq, (seq | 1) + 1, __ATOMIC_RELEASE);
+    }
+    uint32_t read_begin(){
+        uint32_t s;
+        while ((s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE)) & 1);
+        return s;
+    }
+    bool read_retry(uint32_t s){
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&seq, __ATOMIC_RELAXED) != s;
+    }
+    uint value_nbytes(){
+        // Size of the value data, for array PVs it is the size of the array
+        if (type == T_str){
+            return value.str == NULL? 0: strlen(value.str) + 1;}
+        if (type >= T_Bptr){
+            return element_size(type)*array_length(shape);}
+        return sizeof(value);
+    }
+    uint history_itemsize(uint32_t* ashape = NULL){
+        // Bytes of a history record of the value of shape ashape, or of the
+        // current shape
+        uint8_t htype = history_type(type);
+        uint itemsize = element_size(htype);
+        if (htype == type){// array PV
+            itemsize *= array_length(ashape != NULL? ashape: shape);}
+        return itemsize;
+    }
+    int history_alloc(){
+        /* Allocate the history ring for the current shape, if it is kept and
+         * does not fit yet. It is done when the PV is created or its shape
+         * is set, not on the acquisition path. A new ring replaces the old
+         * one, which is retired, workers may still read it.
+         * Returns 1 if there is no memory, the history is not recorded then.
+         */
+        uint8_t htype = history_type(type);
+        uint itemsize = history_itemsize();
+        if (history_depth == 0 or htype == T_str
+          or (history != NULL and history->itemsize == itemsize)){
+            return 0;}
+        PVHistory* h = (PVHistory*) calloc(1, sizeof(PVHistory));
+        if (h != NULL){
+            h->values = (uint8_t*) malloc(2*history_depth*itemsize);
+            h->times = (TD_timestamp*) malloc(2*history_depth*sizeof(TD_timestamp));
+        }
+        if (h == NULL or h->values == NULL or h->times == NULL){
+            printf("ERR_P2P: no memory for history of %s\n", name);
+            if (h != NULL){
+                free(h->values);
+                free(h->times);
+                free(h);
+            }
+            return 1;
+        }
+        h->depth = history_depth;
+        h->itemsize = itemsize;
+        h->arraytype = htype;
+        PVHistory* old = history;
+        __atomic_store_n(&history, h, __ATOMIC_RELEASE);
+        if (old != NULL){
+            plant_retire(old->values);
+            plant_retire(old->times);
+            plant_retire(old);
+        }
+        return 0;
+    }
+    void record_history(){
+        // Append current value and timestamp to the history ring
+        const void* src = &value;
+        uint8_t htype = history_type(type);
+        uint itemsize = history_itemsize();
+        if (htype == T_str){
+            return;}
+        if (htype == type){// array PV
+            if (value.Bptr == NULL) return;
+            src = value.Bptr;
+        }
+        int16_t widened = value.b;
+        if (type == T_b){
+            src = &widened;}
+        if (history == NULL or history->itemsize != itemsize){
+            // the shape was written directly or the allocation has failed
+            if (history_alloc()) return;
+        }
+        PVHistory* h = history;
+        uint32_t i = h->head;
+        memcpy(h->values + i*itemsize, src, itemsize);
+        memcpy(h->values + (i + h->depth)*itemsize, src, itemsize);
+        h->times[i] = timestamp;
+        h->times[i + h->depth] = timestamp;
+        h->head = (i + 1 == h->depth)? 0: i + 1;
+        if (h->count < h->depth) h->count++;
+    }
+    CborError history2cbor(CborEncoder *pencoder, uint32_t nlast,
+      const TD_timestamp* since = NULL){
+        /* Encode the last nlast records of history, or those newer than
+         * since, as typed arrays of values "v" and timestamps "t".
+         */
+        CborEncoder saved = *pencoder;
+        for (;;){// re-encode if the writer has modified the PV meanwhile
+            uint32_t s = read_begin();
+            CborError err = _history2cbor(pencoder, nlast, since);
+            if (not read_retry(s)) return err;
+            *pencoder = saved;
+        }
+    }
+    CborError _history2cbor(CborEncoder *pencoder, uint32_t nlast,
+      const TD_timestamp* since){
+        CborEncoder map_values;
+        // The ring and the shape are read once: the writer may replace the
+        // ring, the old one stays readable until the retry, see record_history()
+        PVHistory* h = __atomic_load_n(&history, __ATOMIC_ACQUIRE);
+        if (h == NULL){
+            encode_error(pencoder, name, "No history");
+            return CborNoError;
+        }
+        uint32_t shape[MAX_DIMENSION];
+        memcpy(shape, this->shape, sizeof(shape));
+        uint32_t n = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        uint32_t head = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+        if (nlast < n) n = nlast;
+        if (h->itemsize != history_itemsize(shape)){// reshaped since last record
+            n = 0;}
+        // first record of the window, the window is contiguous in the ring
+        uint32_t first = head + h->depth - n;
+        if (since != NULL){
+            // timestamps are increasing, find the first record newer than since
+            uint32_t lo = first, hi = first + n;
+            while (lo < hi){
+                uint32_t mid = (lo + hi)/2;
+                const TD_timestamp* t = &h->times[mid];
+                if (t->tv_sec > since->tv_sec or
+                  (t->tv_sec == since->tv_sec and t->tv_nsec > since->tv_nsec)){
+                    hi = mid;
+                }else{
+                    lo = mid + 1;}
+            }
+            n -= lo - first;
+            first = lo;
+        }
+        uint32_t hshape[MAX_DIMENSION] = {n, 0, 0, 0};
+        if (history_type(type) == type){// array PV, prepend the history axis
+            for (int ii=0; ii<MAX_DIMENSION-1 and shape[ii] > 0; ii++){
+                hshape[ii+1] = shape[ii];}
+            if (shape[MAX_DIMENSION-1] > 0){// no room, flatten
+                hshape[1] = array_length(shape);
+                hshape[2] = hshape[3] = 0;
+            }
+        }
+        cbor_encode_text_stringz(pencoder, name);
+        cbor_encoder_create_map(pencoder, &map_values, CborIndefiniteLength);
+        if (n == 0){
+            cbor_encode_text_stringz(&map_values, "shape");
+            CborEncoder empty;
+            cbor_encoder_create_array(&map_values, &empty, 1);
+            cbor_encode_uint(&empty, 0);
+            cbor_encoder_close_container(&map_values, &empty);
+        }else{
+            encode_ndarray(&map_values, h->values + first*h->itemsize,
+              h->arraytype, hshape);
+        }
+        cbor_encode_text_stringz(&map_values, "t");
+        encode_taggedBuffer(&map_values, tagTxt[T_u4ptr].tag, &h->times[first],
+          n*sizeof(TD_timestamp));
+        cbor_encoder_close_container(pencoder, &map_values);
+        return CborNoError;
+    }
+    bool is_newer(const TD_timestamp* t){
+        return timestamp.tv_sec > t->tv_sec or
+          (timestamp.tv_sec == t->tv_sec and timestamp.tv_nsec > t->tv_nsec);
+    }
     void set_shape(uint x, uint y=0, uint z=0, uint v=0){
         shape[0] = x; shape[1] = y; shape[2] = z; shape[3] = v;
+        history_alloc();
+    }
+    int reshape(uint x, uint y=0, uint z=0, uint v=0){
+        /* Change the shape of an array PV at runtime. The value is moved into
+         * storage of the array pool, sized for the new shape; the storage
+         * is replaced only if it is too small or four times too large.
+         * Leading elements are kept, in the flat order, the new ones are zero.
+         * The shape, bufsize and the value change together for readers.
+         * Should be called by the thread, which runs the plant.
+         * Returns 1 if it is not an array PV, if it is a typed ArrayPV,
+         * whose shape is fixed at compile time, or if there is no memory.
+         */
+        uint32_t nshape[MAX_DIMENSION] = {x, y, z, v};
+        if (type < T_Bptr or x == 0 or encode_value != NULL){
+            return 1;}
+        uint32_t nbytes = element_size(type)*array_length(nshape);
+        uint32_t oldbytes = value.Bptr != NULL? value_nbytes(): 0;
+        uint32_t keep = oldbytes < nbytes? oldbytes: nbytes;
+        void* old = storage;
+        uint8_t* data = (uint8_t*) storage;
+        if (data == NULL or nbytes > plant_array_capacity(data)
+          or nbytes < plant_array_capacity(data)/4){
+            data = (uint8_t*) plant_array_alloc(nbytes);
+            if (data == NULL){
+                return 1;}
+            if (keep != 0){
+                memcpy(data, value.Bptr, keep);}
+        }else if ((uint8_t*)value.Bptr != data and keep != 0){
+            memmove(data, value.Bptr, keep);}
+        write_begin();
+        memset(data + keep, 0, nbytes - keep);
+        storage = data;
+        value.Bptr = (TD_Bptr)data;
+        set_shape(x, y, z, v);
+        bufsize = nbytes;
+        update_timestamp();
+        if (old != data){
+            plant_array_free(old);}
+        return 0;
     }
     int _call_setter(){
         int r = 0;
+        update_timestamp();
         if (setter != NULL){
+            __atomic_store_n(&async_state, ASYNC_PENDING, __ATOMIC_RELEASE);
+            TRACE(TR_SETTER, 0, trace_tag(name));
             r = (*setter)();
+            TRACE(TR_SETTER_DONE, r, trace_tag(name));
+            if (r == SETTER_PENDING){
+                setter_async = true;
+                if (plant->npending < MAX_PENDING_SETTERS){
+                    register_pending_setter(this);
+                    return 0;
+                }
+                // Could not be tracked, complete it here
+                struct timespec pause = {0, 100000};
+                while (__atomic_load_n(&async_state, __ATOMIC_ACQUIRE) != ASYNC_DONE){
+                    nanosleep(&pause, NULL);}
+                r = 0;
+                if (async_status == 0){
+                    update_timestamp();
+                }else if (session->reply_encoder != NULL){
+                    encode_error(session->reply_encoder, name, "Setter failed");}
+            }
+            __atomic_store_n(&async_state, ASYNC_IDLE, __ATOMIC_RELEASE);
         }
         return r;
     }
+    bool setter_pending(){
+        return __atomic_load_n(&async_state, __ATOMIC_ACQUIRE) != ASYNC_IDLE;
+    }
+    void setter_done(int status = 0){
+        // Complete a pending setter, can be called from any thread
+        async_status = status;
+        __atomic_store_n(&async_state, ASYNC_DONE, __ATOMIC_RELEASE);
+    }
     int set(int vv) {
         VALUE v;
         v.i4 = vv;
         //printf("setting int %s=%i\n",name,v.i4);
 		if(type == T_u4){
-			if((TD_u4)opLow > v.u4 or v.u4 > (TD_u4)opHigh){
-                encode_error(pRootEncoder, name, "Off limit setting");
-				return 1;
+			if((TD_u4)opLow > v.u4 or (opHigh != MaxI32 and v.u4 > (TD_u4)opHigh)){
+                encode_error(session->reply_encoder, name, "Off limit setting");
+				return 0;// replied, not a failure of the plant
             }
+            write_begin();
 			value.u4 = v.u4;
 			return _call_setter();
 		}
 		if(opLow > v.i4 or v.i4 > opHigh){
-            encode_error(pRootEncoder, name, "Off limit setting");
-			return 1;
+            encode_error(session->reply_encoder, name, "Off limit setting");
+			return 0;
         }
         //printf("type %i\n",type); 
+        write_begin();
 		switch (type){
 		case T_b: 	{value.b = v.b; break;}
 		case T_B:	{value.B = v.B; break;}
@@ -219,22 +611,30 @@ class PV { // Parameter object
 		return _call_setter();
 	}
     int set(const char* str){
-        if(DBG>=1)printf(">set_str %s[%li] %s\n", name, strlen(str), str);
         assert(type == T_str);
         if(legalValues != NULL){
             if(strstr(legalValues, str) == NULL) {
-                encode_error(pRootEncoder, name, "Illegal value");
+                encode_error(session->reply_encoder, name, "Illegal value");
                 return 0;
             }}
-        if (value.str != NULL){
-            free(value.str);}
+        // Strings are kept in the array pool, whose free blocks are reused,
+        // so steady-state sets do not allocate
         uint n = strlen(str)+1;
-        value.str = (char *) malloc(n);
-        strncpy(value.str, str, n);
+        char* old = value.str;
+        char* s = (char *) plant_array_alloc(n);
+        if (s == NULL){
+            encode_error(session->reply_encoder, name, "No memory for the value");
+            return 0;
+        }
+        memcpy(s, str, n);
+        write_begin();
+        __atomic_store_n(&value.str, s, __ATOMIC_RELEASE);
+        if (old != NULL){
+            plant_array_free(old);}// retired, workers may still read it
         return _call_setter();
 	}
     int set_ptr(void* pvalue){
-        if(DBG>=1)printf("setting ptr* %s, shape (%i,%i,%i,%i)\n", name, shape[0], shape[1], shape[2], shape[3]);
+        write_begin();
         value.Bptr = (TD_Bptr)pvalue;
         return _call_setter();
     }
@@ -258,10 +658,6 @@ class PV { // Parameter object
         return set_ptr(pvalue);
     }
     int set_tagged(CborTag tag, const void* buf, uint nbytes){
-        if(DBG>=1){
-            printf(">parm_set_tagged %s, %li, %i:\n", name, tag, nbytes);
-            dumpbytes((const uint8_t*)buf, nbytes);  printf("\n");
-        }
         uint itype = 0;
         for (; tagTxt[itype].tag != tag; itype++);
         assert(itype == tagTxt[itype].valueType);// just checking
@@ -273,9 +669,11 @@ class PV { // Parameter object
         case T_u4ptr:
         {
             if(nbytes > bufsize){
-                encode_error(pRootEncoder, name, "Value size is too large");
+                encode_error(session->reply_encoder, name, "Value size is too large");
                 return 0;}
+            write_begin();
             memcpy(value.Bptr, buf, nbytes);
+            update_timestamp();
             break;
         }
         default:
@@ -283,14 +681,83 @@ class PV { // Parameter object
         }
         return 0;
     }
-    CborError val2cbor(CborEncoder *pencoder){
-        if(DBG>=2)printf(">val2cbor\n");
+    int set_array(const int64_t* vals, uint count){
+        /* Set array PV from a list of integers. The list is checked against
+         * the range of the element type and opLow/opHigh before anything is
+         * copied, so the PV is either fully updated or left untouched.
+         */
+        int64_t lo, hi;
+        uint itemsize;
+        switch (type){
+        case T_Bptr: {lo = 0;          hi = UINT8_MAX;  itemsize = 1; break;}
+        case T_u2ptr:{lo = 0;          hi = UINT16_MAX; itemsize = 2; break;}
+        case T_i2ptr:{lo = INT16_MIN;  hi = INT16_MAX;  itemsize = 2; break;}
+        case T_u4ptr:{lo = 0;          hi = UINT32_MAX; itemsize = 4; break;}
+        case T_i4ptr:{lo = INT32_MIN;  hi = INT32_MAX;  itemsize = 4; break;}
+        default:
+            encode_error(session->reply_encoder, name, "Not an array PV");
+            return 0;
+        }
+        if(opLow != MinI32 and opLow > lo) lo = opLow;
+        if(opHigh != MaxI32 and opHigh < hi) hi = opHigh;
+        if(count*itemsize > bufsize){
+            encode_error(session->reply_encoder, name, "Value size is too large");
+            return 0;}
+        int64_t vmin, vmax;
+        minmax_i64(vals, count, &vmin, &vmax);
+        if(vmin < lo or vmax > hi){
+            uint ii = 0;
+            for (; ii<count; ii++){
+                if(vals[ii] < lo or vals[ii] > hi) break;}
+            char msg[48];
+            snprintf(msg, sizeof(msg), "Off limit setting at index %u", ii);
+            encode_error(session->reply_encoder, name, msg);
+            return 0;
+        }
+        // Narrow to the element type
+        write_begin();
+        switch (type){
+        case T_Bptr: {for (uint ii=0; ii<count; ii++) value.Bptr[ii] = vals[ii]; break;}
+        case T_u2ptr:{for (uint ii=0; ii<count; ii++) value.u2ptr[ii] = vals[ii]; break;}
+        case T_i2ptr:{for (uint ii=0; ii<count; ii++) value.i2ptr[ii] = vals[ii]; break;}
+        case T_u4ptr:{for (uint ii=0; ii<count; ii++) value.u4ptr[ii] = vals[ii]; break;}
+        case T_i4ptr:{for (uint ii=0; ii<count; ii++) value.i4ptr[ii] = vals[ii]; break;}
+        }
+        return _call_setter();
+    }
+    void array_value(void** data, uint32_t* ashape){
+        /* Pointer and shape of the array value, which belong together: a
+         * reader must not combine the block of one value with the shape of
+         * another, see reshape(). The block stays readable until the retry
+         * of the caller, it is retired when replaced.
+         */
+        for (;;){
+            uint32_t s = read_begin();
+            *data = __atomic_load_n(&value.Bptr, __ATOMIC_RELAXED);
+            memcpy(ashape, shape, sizeof(shape));
+            if (not read_retry(s)) return;
+        }
+    }
+    CborError val2cbor(CborEncoder *pencoder, bool with_timestamp = true){
+        if (getter != NULL){
+            (*getter)();}
+        CborEncoder saved = *pencoder;
+        for (;;){// re-encode if the writer has modified the PV meanwhile
+            uint32_t s = read_begin();
+            CborError err = _val2cbor(pencoder, with_timestamp);
+            if (not read_retry(s)) return err;
+            *pencoder = saved;
+        }
+    }
+    CborError _val2cbor(CborEncoder *pencoder, bool with_timestamp){
         CborEncoder map_values;
         CborError r;
         r = cbor_encode_text_stringz(pencoder, name);
-        assert(r==CborNoError);
+        assert(r==CborNoError or r==CborErrorOutOfMemory);// sizing encoder has no buffer
         cbor_encoder_create_map(pencoder, &map_values, CborIndefiniteLength);
-        switch (type){
+        if (encode_value != NULL){// typed PV, resolved at compile time
+            (*encode_value)(this, &map_values);
+        }else switch (type){
         case T_b:   {
             cbor_encode_text_stringz(&map_values, "v");
             cbor_encode_int(&map_values, value.b);
@@ -330,27 +797,34 @@ class PV { // Parameter object
                 return CborNoError;
             }
             cbor_encode_text_stringz(&map_values, "v");
-            r = cbor_encode_text_stringz(&map_values, value.str);
-            assert(r==CborNoError);
+            r = cbor_encode_text_stringz(&map_values,
+              __atomic_load_n(&value.str, __ATOMIC_ACQUIRE));
+            assert(r==CborNoError or r==CborErrorOutOfMemory);
             break;
         }case T_i2ptr:
         case T_u2ptr:{
-            if (value.i4 == 0){
+            void* data;
+            uint32_t ashape[MAX_DIMENSION];
+            array_value(&data, ashape);
+            if (data == NULL){
                 cbor_encoder_close_container(pencoder, &map_values);
                 encode_error(pencoder, name, "PV_i2ptr was not initialized");
                 return CborNoError;
             }            
             //printf("encode_uint16Array %s\n", name);
-            encode_ndarray(&map_values, value.u2ptr, type, shape);
+            encode_ndarray(&map_values, data, type, ashape);
             break;
         }case T_i4ptr:
         case T_u4ptr:{
-            if (value.i4 == 0){
+            void* data;
+            uint32_t ashape[MAX_DIMENSION];
+            array_value(&data, ashape);
+            if (data == NULL){
                 cbor_encoder_close_container(pencoder, &map_values);
                 encode_error(pencoder, name, "PV_i4ptr was not initialized");
                 return CborNoError;
             }
-            encode_ndarray(&map_values, value.u4ptr, type, shape);
+            encode_ndarray(&map_values, data, type, ashape);
             break;
         }default: {
             //printf("ERR in val2cbor %s\n", name);
@@ -359,7 +833,8 @@ class PV { // Parameter object
             return CborNoError;
         }
         }
-        encode_timestamp(&map_values, &timestamp);
+        if (with_timestamp){
+            encode_timestamp(&map_values, &timestamp);}
         cbor_encoder_close_container(pencoder, &map_values);
         return CborNoError;
     }
@@ -370,7 +845,7 @@ class PV { // Parameter object
         char *fbitsPtr = fbitString;
         r = cbor_encode_text_stringz(pencoder, name);
         //printf("info2cbor r=%i, %i\n", (int)r, (int) CborNoError);
-        assert(r==CborNoError);
+        assert(r==CborNoError or r==CborErrorOutOfMemory);// see encoder_retry()
         cbor_encoder_create_map(pencoder, &map_values, CborIndefiniteLength);
         cbor_encode_text_stringz(&map_values, "desc");
         cbor_encode_text_stringz(&map_values, desc);
@@ -410,111 +885,1130 @@ class PV { // Parameter object
         return CborNoError;
     }
 };
+//``````````````````Typed PVs``````````````````````````````````````````````````
+/* ScalarPV<T> and ArrayPV<T, Dims...> are PVs, which element type, CBOR tag,
+ * limit checks and encoding are resolved at compile time. They are served
+ * like any other PV, but encode their value without switching on the type,
+ * and have typed set(). Unsupported element types do not compile.
+ */
+template<typename T> struct ValueTraits;// defined for supported types only
+template<> struct ValueTraits<int8_t>{
+    static const uint8_t type = T_b;
+    static int8_t& ref(VALUE& v){return v.b;}
+};
+template<> struct ValueTraits<uint8_t>{
+    static const uint8_t type = T_B;
+    static const uint8_t array_type = T_Bptr;
+    static uint8_t& ref(VALUE& v){return v.B;}
+};
+template<> struct ValueTraits<int16_t>{
+    static const uint8_t type = T_i2;
+    static const uint8_t array_type = T_i2ptr;
+    static int16_t& ref(VALUE& v){return v.i2;}
+};
+template<> struct ValueTraits<uint16_t>{
+    static const uint8_t type = T_u2;
+    static const uint8_t array_type = T_u2ptr;
+    static uint16_t& ref(VALUE& v){return v.u2;}
+};
+template<> struct ValueTraits<int32_t>{
+    static const uint8_t type = T_i4;
+    static const uint8_t array_type = T_i4ptr;
+    static int32_t& ref(VALUE& v){return v.i4;}
+};
+template<> struct ValueTraits<uint32_t>{
+    static const uint8_t type = T_u4;
+    static const uint8_t array_type = T_u4ptr;
+    static uint32_t& ref(VALUE& v){return v.u4;}
+};
+template<typename T> class ScalarPV : public PV {
+  public:
+    ScalarPV(const char *aname, const char *adesc, const uint16_t afbits = F_R,
+      const char *aunits = "", int32_t aopLow = MinI32, int32_t aopHi = MaxI32,
+      char *lv = NULL, uint32_t ahistory = 0):
+      PV(aname, adesc, ValueTraits<T>::type, afbits, aunits, aopLow, aopHi, lv,
+      ahistory){
+        encode_value = &encode;
+        set_value = &set_int;
+    }
+    T get(){
+        return ValueTraits<T>::ref(value);
+    }
+    int set(T v){
+        return set_checked(v);
+    }
+    int set_checked(int64_t v){
+        // MinI32 and MaxI32 are no limits, e.g. of uint32 values above MaxI32,
+        // values out of the range of T are off limit
+        if ((opLow != MinI32 and v < opLow) or (opHigh != MaxI32 and v > opHigh)
+          or v != (int64_t)(T)v){
+            encode_error(session->reply_encoder, name, "Off limit setting");
+            return 0;// replied, not a failure of the plant
+        }
+        write_begin();
+        ValueTraits<T>::ref(value) = (T)v;
+        return _call_setter();
+    }
+    static int set_int(PV* pv, int64_t v){// sets of the protocol, see parm_set()
+        return ((ScalarPV<T>*)pv)->set_checked(v);
+    }
+    static CborError encode(PV* pv, CborEncoder* map){
+        cbor_encode_text_stringz(map, "v");
+        T v = ValueTraits<T>::ref(pv->value);
+        if (T(-1) < T(0)){// signed, folded at compile time
+            return cbor_encode_int(map, v);}
+        return cbor_encode_uint(map, v);
+    }
+};
+static constexpr uint32_t dims_product(){return 1;}
+template<typename... Rest>
+static constexpr uint32_t dims_product(uint32_t first, Rest... rest){
+    return first*dims_product(rest...);
+}
+template<typename T, uint32_t... Dims> class ArrayPV : public PV {
+    static_assert(sizeof...(Dims) >= 1 and sizeof...(Dims) <= MAX_DIMENSION,
+      "ArrayPV needs 1 to MAX_DIMENSION dimensions");
+  public:
+    static constexpr uint32_t count = dims_product(Dims...);
+    static constexpr uint32_t nbytes = count*sizeof(T);
+    T data[count];// the value, unless set() points it elsewhere
+
+    ArrayPV(const char *aname, const char *adesc, const uint16_t afbits = F_R,
+      const char *aunits = "", int32_t aopLow = MinI32, int32_t aopHi = MaxI32,
+      char *lv = NULL, uint32_t ahistory = 0):
+      PV(aname, adesc, ValueTraits<T>::array_type, afbits, aunits, aopLow,
+      aopHi, lv, ahistory){
+        const uint32_t dims[] = {Dims...};
+        for (uint ii=0; ii<MAX_DIMENSION; ii++){
+            shape[ii] = ii < sizeof...(Dims)? dims[ii]: 0;}
+        memset(data, 0, sizeof(data));
+        value.Bptr = (TD_Bptr)data;
+        bufsize = nbytes;
+        encode_value = &encode;
+        history_alloc();
+    }
+    T* get(){
+        return (T*)value.Bptr;
+    }
+    int set(T* pvalue){
+        // Serve the array at pvalue, it must have the shape of the PV
+        return set_ptr(pvalue);
+    }
+    static CborError encode(PV* pv, CborEncoder* map){
+        static const uint32_t static_shape[MAX_DIMENSION] = {Dims...};
+        encode_shape(map, (uint32_t*)static_shape);
+        cbor_encode_text_stringz(map, "v");
+        cbor_encode_tag(map, (CborTag)tagTxt[ValueTraits<T>::array_type].tag);
+        return cbor_encode_byte_string(map, pv->value.Bptr, nbytes);
+    }
+};
 //``````````````````Parameter handling`````````````````````````````````````````
-static PV** PVs;
+/* Lookups and scans of the whole table use the index of the PV table, which
+ * keeps the features and name hashes of PVs in arrays, so they do not drag
+ * the cold attributes of each PV through the cache. The index is rebuilt by
+ * the thread, which runs the plant, when plant->pvs or plant->npv has
+ * changed or plant_pvs_changed() was called. Workers use it only if it is
+ * up to date.
+ */
+static uint32_t name_hash(const char* str){// FNV-1a
+    uint32_t h = 2166136261u;
+    while (*str){
+        h = (h ^ (uint8_t)*str++) * 16777619u;}
+    return h;
+}
+static PVIndex* index_pvs(){
+    // Return the index of the PV table, rebuild it if needed, NULL if it is outdated
+    PVIndex* ix = __atomic_load_n(&plant->index, __ATOMIC_ACQUIRE);
+    uint32_t generation = __atomic_load_n(&plant->pvs_generation, __ATOMIC_ACQUIRE);
+    if (ix != NULL and ix->pvs == plant->pvs and ix->npv == plant->npv
+      and ix->generation == generation){
+        return ix;}
+    if (session->read_only) return NULL;
+    uint16_t npv = plant->npv;
+    uint32_t nslots = 16;
+    while (nslots < 2u*npv) nslots *= 2;
+    size_t size = sizeof(PVIndex) + npv*sizeof(uint32_t)
+      + (2*npv + nslots)*sizeof(uint16_t);
+    ix = (PVIndex*) calloc(1, size);
+    assert(ix != NULL && "No memory for PV index");
+    ix->pvs = plant->pvs;
+    ix->npv = npv;
+    ix->generation = generation;
+    ix->hash_mask = nslots - 1;
+    ix->hash = (uint32_t*)(ix + 1);
+    ix->fbits = (uint16_t*)(ix->hash + npv);
+    ix->measured = ix->fbits + npv;
+    ix->slots = ix->measured + npv;
+    for (int i=0; i < npv; i++){
+        PV* pv = plant->pvs[i];
+        ix->fbits[i] = pv->fbits;
+        ix->hash[i] = name_hash(pv->name);
+        if ((pv->fbits & F_M) == F_M){
+            ix->measured[ix->nmeasured++] = i;}
+        uint32_t slot = ix->hash[i] & ix->hash_mask;
+        while (ix->slots[slot] != 0){
+            slot = (slot + 1) & ix->hash_mask;}
+        ix->slots[slot] = i + 1;
+    }
+    PVIndex* old = __atomic_exchange_n(&plant->index, ix, __ATOMIC_ACQ_REL);
+    if (old != NULL){
+        plant_retire(old);}
+    return ix;
+}
+void plant_pvs_changed(){
+    // Features of PVs have changed, e.g. F_M, the index is rebuilt on next use
+    __atomic_add_fetch(&plant->pvs_generation, 1, __ATOMIC_RELEASE);
+}
+static PV* find_pv(const char* pvname){
+    PVIndex* ix = index_pvs();
+    if (ix != NULL){
+        uint32_t h = name_hash(pvname);
+        for (uint32_t slot = h & ix->hash_mask; ix->slots[slot] != 0;
+          slot = (slot + 1) & ix->hash_mask){
+            int i = ix->slots[slot] - 1;
+            if (ix->hash[i] == h and strcmp(ix->pvs[i]->name, pvname)==0){
+                return ix->pvs[i];}
+        }
+        return NULL;
+    }
+	for(int i=0; i < plant->npv; i++){
+		if (strcmp(plant->pvs[i]->name, pvname)==0){
+			return plant->pvs[i];}
+	}
+	return NULL;
+}
 static PV* pvof(const char* pvname){
 	PV* pv = NULL;
     //printf(">pvof %i\n",NPV);
 	if (pvname == NULL){
-        encode_error(pRootEncoder, "?", "PV is not provided");
+        encode_error(session->reply_encoder, "?", "PV is not provided");
 		return NULL;
 	}
-	for(int i=0; i < NPV; i++){
-		if (strcmp(PVs[i]->name, pvname)==0){
-			pv = PVs[i];}
-	}
+	pv = find_pv(pvname);
 	if (pv == NULL){
-        encode_error(pRootEncoder, pvname, "Wrong PV name");
+        encode_error(session->reply_encoder, pvname, "Wrong PV name");
 		return NULL;
 	}
 	return pv;
 }
+//``````````````````PV groups``````````````````````````````````````````````````
+/* A group is a named list of PVs, which is resolved once, when the group is
+ * defined, from exact names and glob patterns like "adc_*". A get of the
+ * group name encodes all members in one pass. Glob patterns in a get are
+ * resolved into a separate cache of MAX_GLOBS, the oldest one is evicted.
+ * Workers read the groups concurrently with the writer, so a published
+ * group is not modified: a change publishes a new copy and retires the old
+ * one with plant_retire().
+ */
+static bool is_glob(const char* str){
+    return strpbrk(str, "*?") != NULL;
+}
+static int group_slot(const char* gname){
+    // Index of the group in plant->groups or -1
+    int n = __atomic_load_n(&plant->ngroups, __ATOMIC_ACQUIRE);
+	for(int i=0; i < n; i++){
+        PVGroup* g = __atomic_load_n(&plant->groups[i], __ATOMIC_ACQUIRE);
+		if (strcmp(g->name, gname)==0){
+			return i;}
+	}
+	return -1;
+}
+static PVGroup* find_group(const char* gname){
+    int i = group_slot(gname);
+    return i < 0? NULL: __atomic_load_n(&plant->groups[i], __ATOMIC_ACQUIRE);
+}
+static PVGroup* group_alloc(const char* gname, uint capacity){
+    // A group with room for capacity members, not published
+    PVGroup* g = (PVGroup*) malloc(sizeof(PVGroup) + capacity*sizeof(PV*));
+    if (g == NULL) return NULL;
+    memset(g->name, 0, sizeof(g->name));
+    strncpy(g->name, gname, sizeof(g->name)-1);
+    g->members = (PV**)(g + 1);
+    g->nmembers = 0;
+    g->shared_timestamp = false;
+    return g;
+}
+static PVGroup* group_publish(PVGroup* g){
+    // Replace the group of the same name or append it, return g or NULL
+    int i = group_slot(g->name);
+    if (i >= 0){
+        PVGroup* old = plant->groups[i];
+        __atomic_store_n(&plant->groups[i], g, __ATOMIC_RELEASE);
+        plant_retire(old);
+        return g;
+    }
+    if (plant->ngroups == MAX_GROUPS){
+        encode_error(session->reply_encoder, g->name, "Too many groups");
+        free(g);
+        return NULL;
+    }
+    __atomic_store_n(&plant->groups[plant->ngroups], g, __ATOMIC_RELEASE);
+    __atomic_store_n(&plant->ngroups, plant->ngroups + 1, __ATOMIC_RELEASE);
+    return g;
+}
+static PVGroup* create_group(const char* gname, bool shared_timestamp = false){
+    // Create a group or replace the existing one with an empty one
+    if (find_pv(gname) != NULL){
+        encode_error(session->reply_encoder, gname, "Group name is taken by a PV");
+        return NULL;
+    }
+    if (group_slot(gname) < 0 and plant->ngroups == MAX_GROUPS){
+        encode_error(session->reply_encoder, gname, "Too many groups");
+        return NULL;
+    }
+    PVGroup* g = group_alloc(gname, 0);
+    if (g == NULL){
+        encode_error(session->reply_encoder, gname, "No memory for the group");
+        return NULL;
+    }
+    g->shared_timestamp = shared_timestamp;
+    return group_publish(g);
+}
+static PVGroup* group_share_timestamp(PVGroup* g, bool shared){
+    // Return the group with the flag, which is published now
+    if (g->shared_timestamp == shared) return g;
+    PVGroup* ng = group_alloc(g->name, g->nmembers);
+    if (ng == NULL){
+        encode_error(session->reply_encoder, g->name, "No memory for the group");
+        return g;
+    }
+    ng->shared_timestamp = shared;
+    memcpy(ng->members, g->members, g->nmembers*sizeof(PV*));
+    ng->nmembers = g->nmembers;
+    return group_publish(ng);
+}
+static bool group_has(const PVGroup* g, const PV* pv){
+    for(int j=0; j < g->nmembers; j++){
+        if (g->members[j] == pv) return true;}
+    return false;
+}
+static PVGroup* group_add(PVGroup* g, const char* pattern){
+    // Add PVs matching the pattern, return the group, which is published now
+    int added = 0;
+	for(int i=0; i < plant->npv; i++){
+        if (glob_match(pattern, plant->pvs[i]->name)
+          and not group_has(g, plant->pvs[i])){
+            added++;}
+	}
+    if (added == 0){
+        if (not is_glob(pattern)){
+            encode_error(session->reply_encoder, pattern, "Wrong PV name");}
+        return g;
+    }
+    PVGroup* ng = group_alloc(g->name, g->nmembers + added);
+    if (ng == NULL){
+        encode_error(session->reply_encoder, g->name, "No memory for the group");
+        return g;
+    }
+    ng->shared_timestamp = g->shared_timestamp;
+    memcpy(ng->members, g->members, g->nmembers*sizeof(PV*));
+    ng->nmembers = g->nmembers;
+	for(int i=0; i < plant->npv; i++){
+        if (glob_match(pattern, plant->pvs[i]->name)
+          and not group_has(ng, plant->pvs[i])){
+            ng->members[ng->nmembers++] = plant->pvs[i];}
+	}
+    return group_publish(ng);
+}
+static int encode_group(PVGroup* g){
+    /*Encode values of all group members using session->reply_encoder*/
+    CborError err = CborNoError;
+    TD_timestamp* newest = NULL;
+    bool shared = g->shared_timestamp;
+    for(int i=0; i < g->nmembers; i++){
+        PV* pv = g->members[i];
+        err = pv->val2cbor(session->reply_encoder, not shared);
+        if (err != CborNoError) return err;
+        if (newest == NULL or pv->is_newer(newest)){
+            newest = &pv->timestamp;}
+    }
+    if (shared and newest != NULL){
+        CborEncoder amap;
+        cbor_encode_text_stringz(session->reply_encoder, g->name);
+        cbor_encoder_create_map(session->reply_encoder, &amap, CborIndefiniteLength);
+        encode_timestamp(&amap, newest);
+        cbor_encoder_close_container(session->reply_encoder, &amap);
+    }
+    return err;
+}
+static PVGroup* find_glob(const char* pattern){
+    for(int i=0; i < MAX_GLOBS; i++){
+        PVGroup* g = __atomic_load_n(&plant->globs[i], __ATOMIC_ACQUIRE);
+        if (g != NULL and strcmp(g->name, pattern)==0){
+            return g;}
+    }
+    return NULL;
+}
+static PVGroup* cache_glob(const char* pattern){
+    /* Resolve the pattern into the glob cache, evict the oldest entry.
+     * Should be called by the writer, returns NULL if it is not cached.*/
+    if (plant->globs_pvs != plant->pvs or plant->globs_npv != plant->npv){
+        for(int i=0; i < MAX_GLOBS; i++){// resolved from another PV table
+            if (plant->globs[i] != NULL){
+                PVGroup* old = plant->globs[i];
+                __atomic_store_n(&plant->globs[i], (PVGroup*)NULL, __ATOMIC_RELEASE);
+                plant_retire(old);
+            }
+        }
+        plant->globs_pvs = plant->pvs;
+        plant->globs_npv = plant->npv;
+    }
+    PVGroup* g = find_glob(pattern);
+    if (g != NULL or strlen(pattern) >= sizeof(g->name)){
+        return g;}
+    int n = 0;
+	for(int i=0; i < plant->npv; i++){
+        if (glob_match(pattern, plant->pvs[i]->name)) n++;}
+    g = group_alloc(pattern, n);
+    if (g == NULL) return NULL;
+	for(int i=0; i < plant->npv; i++){
+        if (glob_match(pattern, plant->pvs[i]->name)){
+            g->members[g->nmembers++] = plant->pvs[i];}
+	}
+    int slot = plant->next_glob;
+    plant->next_glob = (slot + 1) % MAX_GLOBS;
+    PVGroup* old = plant->globs[slot];
+    __atomic_store_n(&plant->globs[slot], g, __ATOMIC_RELEASE);
+    if (old != NULL){
+        plant_retire(old);}
+    return g;
+}
+static int encode_glob(const char* pattern){
+    /*Encode values of PVs matching the pattern, the membership is cached*/
+    PVGroup* g = session->read_only? find_glob(pattern): cache_glob(pattern);
+    if (g != NULL){
+        return encode_group(g);}
+    // No room for caching, resolve on the fly
+    CborError err = CborNoError;
+	for(int i=0; i < plant->npv and err == CborNoError; i++){
+        if (glob_match(pattern, plant->pvs[i]->name)){
+            err = plant->pvs[i]->val2cbor(session->reply_encoder);}
+    }
+    return err;
+}
+static int reply_group(const char* gname){
+    // Reply with the list of group members
+    PVGroup* g = find_group(gname);
+    if (g == NULL){
+        encode_error(session->reply_encoder, gname, "Wrong group name");
+        return 0;
+    }
+    CborEncoder amap, alist;
+    cbor_encode_text_stringz(session->reply_encoder, gname);
+    cbor_encoder_create_map(session->reply_encoder, &amap, 1);
+    cbor_encode_text_stringz(&amap, "members");
+    cbor_encoder_create_array(&amap, &alist, g->nmembers);
+    for(int i=0; i < g->nmembers; i++){
+        cbor_encode_text_stringz(&alist, g->members[i]->name);}
+    cbor_encoder_close_container(&amap, &alist);
+    cbor_encoder_close_container(session->reply_encoder, &amap);
+    return 0;
+}
+int plant_define_group(const char* gname, const char** patterns, int npatterns,
+  bool shared_timestamp = false){
+    /* Define a server-side group, should be called after the PVs are created.
+     * Returns number of members or -1 on error.*/
+    PVGroup* g = create_group(gname, shared_timestamp);
+    if (g == NULL) return -1;
+    for(int i=0; i < npatterns and g != NULL; i++){
+        g = group_add(g, patterns[i]);}
+    return g == NULL? -1: g->nmembers;
+}
 static int encode_value(const char* pvname){
-    /*Encode PV value using pRootEncoder*/
+    /*Encode PV value using session->reply_encoder*/
     CborError err;
-    if(DBG>=2)printf(">encode_value %s\n", pvname);
-	PV* pv = pvof(pvname);
+    if (is_glob(pvname)){
+        return encode_glob(pvname);}
+	PV* pv = find_pv(pvname);
+	if (pv == NULL){
+        PVGroup* g = find_group(pvname);
+        if (g != NULL){
+            return encode_group(g);}
+	}
+	pv = pvof(pvname);
 	if (pv == NULL){
         return CborNoError;
 	}
-	err = pv->val2cbor(pRootEncoder);
+	err = pv->val2cbor(session->reply_encoder);
     return err;
 }
-int  encode_measurements(){
-    /* Encode all PVs with F_M feature (Continuous Measurements)*/
+static int encode_value_if_newer(const char* pvname, const void* t, uint n){
+    /*Encode PV value only if it changed after client-supplied timestamp t,
+     * otherwise encode a short "unchanged" status.*/
+    PV* pv = pvof(pvname);
+	if (pv == NULL){
+        return CborNoError;
+	}
+    if (n != sizeof(TD_timestamp)){
+        encode_error(session->reply_encoder, pvname, "Wrong timestamp");
+        return CborNoError;
+    }
+    TD_timestamp ts;
+    memcpy(&ts, t, sizeof(ts));
+    if (pv->is_newer(&ts)){
+        return pv->val2cbor(session->reply_encoder);}
+    CborEncoder amap;
+    cbor_encode_text_stringz(session->reply_encoder, pvname);
+    cbor_encoder_create_map(session->reply_encoder, &amap, 1);
+    cbor_encode_text_stringz(&amap, "status");
+    cbor_encode_text_stringz(&amap, "unchanged");
+    cbor_encoder_close_container(session->reply_encoder, &amap);
+    return CborNoError;
+}
+int  encode_measurements(TD_timestamp* archive_time){
+    /* Encode all PVs with F_M feature (Continuous Measurements).
+     * The latest timestamp of encoded archivable (F_A) PVs is returned
+     * in archive_time, it stays zero if there are none.*/
     CborError err = CborNoError;
-    for (int ii =0; ii<NPV; ii++){
-        if (PVs[ii]->fbits == F_M){
-            //printf("Measured %s\n",(PVs[ii]->name));
-            err = PVs[ii]->val2cbor(pRootEncoder);
-            if (err != CborNoError) break;
-        }
+    PVIndex* ix = index_pvs();
+    for (int ii =0; ii<ix->nmeasured; ii++){
+        PV* pv = ix->pvs[ix->measured[ii]];
+        if (pv->is_newer(&plant->frame_acquired)){
+            plant->frame_acquired = pv->timestamp;}
+        if ((pv->fbits & F_A) and
+          (pv->timestamp.tv_sec > archive_time->tv_sec or
+          (pv->timestamp.tv_sec == archive_time->tv_sec and
+          pv->timestamp.tv_nsec > archive_time->tv_nsec))){
+            *archive_time = pv->timestamp;}
+        //printf("Measured %s\n",(pv->name));
+        CborEncoder mark;
+        encoder_mark(&mark);
+        do err = pv->val2cbor(session->reply_encoder);
+        while (encoder_retry(&mark, pv->name));
+        if (err != CborNoError) break;
     }
     return err;
 }
+//``````````````````Parallel frame builder`````````````````````````````````````
+/* The measured PVs are first sized by encoding them into an encoder without
+ * buffer, then each of them is encoded by one of the encoder threads directly
+ * into its place in the frame. The PVs are encoded exactly as by
+ * encode_measurements(), so the frame is byte-identical to the serial one.
+ */
+struct FRAME_JOBS{
+    uint8_t* buf;
+    PV** pvs;
+    uint32_t* offsets;
+};
+static void encode_frame_job(void* ctx, int i){
+    FRAME_JOBS* jobs = (FRAME_JOBS*) ctx;
+    CborEncoder encoder;
+    cbor_encoder_init(&encoder, jobs->buf + jobs->offsets[i],
+      jobs->offsets[i+1] - jobs->offsets[i], 0);
+    // The plant thread waits for the frame, so the PV can not change meanwhile
+    jobs->pvs[i]->_val2cbor(&encoder, true);
+}
+size_t encode_measurements_parallel(uint8_t* buf, size_t bufsize,
+  TD_timestamp* archive_time){
+    /* Encode the same PVs as encode_measurements() into buf, using the
+     * encoder threads if the frame is at least plant->parallel_frame_min bytes.
+     * Returns the number of encoded bytes or 0 if the PVs do not fit into buf.
+     */
+    if (plant->frame_capacity < plant->npv){
+        plant->frame_pvs = (PV**) realloc(plant->frame_pvs, plant->npv*sizeof(PV*));
+        plant->frame_offsets = (uint32_t*) realloc(plant->frame_offsets,
+          (plant->npv + 1)*sizeof(uint32_t));
+        assert(plant->frame_pvs != NULL and plant->frame_offsets != NULL);
+        plant->frame_capacity = plant->npv;
+    }
+    FRAME_JOBS jobs = {buf, plant->frame_pvs, plant->frame_offsets};
+    TD_timestamp atime = *archive_time;
+    size_t total = 0;
+    int njobs = 0;
+    PVIndex* ix = index_pvs();
+    for (int ii =0; ii<ix->nmeasured; ii++){
+        PV* pv = ix->pvs[ix->measured[ii]];
+        if (pv->is_newer(&plant->frame_acquired)){
+            plant->frame_acquired = pv->timestamp;}
+        if ((pv->fbits & F_A) and
+          (pv->timestamp.tv_sec > atime.tv_sec or
+          (pv->timestamp.tv_sec == atime.tv_sec and
+          pv->timestamp.tv_nsec > atime.tv_nsec))){
+            atime = pv->timestamp;}
+        CborEncoder sizer;
+        cbor_encoder_init(&sizer, NULL, 0, 0);
+        pv->val2cbor(&sizer);// calls the getter
+        jobs.pvs[njobs] = pv;
+        jobs.offsets[njobs++] = total;
+        total += cbor_encoder_get_extra_bytes_needed(&sizer);
+    }
+    jobs.offsets[njobs] = total;
+    if (total == 0 or total > bufsize) return 0;
+    if (total < plant->parallel_frame_min){
+        for (int i=0; i < njobs; i++){
+            encode_frame_job(&jobs, i);}
+    }else{
+        plant_parallel_for(njobs, encode_frame_job, &jobs);}
+    *archive_time = atime;
+    return total;
+}
 static int reply_info(const char* pvname){
     if (strcmp(pvname, "*") == 0){
         CborEncoder alist;
-        if(DBG>=2)printf(">create_map %i\n",NPV);
-        cbor_encode_text_stringz(pRootEncoder, "*");
-        cbor_encoder_create_map(pRootEncoder, &alist, NPV);
-        for (int i=0; i < NPV; i++){
-            if(DBG>=2)printf("encode %s\n",PVs[i]->name);
-            PVs[i]->info2cbor(&alist);
-        }
-        cbor_encoder_close_container(pRootEncoder, &alist);
+        cbor_encode_text_stringz(session->reply_encoder, "*");
+        cbor_encoder_create_map(session->reply_encoder, &alist, plant->npv);
+        for (int i=0; i < plant->npv; i++){
+            plant->pvs[i]->info2cbor(&alist);
+        }
+        cbor_encoder_close_container(session->reply_encoder, &alist);
         return 0;
     }
     PV* pv = pvof(pvname);
 	if (pv == NULL){
         return 0;
 	}
-    if(DBG>=2)printf(">reply info %s\n", pvname);
-    return (int) (pv->info2cbor(pRootEncoder));
+    return (int) (pv->info2cbor(session->reply_encoder));
 	return 0;
 }
+//``````````````````Pending setters````````````````````````````````````````````
+static bool register_pending_setter(PV* pv){
+    // Called by PV::_call_setter() when setter returned SETTER_PENDING
+    // and a slot is free.
+    PendingSetter* p = &plant->pending_setters[plant->npending++];
+    p->pv = pv;
+    p->silent = plant->snapshot_restoring;
+    if (p->silent){
+        return true;}
+    p->request_id_present = session->request_id_present;
+    p->request_id = session->request_id;
+    if(session->reply_encoder != NULL){
+        CborEncoder amap;
+        cbor_encode_text_stringz(session->reply_encoder, pv->name);
+        cbor_encoder_create_map(session->reply_encoder, &amap, 1);
+        cbor_encode_text_stringz(&amap, "status");
+        cbor_encode_text_stringz(&amap, "pending");
+        cbor_encoder_close_container(session->reply_encoder, &amap);
+    }
+    return true;
+}
+int parm_pending(){
+    return plant->npending;
+}
+int parm_complete_pending(CborEncoder* encoder){
+    /* Encode the reply of one completed setter, return 0 if none completed.
+     * The reply carries the id of the request, which started the setter.
+     */
+    for (int i=0; i < plant->npending; i++){
+        PV* pv = plant->pending_setters[i].pv;
+        if (__atomic_load_n(&pv->async_state, __ATOMIC_ACQUIRE) != ASYNC_DONE)
+            continue;
+        if (plant->pending_setters[i].silent){
+            if (pv->async_status != 0)
+                printf("WARNING: restored setter of %s failed\n", pv->name);
+            plant->pending_setters[i--] = plant->pending_setters[--plant->npending];
+            __atomic_store_n(&pv->async_state, ASYNC_IDLE, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (plant->pending_setters[i].request_id_present){
+            cbor_encode_text_stringz(encoder, "id");
+            cbor_encode_int(encoder, plant->pending_setters[i].request_id);
+        }
+        if (pv->async_status == 0){
+            pv->update_timestamp();
+            CborEncoder mark;
+            encoder_mark(&mark);// encoder is session->reply_encoder
+            do pv->val2cbor(encoder);
+            while (encoder_retry(&mark, pv->name));
+        }else{
+            encode_error(encoder, pv->name, "Setter failed");
+        }
+        plant->pending_setters[i] = plant->pending_setters[--plant->npending];
+        __atomic_store_n(&pv->async_state, ASYNC_IDLE, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
+#if PLATFORM == PLATFORM_LINUX
+//``````````````````Snapshot of savable PVs````````````````````````````````````
+/* Values of F_s PVs, including array data, are written into a binary
+ * snapshot file, F_r PVs are restored from it at startup, so the plant
+ * restarts fully configured. The file is a SNAPSHOT_HEADER, followed by
+ * entries: SNAPSHOT_ENTRY and the value data, padded to 8 bytes.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define SNAPSHOT_MAGIC "P2PSNAP1"
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+struct SNAPSHOT_HEADER{
+    char magic[8];
+    uint32_t nentries;
+    uint32_t size;  // of the whole file
+};
+struct SNAPSHOT_ENTRY{
+    char name[32];
+    uint32_t shape[MAX_DIMENSION];
+    uint32_t nbytes;// of the value data
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+static int snapshot_save(){
+    // Write all F_s PVs to a temporary file, then atomically replace the snapshot
+    size_t size = sizeof(SNAPSHOT_HEADER);
+    PVIndex* ix = index_pvs();
+    for (int i=0; i < ix->npv; i++){
+        if (ix->fbits[i] & F_s){
+            size += sizeof(SNAPSHOT_ENTRY) + SNAPSHOT_ALIGN(plant->pvs[i]->value_nbytes());}
+    }
+    uint8_t* buf = (uint8_t*) calloc(1, size);
+    if (buf == NULL){
+        printf("ERR: no memory for snapshot\n");
+        return 1;
+    }
+    SNAPSHOT_HEADER* h = (SNAPSHOT_HEADER*)buf;
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->size = size;
+    size_t offset = sizeof(SNAPSHOT_HEADER);
+    for (int i=0; i < ix->npv; i++){
+        if (not (ix->fbits[i] & F_s)) continue;
+        PV* pv = ix->pvs[i];
+        SNAPSHOT_ENTRY* e = (SNAPSHOT_ENTRY*)(buf + offset);
+        strncpy(e->name, pv->name, sizeof(e->name)-1);
+        memcpy(e->shape, pv->shape, sizeof(e->shape));
+        e->type = pv->type;
+        e->nbytes = pv->value_nbytes();
+        const void* data = (pv->type >= T_str)? (const void*)pv->value.Bptr: &pv->value;
+        if (e->nbytes != 0){
+            memcpy(buf + offset + sizeof(SNAPSHOT_ENTRY), data, e->nbytes);}
+        offset += sizeof(SNAPSHOT_ENTRY) + SNAPSHOT_ALIGN(e->nbytes);
+        h->nentries++;
+    }
+    char tmp[sizeof(plant->snapshot_path)+4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", plant->snapshot_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 and write(fd, buf, size) == (ssize_t)size;
+    if (fd >= 0) ok = (close(fd) == 0) and ok;
+    uint32_t nentries = h->nentries;// h is in buf
+    free(buf);
+    if (not ok or rename(tmp, plant->snapshot_path) != 0){
+        printf("ERR: could not write snapshot %s\n", plant->snapshot_path);
+        return 1;
+    }
+    plant->snapshot_dirty = false;
+    if(DBG>=1)printf("Snapshot of %u PVs saved to %s\n", nentries, plant->snapshot_path);
+    return 0;
+}
+static int restore_entry(PV* pv, const SNAPSHOT_ENTRY* e, const uint8_t* data){
+    /* Restore the value of one PV from a snapshot entry, return 1 if restored.
+     * Strings and scalars are set by PV::set(), which checks legal values and
+     * limits, a refused value is not restored.
+     */
+    if (not (pv->fbits & F_r) or pv->type != e->type){
+        return 0;}
+    if (pv->type == T_str){
+        if (e->nbytes == 0 or data[e->nbytes-1] != 0){
+            return 0;}
+        pv->set((const char*)data);
+        return pv->value.str != NULL and strcmp(pv->value.str, (const char*)data) == 0;
+    }else if (pv->type >= T_Bptr){// only into the existing buffer
+        uint capacity = pv->bufsize != 0? pv->bufsize: pv->value_nbytes();
+        if (pv->value.Bptr == NULL or e->nbytes > capacity){
+            return 0;}
+        uint64_t n = element_size(e->type);// the shape should match the data
+        for (uint ii=0; ii < MAX_DIMENSION; ii++){
+            if (ii > 0 and e->shape[ii] == 0) break;
+            n *= e->shape[ii];
+            if (n > e->nbytes) return 0;
+        }
+        if (n != e->nbytes){
+            return 0;}
+        pv->write_begin();// readers retry until update_timestamp()
+        memcpy(pv->value.Bptr, data, e->nbytes);
+        memcpy(pv->shape, e->shape, sizeof(pv->shape));
+        pv->_call_setter();// apply the setting
+        return 1;
+    }
+    if (e->nbytes != sizeof(pv->value)){
+        return 0;}
+    VALUE v;
+    memcpy(&v, data, sizeof(v));
+    int64_t vv;
+    switch (pv->type){
+    case T_b:   {vv = v.b; break;}
+    case T_B:   {vv = v.B; break;}
+    case T_i2:  {vv = v.i2; break;}
+    case T_u2:  {vv = v.u2; break;}
+    case T_u4:  {vv = v.u4; break;}
+    default:    {vv = v.i4; break;}
+    }
+    if (pv->set_value != NULL){
+        pv->set_value(pv, vv);
+    }else{
+        pv->set((int)vv);}
+    return memcmp(&pv->value, &v, element_size(pv->type)) == 0;
+}
+int plant_snapshot_init(const char* path, uint32_t interval_ms){
+    /* Restore F_r PVs from the snapshot file, if it exists, and save F_s PVs
+     * into it, not more often than every interval_ms, when they change.
+     * Should be called after the PVs are created. Returns number of PVs
+     * restored.
+     */
+    strncpy(plant->snapshot_path, path, sizeof(plant->snapshot_path)-1);
+    plant->snapshot_interval_ms = interval_ms;
+    clock_gettime(CLOCK_MONOTONIC, &plant->snapshot_last_save);
+    int fd = open(plant->snapshot_path, O_RDONLY);
+    if (fd < 0){
+        printf("No snapshot %s, starting with defaults\n", plant->snapshot_path);
+        plant->snapshot_dirty = true;
+        return 0;
+    }
+    struct stat st;
+    uint8_t* map = NULL;
+    if (fstat(fd, &st) == 0 and st.st_size >= (off_t)sizeof(SNAPSHOT_HEADER)){
+        map = (uint8_t*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) map = NULL;
+    }
+    close(fd);
+    const SNAPSHOT_HEADER* h = (const SNAPSHOT_HEADER*)map;
+    if (map == NULL or memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0
+      or h->size != (uint32_t)st.st_size){
+        printf("ERR: corrupted snapshot %s, starting with defaults\n", plant->snapshot_path);
+        if (map != NULL) munmap(map, st.st_size);
+        plant->snapshot_dirty = true;
+        return 0;
+    }
+    int nrestored = 0;
+    size_t offset = sizeof(SNAPSHOT_HEADER);
+    plant->snapshot_restoring = true;
+    for (uint32_t i=0; i < h->nentries; i++){
+        if (offset + sizeof(SNAPSHOT_ENTRY) > h->size) break;
+        const SNAPSHOT_ENTRY* e = (const SNAPSHOT_ENTRY*)(map + offset);
+        offset += sizeof(SNAPSHOT_ENTRY);
+        if (offset + e->nbytes > h->size) break;
+        char name[sizeof(e->name)+1] = {0};
+        memcpy(name, e->name, sizeof(e->name));
+        PV* pv = find_pv(name);
+        if (pv != NULL){
+            nrestored += restore_entry(pv, e, map + offset);}
+        offset += SNAPSHOT_ALIGN(e->nbytes);
+    }
+    plant->snapshot_restoring = false;
+    munmap(map, st.st_size);
+    plant->snapshot_dirty = false;
+    printf("Restored %i PVs from snapshot %s\n", nrestored, plant->snapshot_path);
+    return nrestored;
+}
+int plant_snapshot_update(bool force){
+    /* Save the snapshot if savable PVs changed. Changes within interval_ms
+     * after the last save are coalesced into one write. Should be called in
+     * the main loop, with force=true at exit.
+     */
+    if (plant->snapshot_path[0] == 0 or not plant->snapshot_dirty){
+        return 0;}
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed_ms = (now.tv_sec - plant->snapshot_last_save.tv_sec)*1000
+      + (now.tv_nsec - plant->snapshot_last_save.tv_nsec)/1000000;
+    if (not force and elapsed_ms < plant->snapshot_interval_ms){
+        return 0;}
+    plant->snapshot_last_save = now;
+    return snapshot_save();
+}
+//``````````````````Shared-memory mirror```````````````````````````````````````
+int plant_mirror_init(const char* shm_name){
+    /* Publish the PVs in shared memory object shm_name (include/mirror.h).
+     * Should be called after the PVs are created, array PVs should have
+     * their buffers set, the data area is sized by the current value.
+     */
+    static_assert(MAX_DIMENSION == MIRROR_MAX_DIMENSION, "mirror shape");
+    size_t size = MIRROR_ALIGN(sizeof(MIRROR_HEADER) + plant->npv*sizeof(MIRROR_ENTRY));
+    for (int i=0; i < plant->npv; i++){
+        PV* pv = plant->pvs[i];
+        uint capacity = pv->value_nbytes();
+        if (pv->type >= T_Bptr and pv->bufsize > capacity){
+            capacity = pv->bufsize;}
+        if (pv->type == T_str and capacity < 64){
+            capacity = 64;}
+        pv->mirror_capacity = capacity;
+        size += MIRROR_ALIGN(sizeof(MIRROR_SLOT) + capacity);
+    }
+    int fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0){
+        printf("ERR: could not create shared memory %s\n", shm_name);
+        return 1;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0){
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);}
+    close(fd);
+    if (map == MAP_FAILED){
+        printf("ERR: could not map shared memory %s\n", shm_name);
+        shm_unlink(shm_name);
+        return 1;
+    }
+    strncpy(plant->mirror_name, shm_name, sizeof(plant->mirror_name)-1);
+    uint8_t* base = (uint8_t*)map;
+    MIRROR_HEADER* h = (MIRROR_HEADER*)base;
+    MIRROR_ENTRY* e = (MIRROR_ENTRY*)(h + 1);
+    h->npv = plant->npv;
+    h->size = size;
+    h->pid = getpid();
+    size_t offset = MIRROR_ALIGN(sizeof(MIRROR_HEADER) + plant->npv*sizeof(MIRROR_ENTRY));
+    for (int i=0; i < plant->npv; i++){
+        PV* pv = plant->pvs[i];
+        strncpy(e[i].name, pv->name, sizeof(e[i].name)-1);
+        strncpy(e[i].units, pv->units, sizeof(e[i].units));
+        e[i].type = pv->type;
+        e[i].fbits = pv->fbits;
+        e[i].capacity = pv->mirror_capacity;
+        e[i].offset = offset;
+        pv->mirror_slot = (MIRROR_SLOT*)(base + offset);
+        pv->publish_mirror();
+        offset += MIRROR_ALIGN(sizeof(MIRROR_SLOT) + pv->mirror_capacity);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, MIRROR_MAGIC, sizeof(h->magic));// mirror is complete
+    printf("Mirror of %i PVs published in %s, %zu bytes\n", plant->npv, shm_name, size);
+    return 0;
+}
+void plant_mirror_close(){
+    if (plant->mirror_name[0] != 0){
+        shm_unlink(plant->mirror_name);}
+}
+#endif //PLATFORM_LINUX
+//``````````````````Statistics PVs````````````````````````````````````````````
+/* The histograms and counters of PlantStats are served as u4 arrays, their
+ * timestamps are refreshed when they are read. Setting st_reset clears them.
+ */
+#define STATS_NPV (STATS_NHISTOGRAMS + 2)
+static const struct {const char* name; const char* desc; const char* units;}
+  stats_pv_info[STATS_NHISTOGRAMS] = {
+    {"st_request",  "Histogram of request decode, dispatch and encode", "ns"},
+    {"st_queue_wait","Histogram of waiting of requests for workers", "ns"},
+    {"st_send",     "Histogram of transport_send time", "ns"},
+    {"st_frame_enc","Histogram of frame encoding time", "ns"},
+    {"st_frame_lat","Histogram of acquisition to send latency of frames", "ns"},
+    {"st_frame_size","Histogram of frame sizes", "bytes"},
+    {"st_queue_depth","Histogram of the worker queue depth", ""},
+};
+static int stats_getter(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i=0; i < STATS_NPV; i++){
+        plant->stats->pvs[i].update_timestamp(&now);}
+    return 0;
+}
+static int stats_reset_setter(){
+    memset(plant->stats->hist, 0, sizeof(plant->stats->hist));
+    memset(plant->stats->counters, 0, sizeof(plant->stats->counters));
+    return 0;
+}
+int plant_stats_pvs(PV** table){
+    /* Enable the statistics of the current plant and place its STATS_NPV
+     * PVs into table, which should be then served as a part of plant->pvs.
+     * Bucket b of a histogram counts values from stats_bucket_low(b).
+     */
+    PlantStats* st = (PlantStats*) calloc(1, sizeof(PlantStats));
+    PV* pvs = (PV*) malloc(STATS_NPV*sizeof(PV));
+    if (st == NULL or pvs == NULL){
+        printf("ERR: no memory for statistics\n");
+        return 0;
+    }
+    for (int h=0; h < STATS_NHISTOGRAMS; h++){
+        PV* pv = new (&pvs[h]) PV(stats_pv_info[h].name, stats_pv_info[h].desc,
+          T_u4ptr, F_R, stats_pv_info[h].units);
+        pv->value.u4ptr = st->hist[h];
+        pv->set_shape(STATS_NBUCKETS);
+    }
+    PV* pv = new (&pvs[STATS_NHISTOGRAMS]) PV("st_counters",
+      "Counters: requests, worker requests, queue full, frames, send failures",
+      T_u4ptr, F_R);
+    pv->value.u4ptr = st->counters;
+    pv->set_shape(STATS_NCOUNTERS);
+    for (int i=0; i <= STATS_NHISTOGRAMS; i++){
+        pvs[i].getter = stats_getter;}
+    pv = new (&pvs[STATS_NHISTOGRAMS + 1]) PV("st_reset",
+      "Set to clear the statistics", T_B, F_R | F_W);
+    pv->setter = stats_reset_setter;
+    st->pvs = pvs;
+    for (int i=0; i < STATS_NPV; i++){
+        table[i] = &pvs[i];}
+    plant->stats = st;
+    return STATS_NPV;
+}
+//``````````````````Real-time PVs````````````````````````````````````````````
+/* The RT_VALUE values of RealtimeState are served as a u4 array, rt_cycle,
+ * its timestamp is refreshed when it is read. Setting rt_reset clears them,
+ * the warm-up is not repeated.
+ */
+#define RT_NPV 2
+static int rt_getter(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    plant->rt->pvs[0].update_timestamp(&now);
+    return 0;
+}
+static int rt_reset_setter(){
+    memset(plant->rt->values, 0, sizeof(plant->rt->values));
+    return 0;
+}
+int plant_realtime_pvs(PV** table){
+    /* Measure the cycles of the current plant, see plant_cycle_begin(), and
+     * place its RT_NPV PVs into table, which should be then served as a part
+     * of plant->pvs. The real-time mode itself is enabled by plant_realtime().
+     */
+    if (plant->rt == NULL){
+        void* mem = calloc(1, sizeof(RealtimeState));
+        if (mem == NULL){
+            printf("ERR: no memory for the cycle measurement\n");
+            return 0;
+        }
+        plant->rt = new (mem) RealtimeState();
+    }
+    PV* pvs = (PV*) malloc(RT_NPV*sizeof(PV));
+    if (pvs == NULL){
+        printf("ERR: no memory for the cycle measurement\n");
+        return 0;
+    }
+    PV* pv = new (&pvs[0]) PV("rt_cycle",
+      "Acquisition cycles: worst and last latency [ns], cycles, heap allocations",
+      T_u4ptr, F_R);
+    pv->value.u4ptr = plant->rt->values;
+    pv->set_shape(RT_NVALUES);
+    pv->getter = rt_getter;
+    pv = new (&pvs[1]) PV("rt_reset", "Set to clear rt_cycle", T_B, F_R | F_W);
+    pv->setter = rt_reset_setter;
+    plant->rt->pvs = pvs;
+    for (int i=0; i < RT_NPV; i++){
+        table[i] = &pvs[i];}
+    return RT_NPV;
+}
+void plant_prefault_pvs(){
+    // Touch the values and histories of all PVs, see plant_realtime()
+    for (int i=0; i < plant->npv; i++){
+        PV* pv = plant->pvs[i];
+        if (pv->type >= T_Bptr and pv->value.Bptr != NULL){
+            prefault(pv->value.Bptr, pv->bufsize? pv->bufsize: pv->value_nbytes());}
+        if (pv->history != NULL and pv->history->values != NULL){
+            prefault(pv->history->values, 2*pv->history->depth*pv->history->itemsize);
+            prefault(pv->history->times, 2*pv->history->depth*sizeof(TD_timestamp));
+        }
+    }
+}
+bool parm_read_only(const char* name){
+    /* Check if a get or history of the PV, group or glob pattern may be
+     * processed by a worker: it should not call getters nor cache a glob.
+     */
+    PV* pv = find_pv(name);
+    if (pv != NULL){
+        return pv->getter == NULL;}
+    if (is_glob(name)){// resolved into the cache here, workers only read it
+        PVGroup* g = cache_glob(name);
+        if (g == NULL){
+            for (int i=0; i < plant->npv; i++){
+                if (plant->pvs[i]->getter != NULL
+                  and glob_match(name, plant->pvs[i]->name)) return false;}
+            return true;
+        }
+        for (int i=0; i < g->nmembers; i++){
+            if (g->members[i]->getter != NULL) return false;}
+        return true;
+    }
+    PVGroup* g = find_group(name);
+    if (g == NULL){// wrong name is read-only
+        return true;}
+    for (int i=0; i < g->nmembers; i++){
+        if (g->members[i]->getter != NULL) return false;}
+    return true;
+}
 int parm_init_reply(CborEncoder* pencoder){
-    pRootEncoder = pencoder;
+    session->reply_encoder = pencoder;
     return 0;
 }    
 int parm_info(const char* parmName){
-    if(DBG>=2)printf(">parm_info %s\n", parmName);
+    TRACE(TR_PV, 0, trace_tag(parmName));
     return reply_info(parmName);
 }
 int parm_get(const char* parmName){
-    if(DBG>=2)printf(">parm_get %s\n", parmName);
+    TRACE(TR_PV, 0, trace_tag(parmName));
     return encode_value(parmName);
 }
+int parm_history(const char* parmName, uint32_t nlast, const void* since,
+  uint n){
+    /* Encode history of PV: last nlast records, or, if since is provided,
+     * records newer than since.*/
+    TRACE(TR_PV, nlast, trace_tag(parmName));
+    PV* pv = pvof(parmName);
+	if (pv == NULL){
+        return 0;
+	}
+    if (since == NULL){
+        return pv->history2cbor(session->reply_encoder, nlast);}
+    if (n != sizeof(TD_timestamp)){
+        encode_error(session->reply_encoder, parmName, "Wrong timestamp");
+        return 0;
+    }
+    TD_timestamp ts;
+    memcpy(&ts, since, sizeof(ts));
+    return pv->history2cbor(session->reply_encoder, UINT32_MAX, &ts);
+}
+int parm_group(const char* groupName){
+    TRACE(TR_PV, 0, trace_tag(groupName));
+    return reply_group(groupName);
+}
+int parm_group_define(const char* groupName){
+    TRACE(TR_PV, 0, trace_tag(groupName));
+    create_group(groupName);
+    return 0;
+}
+int parm_group_add(const char* groupName, const char* pattern){
+    PVGroup* g = find_group(groupName);
+    if (g == NULL) return 0;
+    group_add(g, pattern);
+    return 0;
+}
+int parm_group_share_timestamp(const char* groupName, bool shared){
+    PVGroup* g = find_group(groupName);
+    if (g == NULL){
+        create_group(groupName, shared);
+        return 0;
+    }
+    group_share_timestamp(g, shared);
+    return 0;
+}
+int parm_get_if_newer(const char* parmName, const void* t, uint n){
+    TRACE(TR_PV, 0, trace_tag(parmName));
+    return encode_value_if_newer(parmName, t, n);
+}
+static bool set_refused(PV* pv){
+    // Refuse a set, which could not be completed, before the value changes
+    if (pv->setter_pending()){
+        encode_error(session->reply_encoder, pv->name, "Setter is pending");
+        return true;
+    }
+    if (pv->setter_async and plant->npending == MAX_PENDING_SETTERS){
+        encode_error(session->reply_encoder, pv->name, "Too many pending setters");
+        return true;
+    }
+    return false;
+}
 int parm_set(const char* parmName, CborType type, 
   const void* pvalue, uint count){
-    if(DBG>=1) printf("set %s, type %i\n", parmName, type);
+    TRACE(TR_PV, count, trace_tag(parmName));
     PV* pv = pvof(parmName);
 	if (pv == NULL){
         return 0;
-	}    
+	}
+    if (set_refused(pv)){
+        return 0;}
     switch (type){
     case CborTextStringType:{
-        if(DBG>=1)printf(">parm_set_text(%s,%s)\n", parmName, (const char*) pvalue);
         return pv->set(((const char*)pvalue));
         break;
     }case CborIntegerType:{
-        if(DBG>=1)printf(">parm_set_int(%s,%i)\n", parmName, *(int*)(pvalue));
-        return pv->set(((int*)(pvalue))[0]);
+        int64_t v = ((const int64_t*)pvalue)[0];
+        if (pv->set_value != NULL){
+            return pv->set_value(pv, v);}
+        return pv->set((int)v);
     }case CborArrayType:{
-        if(DBG>=1)printf(">parm_set_Array(%s[%i],[%i,...,%i)\n", parmName, count,
-          ((int*)(pvalue))[0], ((int*)pvalue)[count-1]);
-        if (pv->type == T_i4ptr){
-            return pv->set((int32_t*)pvalue);
-        }
-        if (pv->type == T_i2ptr){ 
-            return pv->set((int16_t*)pvalue);//TODO: convert int[] to int16_t[]
-        }
-        break;
+        return pv->set_array((const int64_t*)pvalue, count);
     }
     default:
         // Should never get here
         printf("ERR: Not supported type %i of %s value\n", type, parmName); 
-        encode_error(pRootEncoder, parmName, "ERR: Not supported type of value");
+        encode_error(session->reply_encoder, parmName, "ERR: Not supported type of value");
         break;
     }
     return 0; // If not 0 then assert will be raised and program aborted
@@ -524,7 +2018,9 @@ int parm_set_tagged(const char* parmName, CborTag tag, const void* buf,
     PV* pv = pvof(parmName);
 	if (pv == NULL){
         return 0;
-	}    
+	}
+    if (set_refused(pv)){
+        return 0;}
     return pv->set_tagged(tag, buf, count);
 }
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
@@ -0,0 +1,90 @@
+/*``````````````````Binary tracing```````````````````````````````````````````````
+ * TRACE(id, a, b) records a fixed-size event: timestamp, event id and two
+ * arguments, into a ring of the calling thread. The rings are kept in a
+ * memory-mapped trace file, one per thread, so the trace can be decoded by
+ * tests/tracedecode.cpp at any time, even after a crash.
+ * Tracing is compiled in only if P2P_TRACE is defined (make TRACE=1),
+ * otherwise TRACE() expands to nothing.
+ * Layout of the trace file: TRACE_HEADER, then TRACE_MAX_THREADS TRACE_RINGs.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAGIC "P2PTRACE"
+#define TRACE_RING_SIZE 65536// events per thread, power of 2
+#define TRACE_MAX_THREADS 32
+
+enum TRACE_ID {
+    TR_NONE = 0,
+    TR_REQUEST,     // a: request length
+    TR_REQUEST_DONE,// a: reply length
+    TR_QUEUE,       // request passed to workers, a: queue depth
+    TR_WORKER,      // worker took a request, a: worker index
+    TR_SEND,        // a: length
+    TR_SEND_DONE,   // a: result of transport_send
+    TR_FRAME,       // encoding of a frame of measurements started
+    TR_FRAME_DONE,  // a: frame length
+    TR_SETTER,      // b: first 8 characters of PV name
+    TR_SETTER_DONE, // a: result, b: first 8 characters of PV name
+    TR_COMMAND,     // command of a request, a: PARM_CMD, b: its first 8 characters
+    TR_PV,          // PV or group of a command, a: values or records, b: first 8 characters of its name
+    TR_NIDS
+};
+static const char* const trace_names[TR_NIDS] = {
+    "none", "request", "request_done", "queue", "worker", "send", "send_done",
+    "frame", "frame_done", "setter", "setter_done", "command", "pv",
+};
+struct TRACE_EVENT {
+    uint64_t t;     // CLOCK_MONOTONIC, ns
+    uint32_t id;    // TRACE_ID
+    uint32_t a;
+    uint64_t b;
+};
+struct TRACE_RING {
+    uint32_t tid;   // Linux thread id of the owner
+    uint32_t reserved;
+    uint64_t head;  // number of events written, the last is at head-1
+    TRACE_EVENT events[TRACE_RING_SIZE];
+};
+struct TRACE_HEADER {
+    char magic[8];
+    uint32_t nrings;    // claimed rings
+    uint32_t ring_size;
+};
+static inline uint64_t trace_tag(const char* name){
+    // Pack the first 8 characters of a name into an argument
+    uint64_t tag = 0;
+    strncpy((char*)&tag, name, sizeof(tag));
+    return tag;
+}
+
+#ifdef P2P_TRACE
+extern TRACE_HEADER* trace_map;
+extern thread_local TRACE_RING* trace_ring;
+TRACE_RING* trace_attach();
+static inline void trace_event(uint32_t id, uint32_t a, uint64_t b){
+    TRACE_RING* r = trace_ring;
+    if (r == NULL){
+        if (trace_map == NULL) return;// not started
+        r = trace_attach();
+        if (r == NULL) return;
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    TRACE_EVENT* e = &r->events[r->head & (TRACE_RING_SIZE - 1)];
+    e->t = t.tv_sec*1000000000ull + t.tv_nsec;
+    e->id = id;
+    e->a = a;
+    e->b = b;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+#define TRACE(id, a, b) trace_event(id, a, b)
+#else
+#define TRACE(id, a, b) ((void)0)
+#endif
+
+int trace_init(const char* path);// start tracing into the file
+#endif //TRACE_H
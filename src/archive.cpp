@@ -0,0 +1,160 @@
+/*``````````````````Archive of streamed measurements````````````````````````````
+* The CBOR frames of deliver_measurements(), which contain archivable (F_A)
+* PVs, are appended to memory-mapped segment files in the archive directory.
+* When a segment is full, it is truncated to its used size and the next one
+* is started. Each segment starts with a header, which holds a sparse index
+* of record timestamps, so a reader can find the offset of a given time
+* without scanning the segment.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "../include/defines.h"
+
+extern uint8_t DBG; // Defined in main program
+
+//``````````````````Archive variables``````````````````````````````````````````
+// The state of the archive writer is kept in the plant context.
+static ARCHIVE_HEADER* header(){
+    return (ARCHIVE_HEADER*)plant->archive.map;
+}
+static void segment_path(char* path, size_t n, uint32_t seq){
+    snprintf(path, n, "%s/%06u.p2a", plant->archive.dir, seq);
+}
+static void close_segment(){
+    if (plant->archive.map == NULL) return;
+    uint64_t used = header()->used;
+    msync(plant->archive.map, used, MS_ASYNC);
+    munmap(plant->archive.map, plant->archive.segment_size);
+    if (ftruncate(plant->archive.fd, used) != 0)
+        printf("WARNING_ARC: could not truncate segment %u\n", plant->archive.seq);
+    close(plant->archive.fd);
+    plant->archive.map = NULL;
+    plant->archive.fd = -1;
+}
+static int open_segment(uint32_t seq){
+    char path[300];
+    segment_path(path, sizeof(path), seq);
+    plant->archive.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (plant->archive.fd < 0){
+        printf("ERR_ARC: Could not create %s\n", path);
+        return 1;
+    }
+    if (ftruncate(plant->archive.fd, plant->archive.segment_size) != 0){
+        printf("ERR_ARC: Could not size %s\n", path);
+        close(plant->archive.fd);
+        return 1;
+    }
+    plant->archive.map = (uint8_t*) mmap(NULL, plant->archive.segment_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED, plant->archive.fd, 0);
+    if (plant->archive.map == MAP_FAILED){
+        printf("ERR_ARC: Could not map %s\n", path);
+        plant->archive.map = NULL;
+        close(plant->archive.fd);
+        return 1;
+    }
+    ARCHIVE_HEADER* h = header();
+    memset(h, 0, sizeof(ARCHIVE_HEADER));
+    memcpy(h->magic, ARCHIVE_MAGIC, sizeof(h->magic));
+    h->header_size = sizeof(ARCHIVE_HEADER);
+    h->used = sizeof(ARCHIVE_HEADER);
+    plant->archive.seq = seq;
+    plant->archive.last_indexed = 0;
+    if(DBG>=1) printf("ARC: Started segment %s\n", path);
+    return 0;
+}
+//``````````````````Archive functions``````````````````````````````````````````
+int archive_init(const char* dir, uint32_t segment_size){
+    // Start archiving to dir, the sequence continues after existing segments
+    strncpy(plant->archive.dir, dir, sizeof(plant->archive.dir)-1);
+    plant->archive.segment_size = segment_size;
+    uint32_t seq = 0;
+    DIR* d = opendir(dir);
+    if (d == NULL){
+        printf("ERR_ARC: No archive directory %s\n", dir);
+        return 1;
+    }
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL){
+        unsigned s;
+        if (sscanf(e->d_name, "%06u.p2a", &s) == 1 and s >= seq)
+            seq = s + 1;
+    }
+    closedir(d);
+    printf("ARC: Archiving to %s, starting with segment %u\n", dir, seq);
+    return open_segment(seq);
+}
+int archive_append(const uint8_t* frame, size_t len, const TD_timestamp* t){
+    // Append one frame, return 0 on success
+    if (plant->archive.map == NULL) return 1;
+    size_t reclen = sizeof(ARCHIVE_RECORD) + ARCHIVE_ALIGN(len);
+    if (sizeof(ARCHIVE_HEADER) + reclen > plant->archive.segment_size){
+        printf("WARNING_ARC: frame of %zu bytes does not fit in a segment\n", len);
+        return 1;
+    }
+    if (header()->used + reclen > plant->archive.segment_size){
+        close_segment();
+        if (open_segment(plant->archive.seq + 1)) return 1;
+    }
+    ARCHIVE_HEADER* h = header();
+    uint64_t offset = h->used;
+    ARCHIVE_RECORD* r = (ARCHIVE_RECORD*)(plant->archive.map + offset);
+    r->length = len;
+    r->t = *t;
+    memcpy(plant->archive.map + offset + sizeof(ARCHIVE_RECORD), frame, len);
+
+    // Sparse index, evenly spaced by bytes, so that it never overflows
+    if (h->nrecords == 0 or offset - plant->archive.last_indexed >=
+      plant->archive.segment_size/ARCHIVE_INDEX_SIZE){
+        if (h->nindex < ARCHIVE_INDEX_SIZE){
+            h->index[h->nindex].t = *t;
+            h->index[h->nindex].offset = offset;
+            h->nindex++;
+            plant->archive.last_indexed = offset;
+        }
+    }
+    if (h->nrecords == 0) h->first = *t;
+    h->last = *t;
+    h->nrecords++;
+    // Make the record visible to readers of the mapped file only when complete
+    __atomic_store_n(&h->used, offset + reclen, __ATOMIC_RELEASE);
+    return 0;
+}
+void archive_close(){
+    close_segment();
+}
+bool archive_active(){
+    // Archiving has been started and the current segment is open
+    return plant->archive.map != NULL;
+}
+//``````````````````Reader functions```````````````````````````````````````````
+static bool earlier(const TD_timestamp* a, const TD_timestamp* b){
+    return a->tv_sec < b->tv_sec or
+      (a->tv_sec == b->tv_sec and a->tv_nsec < b->tv_nsec);
+}
+uint64_t archive_find(const uint8_t* segment, const TD_timestamp* t){
+    /* Offset of the first record not earlier than t in the mapped segment,
+     * or the used size if there is none. The index gives the starting
+     * point, then only the records between two index entries are scanned.
+     */
+    const ARCHIVE_HEADER* h = (const ARCHIVE_HEADER*)segment;
+    uint32_t lo = 0, hi = h->nindex;
+    while (lo < hi){// first index entry not earlier than t
+        uint32_t mid = (lo + hi)/2;
+        if (earlier(&h->index[mid].t, t)) lo = mid + 1;
+        else hi = mid;
+    }
+    uint64_t offset = lo == 0? h->header_size: h->index[lo-1].offset;
+    uint64_t used = __atomic_load_n(&h->used, __ATOMIC_ACQUIRE);
+    while (offset < used){
+        const ARCHIVE_RECORD* r = (const ARCHIVE_RECORD*)(segment + offset);
+        if (not earlier(&r->t, t)) break;
+        offset += sizeof(ARCHIVE_RECORD) + ARCHIVE_ALIGN(r->length);
+    }
+    return offset;
+}
@@ -14,6 +14,25 @@ int my_index( const int a[], size_t size, int value )
 bool starts_with(const char *str1, const char *str2){
 	return strncmp(str1, str2, strlen(str2)) == 0;
 }
+bool glob_match(const char *pattern, const char *str){
+	// Match str against shell-like pattern with '*' and '?' wildcards
+	const char *star = NULL, *resume = NULL;
+	while (*str){
+		if (*pattern == '?' or *pattern == *str){
+			pattern++; str++;
+		}else if (*pattern == '*'){
+			star = pattern++;
+			resume = str;
+		}else if (star){
+			pattern = star + 1;
+			str = ++resume;
+		}else{
+			return false;
+		}
+	}
+	while (*pattern == '*') pattern++;
+	return *pattern == 0;
+}
 bool ends_with(const char *str1, const char *str2){
 	int l2 = strlen(str2);
 	int l1 = strlen(str1);
@@ -35,6 +54,43 @@ int array_length(uint32_t* shape){
     }
     return l;
 }
+void minmax_i64(const int64_t* v, uint32_t n, int64_t* pmin, int64_t* pmax){
+    // Min and max of an array. The bulk is processed with GCC vector
+    // extensions, which map to SIMD registers where the target has them.
+    typedef int64_t v4i64 __attribute__((vector_size(32)));
+    int64_t vmin = INT64_MAX, vmax = INT64_MIN;
+    uint32_t ii = 0;
+    if (n >= 4){
+        v4i64 lo, hi;
+        memcpy(&lo, v, sizeof(lo));
+        hi = lo;
+        for (ii=4; ii+4 <= n; ii+=4){
+            v4i64 x;
+            memcpy(&x, v+ii, sizeof(x));
+            lo = x < lo ? x : lo;
+            hi = x > hi ? x : hi;
+        }
+        for (int k=0; k<4; k++){
+            if (lo[k] < vmin) vmin = lo[k];
+            if (hi[k] > vmax) vmax = hi[k];
+        }
+    }
+    for (; ii<n; ii++){
+        if (v[ii] < vmin) vmin = v[ii];
+        if (v[ii] > vmax) vmax = v[ii];
+    }
+    *pmin = vmin;
+    *pmax = vmax;
+}
+void prefault(void* ptr, size_t len){
+    // Write each page of the buffer, so it is backed by memory in advance.
+    // The contents are kept.
+    volatile uint8_t* p = (volatile uint8_t*) ptr;
+    if (p == NULL) return;
+    for (size_t i=0; i < len; i += 4096){
+        p[i] = p[i];}
+    if (len != 0) p[len-1] = p[len-1];
+}
 //``````````````````Helper functions```````````````````````````````````````````
 int mssleep(long miliseconds){
     // Millisecond sleep. The function call alone takes 50 us
@@ -0,0 +1,497 @@
+/*``````````````````Native client of P2Plant```````````````````````````````````
+* See include/p2client.h. Messages are walked in place, by a minimal CBOR
+* reader, nothing is allocated or copied while decoding.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/msg.h>
+
+#include "../include/p2client.h"
+
+//``````````````````Requests```````````````````````````````````````````````````
+/* ["cmd", [names or [name, value]...], ..., "id", N], containers are
+ * indefinite, so commands can be appended without knowing their length.
+ */
+void P2Request::clear(){
+    len = 0;
+    overflow = false;
+    has_id = false;
+    in_list = false;
+    finished = false;
+    put_byte(0x9f);
+}
+void P2Request::put_byte(uint8_t b){
+    if (len == sizeof(buf)){
+        overflow = true;
+        return;
+    }
+    buf[len++] = b;
+}
+void P2Request::put_head(uint8_t major, uint64_t arg){
+    uint8_t h[9];
+    size_t n;
+    if (arg < 24){ h[0] = major << 5 | arg; n = 1;}
+    else if (arg <= 0xff){ h[0] = major << 5 | 24; n = 2;}
+    else if (arg <= 0xffff){ h[0] = major << 5 | 25; n = 3;}
+    else if (arg <= 0xffffffffull){ h[0] = major << 5 | 26; n = 5;}
+    else { h[0] = major << 5 | 27; n = 9;}
+    for (size_t i=1; i < n; i++){
+        h[i] = arg >> 8*(n-1-i);}
+    if (len + n > sizeof(buf)){
+        overflow = true;
+        return;
+    }
+    memcpy(buf + len, h, n);
+    len += n;
+}
+void P2Request::put_text(const char* s){
+    size_t n = strlen(s);
+    put_head(3, n);
+    if (overflow or len + n > sizeof(buf)){
+        overflow = true;
+        return;
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+}
+void P2Request::close_list(){
+    if (in_list){
+        put_byte(0xff);// break
+        in_list = false;
+    }
+}
+P2Request& P2Request::command(const char* cmd){
+    close_list();
+    put_text(cmd);
+    put_byte(0x9f);
+    in_list = true;
+    return *this;
+}
+P2Request& P2Request::name(const char* pvname){
+    put_text(pvname);
+    return *this;
+}
+P2Request& P2Request::set(const char* pvname, int64_t value){
+    put_head(4, 2);
+    put_text(pvname);
+    if (value < 0) put_head(1, -1 - value);
+    else put_head(0, value);
+    return *this;
+}
+P2Request& P2Request::set(const char* pvname, const char* value){
+    put_head(4, 2);
+    put_text(pvname);
+    put_text(value);
+    return *this;
+}
+P2Request& P2Request::set(const char* pvname, const int64_t* values, size_t n){
+    put_head(4, 2);
+    put_text(pvname);
+    put_head(4, n);
+    for (size_t i=0; i < n; i++){
+        if (values[i] < 0) put_head(1, -1 - values[i]);
+        else put_head(0, values[i]);
+    }
+    return *this;
+}
+P2Request& P2Request::history(const char* pvname, uint32_t nlast){
+    put_head(4, 2);
+    put_text(pvname);
+    put_head(0, nlast);
+    return *this;
+}
+P2Request& P2Request::id(int64_t request_id_){
+    close_list();
+    put_text("id");
+    if (request_id_ < 0) put_head(1, -1 - request_id_);
+    else put_head(0, request_id_);
+    has_id = true;
+    request_id = request_id_;
+    return *this;
+}
+size_t P2Request::finish(){
+    if (not finished){
+        close_list();
+        put_byte(0xff);
+        finished = true;
+    }
+    return overflow? 0: len;
+}
+//``````````````````CBOR reader````````````````````````````````````````````````
+struct Cursor {
+    const uint8_t* p;
+    const uint8_t* end;
+};
+static bool read_head(Cursor* c, uint8_t* major, uint64_t* arg, bool* indefinite){
+    // Read the head of the next item, *arg of floats is their bit pattern
+    if (c->p >= c->end) return false;
+    uint8_t ai = *c->p & 0x1f;
+    *major = *c->p++ >> 5;
+    *indefinite = ai == 31;
+    size_t n = ai < 24 or ai == 31? 0: ai == 24? 1: ai == 25? 2: ai == 26? 4: ai == 27? 8: 99;
+    if (n == 99 or (size_t)(c->end - c->p) < n) return false;
+    *arg = ai < 24? ai: 0;
+    for (size_t i=0; i < n; i++){
+        *arg = *arg << 8 | *c->p++;}
+    return true;
+}
+static bool at_break(Cursor* c){
+    if (c->p < c->end and *c->p == 0xff){
+        c->p++;
+        return true;
+    }
+    return false;
+}
+static bool skip(Cursor* c, int depth=0){
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    if (depth > 32 or not read_head(c, &major, &arg, &indefinite)) return false;
+    switch (major){
+    case 2: case 3:
+        if (indefinite){
+            while (not at_break(c)){
+                if (not skip(c, depth+1)) return false;}
+        }else{
+            if ((uint64_t)(c->end - c->p) < arg) return false;
+            c->p += arg;
+        }
+        return true;
+    case 4: case 5:{
+        uint64_t n = major == 5? 2*arg: arg;
+        for (uint64_t i=0; indefinite or i < n; i++){
+            if (indefinite and at_break(c)) break;
+            if (not skip(c, depth+1)) return false;
+        }
+        return true;
+    }
+    case 6:
+        return skip(c, depth+1);
+    default:
+        return true;
+    }
+}
+static bool read_text(Cursor* c, const char** s, uint32_t* n){
+    // Definite text string, pointing into the message
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    Cursor save = *c;
+    if (not read_head(c, &major, &arg, &indefinite) or major != 3 or indefinite
+      or (uint64_t)(c->end - c->p) < arg){
+        *c = save;
+        return false;
+    }
+    *s = (const char*)c->p;
+    *n = arg;
+    c->p += arg;
+    return true;
+}
+static bool read_int(Cursor* c, int64_t* v){
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    Cursor save = *c;
+    if (not read_head(c, &major, &arg, &indefinite) or major > 1){
+        *c = save;
+        return false;
+    }
+    *v = major == 0? (int64_t)arg: -1 - (int64_t)arg;
+    return true;
+}
+static double half_to_double(uint16_t h){
+    int e = h >> 10 & 0x1f;
+    double m = h & 0x3ff;
+    double v = e == 0? m*(1.0/16777216): e == 31? (m? 0.0/0.0: 1.0/0.0):
+      (1024 + m)*((double)(1 << e)/33554432);
+    return h & 0x8000? -v: v;
+}
+static bool text_is(const char* s, uint32_t n, const char* key){
+    return strlen(key) == n and memcmp(s, key, n) == 0;
+}
+static bool read_tagged_bytes(Cursor* c, uint64_t* tag, const uint8_t** data,
+  uint32_t* nbytes){
+    // tag(bytes), as encode_taggedBuffer() of the plant
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    if (not read_head(c, &major, tag, &indefinite) or major != 6) return false;
+    if (not read_head(c, &major, &arg, &indefinite) or major != 2 or indefinite
+      or (uint64_t)(c->end - c->p) < arg){
+        return false;}
+    *data = c->p;
+    *nbytes = arg;
+    c->p += arg;
+    return true;
+}
+static bool decode_value(Cursor* c, P2Item* item){
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    Cursor start = *c;
+    if (not read_head(c, &major, &arg, &indefinite)) return false;
+    switch (major){
+    case 0: case 1:
+        item->kind = P2K_INT;
+        item->i = major == 0? (int64_t)arg: -1 - (int64_t)arg;
+        return true;
+    case 3:
+        *c = start;
+        item->kind = P2K_TEXT;
+        if (read_text(c, &item->text, &item->text_len)) return true;
+        break;
+    case 6:
+        *c = start;
+        item->kind = P2K_ARRAY;
+        if (read_tagged_bytes(c, &item->tag, &item->data, &item->nbytes)) return true;
+        break;
+    case 7:{
+        uint8_t ai = *start.p & 0x1f;
+        if (ai == 20 or ai == 21){
+            item->kind = P2K_INT;
+            item->i = ai == 21;
+            return true;
+        }
+        item->kind = P2K_FLOAT;
+        if (ai == 25){ item->f = half_to_double(arg); return true;}
+        if (ai == 26){ uint32_t b = arg; float f; memcpy(&f, &b, 4); item->f = f; return true;}
+        if (ai == 27){ memcpy(&item->f, &arg, 8); return true;}
+        break;
+    }
+    }
+    *c = start;
+    item->kind = P2K_OTHER;
+    return skip(c);
+}
+static bool decode_item(Cursor* c, P2Item* item){
+    // Map of a PV: {"shape": [...], "v": value, "t": timestamps} or {"ERR": msg}
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    item->map = c->p;
+    if (not read_head(c, &major, &arg, &indefinite) or major != 5) return false;
+    for (uint64_t i=0; indefinite or i < arg; i++){
+        if (indefinite and at_break(c)) break;
+        const char* key;
+        uint32_t n;
+        if (not read_text(c, &key, &n)){
+            if (not skip(c) or not skip(c)) return false;
+            continue;
+        }
+        if (text_is(key, n, "v")){
+            if (not decode_value(c, item)) return false;
+        }else if (text_is(key, n, "ERR")){
+            item->kind = P2K_ERROR;
+            if (not read_text(c, &item->text, &item->text_len)) return false;
+        }else if (text_is(key, n, "t")){
+            uint64_t tag;
+            uint32_t nbytes;
+            if (not read_tagged_bytes(c, &tag, &item->times, &nbytes)) return false;
+            item->ntimes = nbytes/sizeof(P2Timestamp);
+        }else if (text_is(key, n, "shape")){
+            uint8_t amajor;
+            uint64_t count;
+            bool aindefinite;
+            if (not read_head(c, &amajor, &count, &aindefinite) or amajor != 4) return false;
+            for (uint64_t k=0; aindefinite or k < count; k++){
+                if (aindefinite and at_break(c)) break;
+                int64_t dim;
+                if (not read_int(c, &dim)) return false;
+                if (item->ndim < P2C_MAX_DIMENSION){
+                    item->shape[item->ndim++] = dim;}
+            }
+        }else if (not skip(c)){
+            return false;}
+    }
+    item->map_len = c->p - item->map;
+    return true;
+}
+int p2c_decode(const uint8_t* msg, size_t len, P2Reply* reply, P2Item* items,
+  int capacity){
+    /* Top level: ["Subscription"?, "id"?, N?, name, {map}, ..., "ERR: ..."?]
+     * A text, which is not followed by a map, is an error of the request.
+     */
+    Cursor c = {msg, msg + len};
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    memset(reply, 0, sizeof(*reply));
+    if (not read_head(&c, &major, &arg, &indefinite) or major != 4) return -1;
+    for (uint64_t i=0; indefinite or i < arg; i++){
+        if (indefinite and at_break(&c)) break;
+        const char* s;
+        uint32_t n;
+        if (not read_text(&c, &s, &n)){
+            if (not skip(&c)) return -1;
+            continue;
+        }
+        if (i == 0 and text_is(s, n, "Subscription")){
+            reply->subscription = true;
+            continue;
+        }
+        if (text_is(s, n, "id") and read_int(&c, &reply->id)){
+            reply->has_id = true;
+            i++;
+            continue;
+        }
+        if (c.p >= c.end or *c.p >> 5 != 5){
+            reply->error = s;
+            reply->error_len = n;
+            continue;
+        }
+        i++;
+        if (reply->nitems == capacity){
+            reply->nskipped++;
+            if (not skip(&c)) return -1;
+            continue;
+        }
+        P2Item* item = &items[reply->nitems++];
+        memset(item, 0, sizeof(*item));
+        item->name = s;
+        item->name_len = n;
+        if (not decode_item(&c, item)) return -1;
+    }
+    return 0;
+}
+const P2Item* p2c_find(const P2Item* items, int nitems, const char* name){
+    for (int i=0; i < nitems; i++){
+        if (items[i].is(name)) return &items[i];}
+    return NULL;
+}
+static bool map_find(const P2Item* item, const char* key, Cursor* c){
+    // Position c at the value of key in the map of item
+    uint8_t major;
+    uint64_t arg;
+    bool indefinite;
+    c->p = item->map;
+    c->end = item->map + item->map_len;
+    if (item->map == NULL or not read_head(c, &major, &arg, &indefinite)) return false;
+    for (uint64_t i=0; indefinite or i < arg; i++){
+        if (indefinite and at_break(c)) break;
+        const char* k;
+        uint32_t n;
+        bool is_text = read_text(c, &k, &n);
+        if (is_text and text_is(k, n, key)) return true;
+        if ((not is_text and not skip(c)) or not skip(c)) return false;
+    }
+    return false;
+}
+bool p2c_map_text(const P2Item* item, const char* key, const char** text,
+  uint32_t* len){
+    Cursor c;
+    return map_find(item, key, &c) and read_text(&c, text, len);
+}
+bool p2c_map_int(const P2Item* item, const char* key, int64_t* value){
+    Cursor c;
+    return map_find(item, key, &c) and read_int(&c, value);
+}
+//``````````````````IPC transport``````````````````````````````````````````````
+// The client sends to the receive queue of the plant and receives from its
+// send queue, see src/transport_ipc.cpp.
+struct IpcMessage {
+    long mesg_type;
+    uint8_t buf[];
+};
+struct IpcTransport {
+    int qsnd;
+    int qrcv;
+    IpcMessage* msg;
+    size_t size;    // of msg->buf, grows up to P2C_MAX_MESSAGE_SIZE
+};
+static int ipc_send(void* ctx, const uint8_t* msg, size_t len){
+    IpcTransport* t = (IpcTransport*) ctx;
+    if (len > t->size) return -1;
+    t->msg->mesg_type = 1;
+    memcpy(t->msg->buf, msg, len);
+    return msgsnd(t->qsnd, t->msg, len, 0);
+}
+static int ipc_recv(void* ctx, const uint8_t** msg, int timeout_ms){
+    IpcTransport* t = (IpcTransport*) ctx;
+    struct timespec t0, now;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (true){
+        int n = msgrcv(t->qrcv, t->msg, t->size, 0,
+          timeout_ms < 0? 0: IPC_NOWAIT);
+        *msg = t->msg->buf;
+        if (n >= 0) return n;
+        if (errno == E2BIG and t->size < P2C_MAX_MESSAGE_SIZE){
+            // The message stays in the queue, receive it into a larger buffer
+            IpcMessage* m = (IpcMessage*) realloc(t->msg, sizeof(IpcMessage) + 2*t->size);
+            if (m == NULL) return -1;
+            t->msg = m;
+            t->size *= 2;
+            continue;
+        }
+        if (errno != ENOMSG and errno != EINTR) return -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - t0.tv_sec)*1000 + (now.tv_nsec - t0.tv_nsec)/1000000
+          >= timeout_ms){
+            return 0;}
+        sched_yield();
+    }
+}
+static void ipc_close(void* ctx){
+    free(((IpcTransport*) ctx)->msg);
+    free(ctx);
+}
+int p2c_open_ipc(P2Transport* t, uint8_t plant_id){
+    key_t key = ftok("/tmp/ipcbor.ftok", 65 + plant_id);
+    if (key == -1){
+        printf("P2C:ERR. Could not create IPC Message Key. Please do: 'touch  /tmp/ipcbor.ftok'\n");
+        return 1;
+    }
+    IpcTransport* ipc = (IpcTransport*) malloc(sizeof(IpcTransport));
+    if (ipc == NULL) return 1;
+    ipc->size = P2C_MESSAGE_SIZE;
+    ipc->msg = (IpcMessage*) malloc(sizeof(IpcMessage) + ipc->size);
+    if (ipc->msg == NULL){
+        free(ipc);
+        return 1;
+    }
+    ipc->qsnd = msgget(key, 0666 | IPC_CREAT);
+    ipc->qrcv = msgget(key+1, 0666 | IPC_CREAT);
+    if (ipc->qsnd < 0 or ipc->qrcv < 0){
+        printf("P2C:ERR. Could not open IPC queues of plant %u\n", plant_id);
+        free(ipc->msg);
+        free(ipc);
+        return 1;
+    }
+    t->ctx = ipc;
+    t->send = ipc_send;
+    t->recv = ipc_recv;
+    t->close = ipc_close;
+    return 0;
+}
+void p2c_close(P2Transport* t){
+    if (t->close != NULL) t->close(t->ctx);
+    t->ctx = NULL;
+    t->send = NULL;
+    t->recv = NULL;
+    t->close = NULL;
+}
+//``````````````````Client`````````````````````````````````````````````````````
+int P2Client::send(P2Request* r){
+    size_t n = r->finish();
+    if (n == 0) return -1;
+    return transport.send(transport.ctx, r->buf, n);
+}
+int P2Client::receive(int timeout_ms){
+    const uint8_t* msg;
+    int n = transport.recv(transport.ctx, &msg, timeout_ms);
+    if (n <= 0) return n;
+    if (p2c_decode(msg, n, &reply, items, capacity) != 0) return -1;
+    return n;
+}
+int P2Client::request(P2Request* r, int timeout_ms){
+    if (send(r) != 0) return -1;
+    while (true){
+        int n = receive(timeout_ms);
+        if (n <= 0) return n;
+        if (reply.subscription) continue;
+        if (r->has_id and (not reply.has_id or reply.id != r->request_id)) continue;
+        return n;
+    }
+}
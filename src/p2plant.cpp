@@ -1,22 +1,33 @@
 /*````````````````Base functions of the P2Plant.
 It supposed to run on a bare metal firmware (STM32 MCU, CommonPlatform hardware).
-Supported commands: info, get, set.
+Supported commands: info, get, set, group, history.
 The 'subscribe' command is considered unnecessary. The 'run start/stop' should
 handle the subscription activation.
 */
 const char* VERSION = "1.0.1 2025-03-07";//deliver_measurements()
 #include <stdio.h>
 #include <stdlib.h>// for free()
+#include <new>// for placement new
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <errno.h>
+#include <malloc.h>
 
 #include "../include/defines.h"
+#include "../include/trace.h"
 #include "../../tinycbor/src/cborjson.h"
 
 //``````````````````Globals````````````````````````````````````````````````````
-extern uint8_t DBG; // Defined in main program
-uint16_t NPV = 0;// Number of parameters
-bool plant_client_alive = true;// if not, then subscription will be suspended
-static uint32_t transport_send_failure = 0;
-extern int  encode_measurements();//defined in pv.h, instantiated in main
+static Plant plant_default;
+thread_local Plant* plant = &plant_default;
+thread_local PlantSession* session = &plant_default.session;
+extern int  encode_measurements(TD_timestamp* archive_time);//defined in pv.h, instantiated in main
+extern size_t encode_measurements_parallel(uint8_t* buf, size_t bufsize,
+  TD_timestamp* archive_time);//defined in pv.h
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
 //``````````````````Command handlers```````````````````````````````````````````
 
@@ -25,11 +36,17 @@ enum PARM_COMMAND {// like in ADO architecture
     PARM_CMD_GET = 1,
     PARM_CMD_SET = 2,
     PARM_CMD_SUBSCRIBE = 3,
+    PARM_CMD_GROUP = 4,
+    PARM_CMD_HISTORY = 5,
 };
 
 static int parm_dispatch(int cmd, const char* parmName, CborValue* value=NULL){
+    // The commands do not modify the plant, so they may be re-run into a
+    // larger buffer, see encoder_retry()
     int ret = 1;
-    switch (cmd) {
+    CborEncoder mark;
+    encoder_mark(&mark);
+    do switch (cmd) {
     case PARM_CMD_INFO: {
         ret = parm_info(parmName);
         break;
@@ -38,11 +55,19 @@ static int parm_dispatch(int cmd, const char* parmName, CborValue* value=NULL){
         ret = parm_get(parmName);
         break;
         }
+    case PARM_CMD_GROUP: {
+        ret = parm_group(parmName);
+        break;
+        }
+    case PARM_CMD_HISTORY: {
+        ret = parm_history(parmName, UINT32_MAX, NULL, 0);
+        break;
+        }
     /*case PARM_CMD_SUBSCRIBE: {
         ret = plant_subscribe(parmName);
         }
         break;*/
-    }
+    } while (encoder_retry(&mark, parmName));
     return ret;
 }
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
@@ -59,12 +84,6 @@ static int parm_dispatch(int cmd, const char* parmName, CborValue* value=NULL){
         }                                                                         \
     } while (0)
 
-static void indent(int nestingLevel)
-{
-    while (nestingLevel--) {
-        if(DBG>=2) printf("  ");
-    }
-}
 void dumpbytes(const uint8_t *buf, size_t len)
 {
     while (len--) {
@@ -72,51 +91,118 @@ void dumpbytes(const uint8_t *buf, size_t len)
     }
 }
 //Decode CBOR data manually
-static CborParser root_parser;
-static CborEncoder root_encoder;
-static CborEncoder branch_encoder;
+static CborError parse_int_array(CborValue *it, const char* parName,
+  size_t* count){
+    /* Decode all elements of an integer array into session->int_array.
+     * On a wrong element or an empty array the error is reported and count
+     * is set to 0. The scratch has been sized for the message by
+     * plant_session_reserve(), each element takes at least one byte of it,
+     * so the length claimed by the client is not trusted.
+     */
+    CborValue recursed;
+    CborError ret;
+    size_t n = 0;
+    bool valid = true;
+    char msg[48];
+    ret = cbor_value_enter_container(it, &recursed);
+    if (ret != CborNoError) return ret;
+    while (!cbor_value_at_end(&recursed)){
+        uint64_t raw = 0;
+        if (valid){
+            if (!cbor_value_is_integer(&recursed)){
+                snprintf(msg, sizeof(msg), "Not an integer at index %u", (uint)n);
+                valid = false;
+            }else if (cbor_value_get_raw_integer(&recursed, &raw) != CborNoError
+              or raw > (uint64_t)INT64_MAX){
+                snprintf(msg, sizeof(msg), "Integer out of range at index %u", (uint)n);
+                valid = false;
+            }else if (n == session->int_array_size){
+                snprintf(msg, sizeof(msg), "Array is too long");
+                valid = false;
+            }
+            if (!valid){
+                encode_error(&session->branch_encoder, parName, msg);}
+        }
+        if (valid){
+            cbor_value_get_int64(&recursed, &session->int_array[n++]);}
+        ret = cbor_value_advance(&recursed);
+        if (ret != CborNoError) return ret;
+    }
+    if (valid and n == 0){
+        encode_error(&session->branch_encoder, parName, "Empty array");}
+    *count = valid ? n : 0;
+    return cbor_value_leave_container(it, &recursed);
+}
+static bool single_name(const CborValue *it){
+    // Check if the array holds only one text string
+    CborValue recursed;
+    if (cbor_value_enter_container(it, &recursed) != CborNoError
+      or !cbor_value_is_text_string(&recursed)
+      or cbor_value_advance(&recursed) != CborNoError){
+        return false;}
+    return cbor_value_at_end(&recursed);
+}
 static CborError parse_cbor_buffer(CborValue *it, int nestingLevel)
 {
-    static int parm_cmd = 0;
-    static CborTag parm_tag = 0;
-    static char parName[80];
     CborError ret = CborNoError;
     int hosterror = 0;
     int item = 0;
     while (!cbor_value_at_end(it)) {
         CborType type = cbor_value_get_type(it);
-        indent(nestingLevel);
         switch (type) {
         case CborArrayType: {
             CborValue recursed;
             assert(cbor_value_is_container(it));
+            if (session->parm_cmd == PARM_CMD_SET && nestingLevel == 3 && item == 1){
+                // Array value of a set pair: decode it in one pass
+                size_t count = 0;
+                ret = parse_int_array(it, session->par_name, &count);
+                CBOR_CHECK(ret, "parse int array failed", err, ret);
+                item++;
+                if (count != 0){
+                    CborEncoder mark;
+                    encoder_mark(&mark);
+                    hosterror = parm_set(session->par_name, type, session->int_array, count);
+                    assert(!hosterror);
+                }
+                continue;
+            }
             item = 0;
-            if(DBG>=2) puts("Array[");
-            if(DBG>=3) printf("array nesting %i\n",nestingLevel);
+            // [name] of a get or history without a timestamp or count is
+            // served as the plain name
+            bool bare_name = (session->parm_cmd == PARM_CMD_GET
+              || session->parm_cmd == PARM_CMD_HISTORY)
+              && nestingLevel == 2 && single_name(it);
             ret = cbor_value_enter_container(it, &recursed);
             CBOR_CHECK(ret, "enter container failed", err, ret);
             ret = parse_cbor_buffer(&recursed, nestingLevel + 1);
             CBOR_CHECK(ret, "recursive dump failed", err, ret);
             ret = cbor_value_leave_container(it, &recursed);
             CBOR_CHECK(ret, "leave container failed", err, ret);
-            indent(nestingLevel);
-            if(DBG>=2) puts("]");
-            if(DBG>=3) printf("<nesting %i\n",nestingLevel);
+            if (session->parm_cmd == PARM_CMD_GROUP && nestingLevel == 2){
+                // Group definition finished, reply with its members
+                if (session->group_pending){// [name] defines an empty group
+                    session->group_pending = false;
+                    parm_group_define(session->par_name);
+                }
+                ret = (CborError) (parm_dispatch(session->parm_cmd, session->par_name));
+                CBOR_CHECK(ret, "dispatch failed\n", err, ret);
+            }
+            if (bare_name){
+                ret = (CborError) (parm_dispatch(session->parm_cmd, session->par_name));
+                CBOR_CHECK(ret, "dispatch failed\n", err, ret);
+            }
             continue;
         }
         case CborMapType: {
             CborValue recursed;
             assert(cbor_value_is_container(it));
-            if(DBG>=2) puts("Map{");
-            if(DBG>=3) printf("map nesting %i\n",nestingLevel);
             ret = cbor_value_enter_container(it, &recursed);
             CBOR_CHECK(ret, "enter container failed", err, ret);
             ret = parse_cbor_buffer(&recursed, nestingLevel + 1);
             CBOR_CHECK(ret, "recursive dump failed", err, ret);
             ret = cbor_value_leave_container(it, &recursed);
             CBOR_CHECK(ret, "leave container failed", err, ret);
-            indent(nestingLevel);
-            if(DBG>=2) puts("}");
             continue;
         }
         case CborIntegerType: {
@@ -124,98 +210,145 @@ static CborError parse_cbor_buffer(CborValue *it, int nestingLevel)
             ret = cbor_value_get_int64(it, &val);
             CBOR_CHECK(ret, "parse int64 failed", err, ret);
             item++;
-            if(DBG>=2) printf("%lld\n", (long long)val);
-            if(DBG>=3) printf("nesting %i, item %i\n",nestingLevel, item);
-            if (parm_cmd == PARM_CMD_SET){
+            if (nestingLevel == 1 && session->request_id_expected){
+                // Already echoed on top of the reply, see request_id_of()
+                session->request_id_expected = false;
+                break;
+            }
+            if (session->parm_cmd == PARM_CMD_GROUP && nestingLevel == 3){
+                // [name, flag] changes the flag of an existing group
+                session->group_pending = false;
+                parm_group_share_timestamp(session->par_name, val != 0);
+            }
+            if (session->parm_cmd == PARM_CMD_HISTORY && nestingLevel == 3 && item == 2){
+                // History of the last N values: [name, N]
+                CborEncoder mark;
+                encoder_mark(&mark);
+                do parm_history(session->par_name, val < 0? 0: (uint32_t)val, NULL, 0);
+                while (encoder_retry(&mark, session->par_name));
+            }
+            if (session->parm_cmd == PARM_CMD_SET){
                 if (nestingLevel == 3){
-                    hosterror = parm_set(parName, type, &val, 1);
+                    CborEncoder mark;
+                    encoder_mark(&mark);// room for the reply, setters are not re-run
+                    hosterror = parm_set(session->par_name, type, &val, 1);
                     assert(!hosterror);
                 }            }
             break;
         }
         case CborByteStringType: {
-            uint8_t *buf;
-            size_t n;
-            ret = cbor_value_dup_byte_string(it, &buf, &n, it);
+            // Strings are copied into the scratch of the session, which fits
+            // any string of the request, see plant_session_reserve()
+            uint8_t *buf = (uint8_t*) session->text;
+            size_t n = session->text_size;
+            ret = cbor_value_copy_byte_string(it, buf, &n, it);
             CBOR_CHECK(ret, "parse byte string failed", err, ret);
             item++;
-            if(DBG>=3){
-                printf("Bytes[%li]\n",n);
-                dumpbytes(buf, n);
-                puts("");
+            CborEncoder mark;
+            encoder_mark(&mark);
+            if(session->parm_cmd == PARM_CMD_SET && nestingLevel == 3 && session->parm_tag != 0){
+                parm_set_tagged(session->par_name, session->parm_tag, buf, n);
+            }else if(session->parm_cmd == PARM_CMD_GET && nestingLevel == 3 && item == 2){
+                // Conditional get: [name, timestamp]
+                do parm_get_if_newer(session->par_name, buf, n);
+                while (encoder_retry(&mark, session->par_name));
+            }else if(session->parm_cmd == PARM_CMD_HISTORY && nestingLevel == 3 && item == 2){
+                // History since timestamp: [name, timestamp]
+                do parm_history(session->par_name, UINT32_MAX, buf, n);
+                while (encoder_retry(&mark, session->par_name));
             }
-            if(nestingLevel == 3 && parm_tag != 0){
-                parm_set_tagged(parName, parm_tag, buf, n);}
-            free(buf);
             continue;
         }
         case CborTextStringType: {
-            char *buf;
-            size_t n;
-            ret = cbor_value_dup_text_string(it, &buf, &n, it);
+            char *buf = session->text;
+            size_t n = session->text_size;
+            ret = cbor_value_copy_text_string(it, buf, &n, it);
             CBOR_CHECK(ret, "parse text string failed", err, ret);
             item++;
-            //if(DBG>=2) puts(buf);
-            if(DBG>=3) printf("text level %i, item %i: `%s`\n",nestingLevel,item,buf);
-            if(nestingLevel == 1){
+            if(nestingLevel == 1 && session->request_id_expected){
+                printf("P2P:ERR: Request id is not an integer\n");
+                cbor_encode_text_stringz(&session->branch_encoder, "ERR: Request id is not an integer");
+                return CborUnknownError;
+            }
+            if(nestingLevel == 1 && strcmp(buf, "id") == 0){
+                session->request_id_expected = true;
+            }else if(nestingLevel == 1){
                 if (starts_with(buf, "info")){
-                    parm_cmd = PARM_CMD_INFO;
+                    session->parm_cmd = PARM_CMD_INFO;
                 }else if (starts_with(buf, "get")){
-                    parm_cmd = PARM_CMD_GET;
+                    session->parm_cmd = PARM_CMD_GET;
                 }else if (starts_with(buf, "set")){
-                    parm_cmd = PARM_CMD_SET;
+                    session->parm_cmd = PARM_CMD_SET;
+                }else if (starts_with(buf, "group")){
+                    session->parm_cmd = PARM_CMD_GROUP;
+                }else if (starts_with(buf, "history")){
+                    session->parm_cmd = PARM_CMD_HISTORY;
                 /*}else if (starts_with(buf, "subscribe")){
-                    parm_cmd = PARM_CMD_SUBSCRIBE;*/
+                    session->parm_cmd = PARM_CMD_SUBSCRIBE;*/
                 }else{
                     //CBOR_CHECK(1, "Wrong command", err, ret);
                     printf("P2P:ERR: Wrong command `%s`\n",buf);
-                    cbor_encode_text_stringz(&branch_encoder, "ERR: Wrong command");
+                    cbor_encode_text_stringz(&session->branch_encoder, "ERR: Wrong command");
                     return CborUnknownError;
                 }
-                if(DBG>=3) printf("Command started: %s, enum:%i\n", buf, parm_cmd);
+                TRACE(TR_COMMAND, session->parm_cmd, trace_tag(buf));
             }else if (nestingLevel == 2){
-                ret = (CborError) (parm_dispatch(parm_cmd, buf));
+                ret = (CborError) (parm_dispatch(session->parm_cmd, buf));
                 CBOR_CHECK(ret, "dispatch failed\n", err, ret);
-            }else if (parm_cmd == PARM_CMD_SET && nestingLevel == 3){
+            }else if ((session->parm_cmd == PARM_CMD_GET || session->parm_cmd == PARM_CMD_HISTORY)
+              && nestingLevel == 3){
+                //Save parName for conditional get or history
+                if (item == 1){
+                    strncpy(session->par_name, buf, sizeof(session->par_name));
+                }
+            }else if (session->parm_cmd == PARM_CMD_GROUP && nestingLevel == 3){
+                //Group definition: [name, pattern, ..., flag]
+                if (item == 1){
+                    strncpy(session->par_name, buf, sizeof(session->par_name));
+                    session->group_pending = true;
+                }else{
+                    if (session->group_pending){
+                        session->group_pending = false;
+                        parm_group_define(session->par_name);
+                    }
+                    parm_group_add(session->par_name, buf);
+                }
+            }else if (session->parm_cmd == PARM_CMD_SET && nestingLevel == 3){
                 //Save parName for set command
                 if (item == 1){
-                    strncpy(parName, buf, sizeof(parName));
+                    strncpy(session->par_name, buf, sizeof(session->par_name));
                 }else if(item == 2){
-                    hosterror = parm_set(parName, type, buf, 1);
+                    CborEncoder mark;
+                    encoder_mark(&mark);
+                    hosterror = parm_set(session->par_name, type, buf, 1);
                     assert(!hosterror);
                 }
             }
-            free(buf);
             continue;
         }
         case CborTagType: {
             CborTag tag;
             ret = cbor_value_get_tag(it, &tag);
             CBOR_CHECK(ret, "parse tag failed", err, ret);
-            if(DBG>=2) printf("Tag(%lld)\n", (long long)tag);
             if(nestingLevel == 3){
-                parm_tag = tag;}
+                session->parm_tag = tag;}
             break;
         }
         case CborSimpleType: {
             uint8_t type;
             ret = cbor_value_get_simple_type(it, &type);
             CBOR_CHECK(ret, "parse simple type failed", err, ret);
-            if(DBG>=2) printf("simple(%u)\n", type);
             break;
         }
         case CborNullType:
-            if(DBG>=2) puts("null");
             break;
         /*
         case CborUndefinedType:
-            if(DBG>=2) puts("undefined");
             break;
         case CborBooleanType: {
             bool val;
             ret = cbor_value_get_boolean(it, &val);
             CBOR_CHECK(ret, "parse boolean type failed", err, ret);
-            if(DBG>=2) puts(val ? "true" : "false");
             break;
         }
         case CborHalfFloatType: {
@@ -223,7 +356,6 @@ static CborError parse_cbor_buffer(CborValue *it, int nestingLevel)
             ret = cbor_value_get_half_float(it, &val);
             CBOR_CHECK(ret, "parse half float type failed", err, ret);
             item++;
-            if(DBG>=2) printf("__f16(%04x)\n", val);
             break;
         }
         case CborFloatType: {
@@ -231,16 +363,13 @@ static CborError parse_cbor_buffer(CborValue *it, int nestingLevel)
             ret = cbor_value_get_float(it, &val);
             CBOR_CHECK(ret, "parse float type failed", err, ret);
             item++;
-            if(DBG>=2) printf("%g\n", val);
             break;
         }
         case CborDoubleType: {
             double val;
             ret = cbor_value_get_double(it, &val);
-            if(DBG>=1) printf("Double %g\n",val); 
             CBOR_CHECK(ret, "parse double float type failed", err, ret);
             item++;
-            if(DBG>=2) printf("%g\n", val);
             break;
         }
         case CborInvalidType: {
@@ -250,7 +379,7 @@ static CborError parse_cbor_buffer(CborValue *it, int nestingLevel)
         }
         */
         default: {
-            encode_error(&branch_encoder, parName, "in parse_cbor_buffer: Not supported type");
+            encode_error(&session->branch_encoder, session->par_name, "in parse_cbor_buffer: Not supported type");
             break;
         }
         }
@@ -263,89 +392,965 @@ err:
 }
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
 //``````````````````Main loop helper functions`````````````````````````````````
-uint8_t *encoder_buffer;
-uint32_t encoder_bufsize;
-
+Plant* plant_create(uint8_t id){
+    // Create a plant, its IPC queues will use ftok project id 65+id
+    void* mem = malloc(sizeof(Plant));
+    if (mem == NULL) return NULL;
+    Plant* p = new (mem) Plant();// placement new: no C++ runtime needed
+    p->id = id;
+    return p;
+}
+void plant_select(Plant* p){
+    // Select the plant for the calling thread
+    plant = p;
+    session = &p->session;
+}
 void plant_init(uint8_t *buf, uint32_t bufsize){
-    encoder_buffer = buf;
-    encoder_bufsize = bufsize;
+    session->encoder_buffer = buf;
+    session->encoder_bufsize = bufsize;
 }
 
+int plant_session_reserve(uint32_t msglen){
+    /* Size the scratch of the parser of the calling thread for requests of
+     * msglen bytes, all their strings and integer arrays fit, so parsing
+     * of such requests does not allocate.
+     */
+    if (msglen + 1 > session->text_size){
+        char* text = (char*) realloc(session->text, msglen + 1);
+        if (text == NULL) return 1;
+        session->text = text;
+        session->text_size = msglen + 1;
+    }
+    if (msglen > session->int_array_size){
+        int64_t* a = (int64_t*) realloc(session->int_array, msglen*sizeof(int64_t));
+        if (a == NULL) return 1;
+        session->int_array = a;
+        session->int_array_size = msglen;
+    }
+    return 0;
+}
 void init_encoder(bool subscription){
     // Init encoder. If subscription is True then "Subscription" will be encoded on top.
-    cbor_encoder_init(&root_encoder, encoder_buffer, encoder_bufsize, 0);
-    cbor_encoder_create_array(&root_encoder, &branch_encoder, CborIndefiniteLength);
+    cbor_encoder_init(&session->root_encoder, session->encoder_buffer, session->encoder_bufsize, 0);
+    cbor_encoder_create_array(&session->root_encoder, &session->branch_encoder, CborIndefiniteLength);
     if(subscription){
-        cbor_encode_text_stringz(&branch_encoder, "Subscription");}
+        cbor_encode_text_stringz(&session->branch_encoder, "Subscription");}
 }
 void close_encoder(){
-    cbor_encoder_close_container(&root_encoder, &branch_encoder);
+    cbor_encoder_close_container(&session->root_encoder, &session->branch_encoder);
 }
-void send_encoded_buffer(uint8_t *buf){
-    CborValue it;
-    size_t buflen = cbor_encoder_get_buffer_size(&root_encoder, buf);
-    assert(buflen < encoder_bufsize && "Buffer size too small");
-    if(DBG>=2) printf("P2P:encoded buffer size %i:\n", buflen);
+static int encoder_grow(size_t need){
+    // Move the reply into a buffer of at least need bytes. The branch encoder
+    // must not be in overflow.
+    size_t size = 65536;
+    while (size < need) size *= 2;
+    if (size > ENCODER_MAX_SIZE) return 1;
+    uint8_t* old = session->encoder_buffer;
+    size_t used = session->branch_encoder.data.ptr - old;
+    size_t root_ptr = session->root_encoder.data.ptr - old;
+    uint8_t* buf;
+    if (session->encoder_owned){
+        buf = (uint8_t*) realloc(old, size);
+    }else{// the buffer of plant_init() is left to its owner
+        buf = (uint8_t*) malloc(size);
+        if (buf != NULL) memcpy(buf, old, used);
+    }
+    if (buf == NULL){
+        printf("ERR_P2P: no memory for a reply of %zu bytes\n", size);
+        return 1;
+    }
+    session->encoder_buffer = buf;
+    session->encoder_bufsize = size;
+    session->encoder_owned = true;
+    // Both encoders end at the end of the buffer
+    session->root_encoder.data.ptr = buf + root_ptr;
+    session->root_encoder.end = buf + size;
+    session->branch_encoder.data.ptr = buf + used;
+    session->branch_encoder.end = buf + size;
+    return 0;
+}
+void encoder_mark(CborEncoder* mark){
+    // Mark the start of an entry of the reply, see encoder_retry()
+    CborEncoder* branch = &session->branch_encoder;
+    if (session->reply_encoder == branch and branch->end != NULL
+      and (size_t)(branch->end - branch->data.ptr) < ENCODER_RESERVE){
+        encoder_grow(session->encoder_bufsize + ENCODER_RESERVE);}
+    *mark = *session->reply_encoder;
+}
+bool encoder_retry(CborEncoder* mark, const char* name){
+    /* Return true if the entry since mark has overflowed the buffer, which
+     * then has been grown, so the entry should be encoded again. */
+    CborEncoder* branch = &session->branch_encoder;
+    if (session->reply_encoder != branch or branch->end != NULL){
+        return false;}// fits, or not encoding into the session buffer
+    // The reply before the entry, the entry and the reserve after it
+    size_t need = session->encoder_bufsize + branch->data.bytes_needed + ENCODER_RESERVE;
+    *branch = *mark;
+    if (encoder_grow(need) != 0){
+        encode_error(branch, name, "Reply too large");
+        return false;
+    }
+    *mark = *branch;
+    return true;
+}
+static void send_buffer(uint8_t *buf, size_t buflen){
     if (buflen == 0)
         return;
-    if(DBG>=2){
-        for (int i=0; i<buflen; i++){
-            printf("%i,",buf[i]);}
-    }
     // Program will be blocked if client exits. T
+    uint64_t t0 = plant->stats? stats_now_ns(): 0;
+    TRACE(TR_SEND, buflen, 0);
     int r = transport_send(buf, buflen);
-    if(DBG>=2) printf("P2P <sent\n");
+    TRACE(TR_SEND_DONE, r, 0);
+    if (plant->stats){
+        stats_record(H_SEND, stats_now_ns() - t0);}
     if (r == 0){
-        transport_send_failure = 0;
-        if(DBG>=2){
-            printf("P2P:Replied: ");
-            cbor_parser_init((const uint8_t*) buf, buflen, 0, &root_parser, &it);
-            cbor_value_to_json(stdout, &it, 0);
-            printf("\n");
-        }
+        __atomic_store_n(&plant->transport_send_failure, 0, __ATOMIC_RELAXED);
     }else{
-        transport_send_failure++;
-        printf("WARNING_P2P:transport_send_failure %i # %i\n", r, transport_send_failure);
-        if (plant_client_alive && transport_send_failure > 100){
+        uint32_t failures = __atomic_add_fetch(&plant->transport_send_failure, 1, __ATOMIC_RELAXED);
+        stats_count(C_SEND_FAILURES);
+        printf("WARNING_P2P:transport_send_failure %i # %i\n", r, failures);
+        if (plant->client_alive && failures > 100){
             printf("ERROR_P2P:Client have been disconnected due to transport_send_failure.\n");
-            plant_client_alive = false;
+            plant->client_alive = false;
         }
     }
 }
+void send_encoded_buffer(uint8_t *buf){
+    send_buffer(buf, cbor_encoder_get_buffer_size(&session->root_encoder, buf));
+}
 void deliver_measurements(){
+    TD_timestamp archive_time = {0, 0};
+    uint8_t* buf = session->encoder_buffer;
+    size_t buflen = 0;
+    uint64_t t0 = plant->stats? stats_now_ns(): 0;
+    TRACE(TR_FRAME, 0, 0);
     init_encoder(true);
-    encode_measurements();// Encode all continuously measured parameters
-    close_encoder();
-    send_encoded_buffer(encoder_buffer);
+    if (plant->encoders != NULL){
+        // Encode the header of the frame, then the PVs behind it in parallel
+        close_encoder();
+        size_t head = cbor_encoder_get_buffer_size(&session->root_encoder, buf) - 1;
+        size_t n = encode_measurements_parallel(buf + head,
+          session->encoder_bufsize - head - 1, &archive_time);
+        if (n != 0){
+            buflen = head + n;
+            buf[buflen++] = 0xff;// break, closing the indefinite array
+        }else{
+            init_encoder(true);}
+    }
+    if (buflen == 0){
+        encode_measurements(&archive_time);// Encode all continuously measured parameters
+        close_encoder();
+        buf = session->encoder_buffer;// may have grown
+        if (session->root_encoder.end == NULL){
+            printf("ERR_P2P: frame exceeds %i bytes, dropped\n", ENCODER_MAX_SIZE);
+            return;
+        }
+        buflen = cbor_encoder_get_buffer_size(&session->root_encoder, buf);
+    }
+    TRACE(TR_FRAME_DONE, buflen, 0);
+    if (plant->stats){
+        stats_record(H_FRAME_ENCODE, stats_now_ns() - t0);
+        stats_record(H_FRAME_SIZE, buflen);
+    }
+    if (archive_time.tv_sec != 0){// frame contains archivable PVs
+        archive_append(buf, buflen, &archive_time);
+    }
+    if (not plant->client_alive){// encoded only for the archive
+        return;}
+    send_buffer(buf, buflen);
+    if (plant->stats){
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t dt = (now.tv_sec - (int64_t)plant->frame_acquired.tv_sec)*1000000000
+          + now.tv_nsec - (int64_t)plant->frame_acquired.tv_nsec;
+        stats_record(H_FRAME_LATENCY, dt < 0? 0: dt);
+        stats_count(C_FRAMES);
+    }
+}
+void plant_deliver_completions(){
+    // Send deferred replies of asynchronous setters, one frame per setter.
+    // Should be called in the main loop.
+    while (parm_pending() != 0){
+        init_encoder(false);
+        if (parm_complete_pending(&session->branch_encoder) == 0)
+            return;
+        close_encoder();
+        send_encoded_buffer(session->encoder_buffer);
+    }
 }
 
-void plant_process_request(const uint8_t* msg, int msglen){
-    //Should be called in the main loop
+static bool request_id_of(const uint8_t* msg, int msglen, int64_t* id){
+    // Find the client-assigned id, wherever it is in the top-level array
+    CborParser parser;
+    CborValue it, top;
+    if (cbor_parser_init(msg, msglen, 0, &parser, &top) != CborNoError
+      or !cbor_value_is_array(&top)
+      or cbor_value_enter_container(&top, &it) != CborNoError){
+        return false;}
+    while (!cbor_value_at_end(&it)){
+        bool is_id = false;
+        if (cbor_value_is_text_string(&it)){
+            cbor_value_text_string_equals(&it, "id", &is_id);}
+        if (cbor_value_advance(&it) != CborNoError) return false;
+        if (is_id){
+            return cbor_value_is_integer(&it)
+              and cbor_value_get_int64(&it, id) == CborNoError;}
+    }
+    return false;
+}
+static void encode_request_id(){
+    // The id is the first key of the reply, so the client finds it at once
+    if (session->request_id_present){
+        cbor_encode_text_stringz(&session->branch_encoder, "id");
+        cbor_encode_int(&session->branch_encoder, session->request_id);
+    }
+}
+static void process_request(const uint8_t* msg, int msglen){
     CborValue it;// for maintaining redundancy in CBOR functions
     CborError err;
+    uint64_t t0 = plant->stats? stats_now_ns(): 0;
+    TRACE(TR_REQUEST, msglen, 0);
+    if (plant_session_reserve(msglen)){
+        printf("ERR_P2P: no memory to parse a request of %i bytes\n", msglen);
+        return;
+    }
 
-    if(DBG>=2){
-        printf("\nP2P:Received %i bytes:\n", msglen);
-        dumpbytes(msg, msglen);
-        printf("\n");
-    }
-    // Parse incoming message
-    cbor_parser_init(msg, msglen, 0, &root_parser, &it);
-    if(DBG>=1){
-        printf("P2P:Request received: ");
-        // Dump the values in JSON format
-        cbor_value_to_json(stdout, &it, 0);
-        puts("\n");}
+    // Parse incoming message, its commands are traced, see TR_COMMAND
+    cbor_parser_init(msg, msglen, 0, &session->root_parser, &it);
 
     // Initialize encoder to build the reply and open main map
     init_encoder(false);
-    parm_init_reply(&branch_encoder);
+    parm_init_reply(&session->branch_encoder);
+    session->group_pending = false;
+    session->request_id_expected = false;
+    session->request_id_present = request_id_of(msg, msglen, &session->request_id);
+    encode_request_id();
 
     // Decode CBOR data, fill the reply and close the main map
-    if(DBG>=2) puts("````````````````````Parsing:");
     err = parse_cbor_buffer(&it, 0);
     close_encoder();
-    if(DBG>=2) puts(",,,,,,,,,,,,,,,,,,,,Parsing finished");
-    send_encoded_buffer(encoder_buffer);
+    if (session->root_encoder.end == NULL){
+        // Overflow outside of the entries, which encoder_retry() recovers
+        init_encoder(false);
+        encode_request_id();
+        cbor_encode_text_stringz(&session->branch_encoder, "ERR: Reply too large");
+        close_encoder();
+    }
+    TRACE(TR_REQUEST_DONE, cbor_encoder_get_buffer_size(&session->root_encoder,
+      session->encoder_buffer), 0);
+    if (plant->stats){
+        stats_record(H_REQUEST, stats_now_ns() - t0);
+        stats_count(C_REQUESTS);
+    }
+    send_encoded_buffer(session->encoder_buffer);
+}
+//``````````````````Traffic capture````````````````````````````````````````````
+/* Requests are appended to the capture file as they arrive, each with one
+ * write, so the capture survives a crash of the plant.
+ */
+static uint64_t monotonic_ns(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+static void traffic_append(const uint8_t* msg, int msglen){
+    TRAFFIC_RECORD r = {monotonic_ns() - plant->traffic_start, (uint32_t)msglen};
+    struct iovec iov[2] = {{&r, sizeof(r)}, {(void*)msg, (size_t)msglen}};
+    if (writev(plant->traffic_fd, iov, 2) != (ssize_t)(sizeof(r) + msglen)){
+        printf("ERR: Could not write traffic capture, capture stopped\n");
+        plant_traffic_close();
+    }
+}
+int plant_traffic_capture(const char* path){
+    // Capture requests of the plant into file path, see TRAFFIC_HEADER
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        printf("ERR: Could not create traffic capture %s\n", path);
+        return 1;
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    TRAFFIC_HEADER h;
+    memcpy(h.magic, TRAFFIC_MAGIC, sizeof(h.magic));
+    h.start = t.tv_sec*1000000000ull + t.tv_nsec;
+    if (write(fd, &h, sizeof(h)) != sizeof(h)){
+        printf("ERR: Could not write traffic capture %s\n", path);
+        close(fd);
+        return 1;
+    }
+    plant->traffic_start = monotonic_ns();
+    plant->traffic_fd = fd;
+    printf("Capturing requests into %s\n", path);
+    return 0;
+}
+void plant_traffic_close(){
+    if (plant->traffic_fd >= 0){
+        close(plant->traffic_fd);}
+    plant->traffic_fd = -1;
+}
+//``````````````````Real-time mode`````````````````````````````````````````````
+/* See plant_realtime() in defines.h. Heap allocations are counted per
+ * thread by wrappers of the glibc allocation functions, see
+ * plant_heap_allocations(), cycles take the difference. The wrappers
+ * replace malloc() of the whole program, so they are compiled in only on
+ * request: make RT=1 (P2P_COUNT_ALLOCS), microbench always has them.
+ * Only calls which reach malloc(), calloc() and realloc() are counted,
+ * memory which glibc obtains otherwise (memalign family, mmap) is not.
+ */
+static thread_local uint64_t heap_allocations = 0;
+static thread_local bool rt_counting = false;// within a measured cycle
+static thread_local uint64_t rt_allocations;// at the start of the cycle
+#if defined(__GLIBC__) and defined(P2P_COUNT_ALLOCS)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* malloc(size_t size){
+    heap_allocations++;
+    return __libc_malloc(size);
+}
+extern "C" void* calloc(size_t n, size_t size){
+    heap_allocations++;
+    return __libc_calloc(n, size);
+}
+extern "C" void* realloc(void* ptr, size_t size){
+    heap_allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+uint64_t plant_heap_allocations(){
+    // Calls of malloc(), calloc() and realloc() by the calling thread,
+    // always 0 without P2P_COUNT_ALLOCS
+    return heap_allocations;
+}
+static int realtime_thread(pthread_t thread, int cpu, int priority,
+  const char* what){
+    // Pin the thread to cpu, if not -1, and run it under SCHED_FIFO priority,
+    // if not 0
+    int r = 0;
+    if (cpu >= 0){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int e = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (e != 0){
+            printf("WARNING_P2P: could not pin %s to CPU %i: %s\n", what, cpu, strerror(e));
+            r = 1;
+        }
+    }
+    if (priority > 0){
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = priority;
+        int e = pthread_setschedparam(thread, SCHED_FIFO, &sp);
+        if (e != 0){
+            printf("WARNING_P2P: could not set SCHED_FIFO %i for %s: %s\n",
+              priority, what, strerror(e));
+            r = 1;
+        }
+    }
+    return r;
+}
+static void realtime_pool_thread(pthread_t thread, bool worker){
+    // Place a worker or an encoder thread of the plant, see plant_realtime()
+    RealtimeState* rt = plant->rt;
+    if (rt == NULL or not rt->enabled){
+        return;}
+    const RealtimeConfig* c = &rt->config;
+    int cpu = -1;
+    if (c->ncpus == 1){
+        cpu = c->cpus[0];
+    }else if (c->ncpus > 1){
+        cpu = c->cpus[1 + rt->next_cpu++ % (c->ncpus - 1)];}
+    int priority = worker and c->priority > 0? c->priority - 1: c->priority;
+    realtime_thread(thread, cpu, priority, worker? "worker": "encoder");
+}
+static void __attribute__((noinline)) prefault_stack(){
+    volatile uint8_t stack[RT_STACK_PREFAULT];
+    prefault((void*)stack, sizeof(stack));
+}
+int plant_realtime(const RealtimeConfig* config){
+    /* Enable the real-time mode of the current plant, see defines.h. Should
+     * be called by the thread, which runs the plant, after transport_init()
+     * and before plant_start_workers() and plant_start_encoders(). Returns 1
+     * if any of the steps failed, e.g. without CAP_SYS_NICE or with a low
+     * RLIMIT_MEMLOCK, the other steps are applied.
+     */
+    if (plant->rt == NULL){
+        void* mem = calloc(1, sizeof(RealtimeState));
+        if (mem == NULL) return 1;
+        plant->rt = new (mem) RealtimeState();
+    }
+    RealtimeState* rt = plant->rt;
+    rt->config = *config;
+    if (rt->config.ncpus > RT_MAX_CPUS){
+        rt->config.ncpus = RT_MAX_CPUS;}
+    rt->next_cpu = 0;
+    rt->enabled = true;
+    int r = 0;
+    if (config->lock_memory){
+        #ifdef __GLIBC__
+        // Freed memory stays in the heap and large blocks come from it, so
+        // allocations of the steady state neither fault nor call the kernel
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        #endif
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+            printf("WARNING_P2P: mlockall failed: %s, check RLIMIT_MEMLOCK\n",
+              strerror(errno));
+            r = 1;
+        }
+        if (plant_session_reserve(plant->recv_bufsize)){
+            r = 1;}
+        prefault(session->encoder_buffer, session->encoder_bufsize);
+        prefault(session->send_buf, session->send_bufsize);
+        prefault(session->text, session->text_size);
+        prefault(session->int_array, session->int_array_size*sizeof(int64_t));
+        prefault(plant->recv_buf, plant->recv_bufsize);
+        plant_prefault_pvs();
+        prefault_stack();
+    }
+    if (realtime_thread(pthread_self(), rt->config.ncpus? rt->config.cpus[0]: -1,
+      rt->config.priority, "plant thread")){
+        r = 1;}
+    printf("P2P: real-time mode, SCHED_FIFO priority %i, %i CPUs, memory %s\n",
+      rt->config.priority, rt->config.ncpus,
+      config->lock_memory? "locked": "not locked");
+    return r;
+}
+void plant_cycle_begin(){
+    // Mark the start of an acquisition cycle of the main loop
+    RealtimeState* rt = plant->rt;
+    if (rt == NULL){
+        return;}
+    rt->cycle_start = stats_now_ns();
+    rt_allocations = heap_allocations;
+    rt_counting = rt->ncycles >= RT_WARMUP_CYCLES;
+}
+void plant_cycle_end(){
+    // Mark the end of the cycle, e.g. after its frame has been sent
+    RealtimeState* rt = plant->rt;
+    if (rt == NULL or rt->cycle_start == 0){
+        return;}
+    uint64_t dt = stats_now_ns() - rt->cycle_start;
+    rt->cycle_start = 0;
+    if (rt_counting){
+        rt_counting = false;
+        uint32_t v = dt < UINT32_MAX? dt: UINT32_MAX;
+        rt->values[RT_LAST_CYCLE] = v;
+        if (v > rt->values[RT_WORST_CYCLE]){
+            rt->values[RT_WORST_CYCLE] = v;}
+        rt->values[RT_CYCLES]++;
+        rt->values[RT_ALLOCATIONS] += heap_allocations - rt_allocations;
+    }
+    rt->ncycles++;
 }
+//``````````````````Worker pool````````````````````````````````````````````````
+/* Read-only requests: info, get and history of PVs without getters, may be
+ * processed by a pool of workers, concurrently with the thread, which runs
+ * the plant. That thread stays the single writer: it receives all requests,
+ * processes sets and other requests itself and passes read-only ones to the
+ * workers. Workers encode PV values under their sequence locks and send the
+ * replies themselves, so the replies of pipelined read-only requests may
+ * come out of order, clients should tag them with request ids.
+ * Memory, which may be read by workers, is freed by plant_retire() only
+ * when no worker, which could have seen it, is active (epoch-based).
+ */
+#define WORKER_QUEUE_SIZE 64
+struct WorkerArg {
+    Plant* plant;
+    WorkerPool* pool;
+    int index;
+};
+struct WorkerPool {
+    int nworkers;
+    PlantSession* sessions;
+    uint64_t* epochs;   // epoch announced by active workers, 0: idle
+    pthread_t* threads;
+    WorkerArg* args;
+    uint8_t* msgs;      // a message of recv_bufsize per worker
+    bool stop;          // workers exit, see free_pool()
+    // queue of requests
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    uint8_t* queue;     // WORKER_QUEUE_SIZE messages of recv_bufsize
+    int queue_len[WORKER_QUEUE_SIZE];
+    uint64_t queue_time[WORKER_QUEUE_SIZE];// when the request was queued, for stats
+    uint32_t head;      // next slot to fill
+    uint32_t tail;      // next slot to take
+    // memory retired by the writer
+    void** retired;
+    void (**retired_release)(void*);// free() or array_release()
+    uint64_t* retired_epoch;
+    size_t nretired;
+    size_t retired_size;
+};
+static void* worker_main(void* arg){
+    WorkerArg* wa = (WorkerArg*) arg;
+    plant_select(wa->plant);
+    WorkerPool* pool = wa->pool;
+    int index = wa->index;
+    session = &pool->sessions[index];
+    uint8_t* msg = pool->msgs + index*plant->recv_bufsize;
+    plant_session_reserve(plant->recv_bufsize);
+    for (;;){
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == pool->tail and not pool->stop){
+            pthread_cond_wait(&pool->not_empty, &pool->lock);}
+        if (pool->stop){
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        uint32_t slot = pool->tail++ % WORKER_QUEUE_SIZE;
+        int msglen = pool->queue_len[slot];
+        uint64_t queued = pool->queue_time[slot];
+        memcpy(msg, pool->queue + slot*plant->recv_bufsize, msglen);
+        pthread_mutex_unlock(&pool->lock);
+        TRACE(TR_WORKER, index, 0);
+        if (plant->stats){
+            stats_record(H_QUEUE_WAIT, stats_now_ns() - queued);}
 
+        // Announce the epoch, so that memory seen by this worker is not freed
+        __atomic_store_n(&pool->epochs[index],
+          __atomic_load_n(&plant->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        process_request(msg, msglen);
+        __atomic_store_n(&pool->epochs[index], 0, __ATOMIC_RELEASE);
+    }
+    free(session->text);
+    free(session->int_array);
+    return NULL;
+}
+static void free_pool(WorkerPool* pool, int nsessions, int nthreads){
+    // Stop nthreads started workers and free a pool, which is not published
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=0; i < nthreads; i++){
+        pthread_join(pool->threads[i], NULL);}
+    for (int i=0; i < nsessions; i++){
+        free(pool->sessions[i].encoder_buffer);}
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->sessions);
+    free(pool->epochs);
+    free(pool->threads);
+    free(pool->args);
+    free(pool->msgs);
+    free(pool->queue);
+    free(pool);
+}
+int plant_start_workers(int nworkers){
+    /* Start nworkers threads for read-only requests of the current plant.
+     * Should be called after plant_init() and transport_init(). The pool is
+     * published only when all workers run, on failure nothing is left.
+     */
+    WorkerPool* pool = (WorkerPool*) calloc(1, sizeof(WorkerPool));
+    if (pool == NULL) return 1;
+    pool->nworkers = nworkers;
+    pool->sessions = (PlantSession*) malloc(nworkers*sizeof(PlantSession));
+    pool->epochs = (uint64_t*) calloc(nworkers, sizeof(uint64_t));
+    pool->threads = (pthread_t*) malloc(nworkers*sizeof(pthread_t));
+    pool->args = (WorkerArg*) malloc(nworkers*sizeof(WorkerArg));
+    pool->msgs = (uint8_t*) malloc(nworkers*plant->recv_bufsize);
+    pool->queue = (uint8_t*) malloc(WORKER_QUEUE_SIZE*plant->recv_bufsize);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    if (pool->sessions == NULL or pool->epochs == NULL or pool->threads == NULL
+      or pool->args == NULL or pool->msgs == NULL or pool->queue == NULL){
+        printf("ERR_P2P: no memory for %i workers\n", nworkers);
+        free_pool(pool, 0, 0);
+        return 1;
+    }
+    for (int i=0; i < nworkers; i++){
+        PlantSession* ws = new (&pool->sessions[i]) PlantSession();
+        ws->encoder_bufsize = session->encoder_bufsize;
+        ws->encoder_buffer = (uint8_t*) malloc(ws->encoder_bufsize);
+        ws->encoder_owned = true;
+        ws->read_only = true;
+        if (ws->encoder_buffer == NULL){
+            printf("ERR_P2P: no memory for worker encoder\n");
+            free_pool(pool, i+1, 0);
+            return 1;
+        }
+    }
+    for (int i=0; i < nworkers; i++){
+        pool->args[i].plant = plant;
+        pool->args[i].pool = pool;
+        pool->args[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->args[i]) != 0){
+            printf("ERR_P2P: could not start worker %i\n", i);
+            free_pool(pool, nworkers, i);
+            return 1;
+        }
+        realtime_pool_thread(pool->threads[i], true);
+    }
+    for (int i=0; i < nworkers; i++){
+        pthread_detach(pool->threads[i]);}
+    __atomic_store_n(&plant->pool, pool, __ATOMIC_RELEASE);
+    printf("P2P: started %i workers\n", nworkers);
+    return 0;
+}
+static void retire(void* ptr, void (*release)(void*)){
+    // Release memory, which may still be read by workers, when it is safe
+    WorkerPool* pool = plant->pool;
+    if (pool == NULL){
+        release(ptr);
+        return;
+    }
+    if (pool->nretired == pool->retired_size){
+        size_t size = pool->retired_size? 2*pool->retired_size: 64;
+        void** r = (void**) realloc(pool->retired, size*sizeof(void*));
+        if (r != NULL) pool->retired = r;
+        void (**rr)(void*) = (void (**)(void*)) realloc(pool->retired_release,
+          size*sizeof(void (*)(void*)));
+        if (rr != NULL) pool->retired_release = rr;
+        uint64_t* re = (uint64_t*) realloc(pool->retired_epoch,
+          size*sizeof(uint64_t));
+        if (re != NULL) pool->retired_epoch = re;
+        if (r == NULL or rr == NULL or re == NULL){
+            // No room to defer it, wait until the workers could not see it
+            uint64_t epoch = __atomic_fetch_add(&plant->epoch, 1, __ATOMIC_SEQ_CST);
+            for (int i=0; i < pool->nworkers; i++){
+                for (;;){
+                    uint64_t e = __atomic_load_n(&pool->epochs[i], __ATOMIC_SEQ_CST);
+                    if (e == 0 or e > epoch) break;
+                    sched_yield();
+                }
+            }
+            release(ptr);
+            return;
+        }
+        pool->retired_size = size;
+    }
+    pool->retired[pool->nretired] = ptr;
+    pool->retired_release[pool->nretired] = release;
+    pool->retired_epoch[pool->nretired++] = plant->epoch;
+    __atomic_add_fetch(&plant->epoch, 1, __ATOMIC_SEQ_CST);
+}
+void plant_retire(void* ptr){
+    // Free memory, which may still be read by workers, when it is safe
+    retire(ptr, free);
+}
+static void reclaim_retired(){
+    // Free retired memory, which none of active workers could have seen
+    WorkerPool* pool = plant->pool;
+    if (pool == NULL or pool->nretired == 0) return;
+    uint64_t oldest = UINT64_MAX;
+    for (int i=0; i < pool->nworkers; i++){
+        uint64_t e = __atomic_load_n(&pool->epochs[i], __ATOMIC_SEQ_CST);
+        if (e != 0 and e < oldest) oldest = e;
+    }
+    size_t n = 0;
+    for (size_t i=0; i < pool->nretired; i++){
+        if (pool->retired_epoch[i] < oldest){
+            pool->retired_release[i](pool->retired[i]);
+        }else{
+            pool->retired[n] = pool->retired[i];
+            pool->retired_release[n] = pool->retired_release[i];
+            pool->retired_epoch[n++] = pool->retired_epoch[i];
+        }
+    }
+    pool->nretired = n;
+}
+void plant_reclaim(){
+    /* Free retired memory, which workers are done with. Should be called in
+     * the main loop: memory retired by the acquisition path would otherwise
+     * wait for a request processed by the writer.
+     */
+    reclaim_retired();
+}
+static bool names_read_only(CborValue* list){
+    // Check if a worker can serve all names of a get or history command
+    CborValue it;
+    char name[80];
+    if (cbor_value_enter_container(list, &it) != CborNoError) return false;
+    while (!cbor_value_at_end(&it)){
+        CborValue item = it;
+        CborValue pair;
+        if (cbor_value_is_array(&it)){// [name, ...]
+            if (cbor_value_enter_container(&it, &pair) != CborNoError) return false;
+            item = pair;
+        }
+        size_t n = sizeof(name);
+        if (!cbor_value_is_text_string(&item)
+          or cbor_value_copy_text_string(&item, name, &n, NULL) != CborNoError
+          or !parm_read_only(name)){
+            return false;}
+        if (cbor_value_advance(&it) != CborNoError) return false;
+    }
+    return true;
+}
+static bool request_read_only(const uint8_t* msg, int msglen){
+    // Check if the request contains only info, get or history of PVs without getters
+    CborParser parser;
+    CborValue it, top;
+    if (cbor_parser_init(msg, msglen, 0, &parser, &top) != CborNoError
+      or !cbor_value_is_array(&top)
+      or cbor_value_enter_container(&top, &it) != CborNoError){
+        return false;}
+    int cmd = -1;
+    while (!cbor_value_at_end(&it)){
+        if (cbor_value_is_text_string(&it)){
+            char buf[16];
+            size_t n = sizeof(buf);
+            if (cbor_value_copy_text_string(&it, buf, &n, &it) != CborNoError){
+                return false;}
+            if (strcmp(buf, "id") == 0) cmd = -1;
+            else if (starts_with(buf, "info")) cmd = PARM_CMD_INFO;
+            else if (starts_with(buf, "get")) cmd = PARM_CMD_GET;
+            else if (starts_with(buf, "history")) cmd = PARM_CMD_HISTORY;
+            else return false;
+            continue;
+        }
+        if (cbor_value_is_array(&it)){
+            if (cmd == -1) return false;
+            if (cmd != PARM_CMD_INFO and !names_read_only(&it)) return false;
+        }else if (!cbor_value_is_integer(&it)){// request id
+            return false;}
+        if (cbor_value_advance(&it) != CborNoError) return false;
+    }
+    return true;
+}
+void plant_process_request(const uint8_t* msg, int msglen){
+    //Should be called in the main loop
+    WorkerPool* pool = plant->pool;
+    if (plant->traffic_fd >= 0){
+        traffic_append(msg, msglen);}
+    if (pool == NULL){
+        process_request(msg, msglen);
+        return;
+    }
+    if (msglen <= (int)plant->recv_bufsize and request_read_only(msg, msglen)){
+        pthread_mutex_lock(&pool->lock);
+        bool queued = pool->head - pool->tail < WORKER_QUEUE_SIZE;
+        if (queued){
+            stats_record(H_QUEUE_DEPTH, pool->head - pool->tail);
+            TRACE(TR_QUEUE, pool->head - pool->tail, 0);
+            uint32_t slot = pool->head++ % WORKER_QUEUE_SIZE;
+            memcpy(pool->queue + slot*plant->recv_bufsize, msg, msglen);
+            pool->queue_len[slot] = msglen;
+            pool->queue_time[slot] = plant->stats? stats_now_ns(): 0;
+            pthread_cond_signal(&pool->not_empty);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (queued){
+            stats_count(C_WORKER_REQUESTS);
+            return;
+        }
+        stats_count(C_QUEUE_FULL);
+    }
+    process_request(msg, msglen);// by the writer
+    reclaim_retired();
+}
+//``````````````````Array storage``````````````````````````````````````````````
+/* Storage of array PVs, which are reshaped at runtime, see PV::reshape().
+ * Blocks have power-of-two size classes. A freed block goes to the free list
+ * of its class, which keeps at most ARRAY_KEEP_FREE blocks, so the memory
+ * follows the current shapes, not the largest ones ever set. Blocks of
+ * ARRAY_HUGE_BLOCK and more are mapped separately and advised to use huge
+ * pages, they are unmapped when freed. The pool is used by the thread,
+ * which runs the plant; blocks, which workers may read, are released
+ * through the epochs of plant_retire().
+ */
+struct ARRAY_BLOCK {// header of a block, the data follows
+    uint32_t sclass;
+    uint32_t capacity;  // bytes of data
+    ARRAY_BLOCK* next;  // in the free list
+};
+struct ArrayPool {
+    ARRAY_BLOCK* free_list[ARRAY_NCLASSES];
+    uint8_t nfree[ARRAY_NCLASSES];
+    size_t used;        // bytes of allocated blocks
+    size_t cached;      // bytes of blocks in the free lists
+};
+static size_t array_block_size(uint32_t sclass){
+    return (size_t)ARRAY_MIN_BLOCK << sclass;
+}
+static void array_release(void* ptr){
+    // Return a block to its free list or to the system
+    ARRAY_BLOCK* b = (ARRAY_BLOCK*) ptr - 1;
+    ArrayPool* ap = plant->arrays;
+    size_t size = array_block_size(b->sclass);
+    ap->used -= size;
+    if (size < ARRAY_HUGE_BLOCK and ap->nfree[b->sclass] < ARRAY_KEEP_FREE){
+        b->next = ap->free_list[b->sclass];
+        ap->free_list[b->sclass] = b;
+        ap->nfree[b->sclass]++;
+        ap->cached += size;
+        return;
+    }
+    if (size >= ARRAY_HUGE_BLOCK){
+        munmap(b, size);
+    }else{
+        free(b);}
+}
+void* plant_array_alloc(uint32_t nbytes){
+    // Storage for nbytes of an array PV, NULL if no memory
+    if (plant->arrays == NULL){
+        plant->arrays = (ArrayPool*) calloc(1, sizeof(ArrayPool));
+        if (plant->arrays == NULL) return NULL;
+    }
+    ArrayPool* ap = plant->arrays;
+    uint32_t sclass = 0;
+    while (sclass < ARRAY_NCLASSES
+      and array_block_size(sclass) < nbytes + sizeof(ARRAY_BLOCK)){
+        sclass++;}
+    if (sclass == ARRAY_NCLASSES) return NULL;
+    size_t size = array_block_size(sclass);
+    ARRAY_BLOCK* b = ap->free_list[sclass];
+    if (b != NULL){
+        ap->free_list[sclass] = b->next;
+        ap->nfree[sclass]--;
+        ap->cached -= size;
+    }else{
+        if (size >= ARRAY_HUGE_BLOCK){
+            void* m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m == MAP_FAILED) return NULL;
+            madvise(m, size, MADV_HUGEPAGE);
+            b = (ARRAY_BLOCK*) m;
+        }else{
+            b = (ARRAY_BLOCK*) malloc(size);
+            if (b == NULL) return NULL;
+        }
+    }
+    ap->used += size;
+    b->sclass = sclass;
+    b->capacity = size - sizeof(ARRAY_BLOCK);
+    return b + 1;
+}
+void plant_array_free(void* ptr){
+    // Release storage of plant_array_alloc(), workers may still read it
+    if (ptr != NULL){
+        retire(ptr, array_release);}
+}
+uint32_t plant_array_capacity(const void* ptr){
+    return ((const ARRAY_BLOCK*) ptr - 1)->capacity;
+}
+size_t plant_array_bytes(size_t* cached){
+    // Memory of allocated blocks and, in cached, of the free lists
+    ArrayPool* ap = plant->arrays;
+    if (cached != NULL) *cached = ap != NULL? ap->cached: 0;
+    return ap != NULL? ap->used: 0;
+}
+//``````````````````Frame encoders`````````````````````````````````````````````
+/* Threads, which help the plant thread to encode large frames of
+ * measurements, see encode_measurements_parallel() in pv.h. The calling
+ * thread takes part in the work. Jobs are claimed one by one from a shared
+ * counter, so the load is balanced when PVs differ in size.
+ */
+struct EncoderPool {
+    int nthreads;
+    pthread_t* threads;
+    bool stop;              // encoders exit, see free_encoders()
+    pthread_mutex_t lock;
+    pthread_cond_t start;   // a new batch of jobs is ready
+    pthread_cond_t done;    // no thread is working on the batch
+    uint32_t generation;    // incremented for each batch
+    int active;             // threads, which are working on the batch
+    void (*job)(void* ctx, int i);
+    void* ctx;
+    int njobs;
+    int next;               // next job to claim
+};
+static void run_jobs(EncoderPool* ep){
+    for (;;){
+        int i = __atomic_fetch_add(&ep->next, 1, __ATOMIC_RELAXED);
+        if (i >= ep->njobs) return;
+        (*ep->job)(ep->ctx, i);
+    }
+}
+static void* encoder_main(void* arg){
+    EncoderPool* ep = (EncoderPool*) arg;
+    uint32_t seen = 0;
+    pthread_mutex_lock(&ep->lock);
+    for (;;){
+        while (ep->generation == seen and not ep->stop){
+            pthread_cond_wait(&ep->start, &ep->lock);}
+        if (ep->stop) break;
+        seen = ep->generation;
+        ep->active++;
+        pthread_mutex_unlock(&ep->lock);
+        run_jobs(ep);
+        pthread_mutex_lock(&ep->lock);
+        if (--ep->active == 0){
+            pthread_cond_signal(&ep->done);}
+    }
+    pthread_mutex_unlock(&ep->lock);
+    return NULL;
+}
+static void free_encoders(EncoderPool* ep, int nthreads){
+    // Stop nthreads started encoders and free a pool, which is not published
+    pthread_mutex_lock(&ep->lock);
+    ep->stop = true;
+    pthread_cond_broadcast(&ep->start);
+    pthread_mutex_unlock(&ep->lock);
+    for (int i=0; i < nthreads; i++){
+        pthread_join(ep->threads[i], NULL);}
+    pthread_cond_destroy(&ep->start);
+    pthread_cond_destroy(&ep->done);
+    pthread_mutex_destroy(&ep->lock);
+    free(ep->threads);
+    free(ep);
+}
+int plant_start_encoders(int nthreads, uint32_t min_frame_size){
+    /* Start nthreads threads for encoding of the frames of the current plant,
+     * which are at least min_frame_size bytes long. On failure nothing is
+     * left, the started encoders are stopped.
+     */
+    EncoderPool* ep = (EncoderPool*) calloc(1, sizeof(EncoderPool));
+    if (ep == NULL) return 1;
+    ep->nthreads = nthreads;
+    ep->threads = (pthread_t*) malloc(nthreads*sizeof(pthread_t));
+    pthread_mutex_init(&ep->lock, NULL);
+    pthread_cond_init(&ep->start, NULL);
+    pthread_cond_init(&ep->done, NULL);
+    if (ep->threads == NULL){
+        printf("ERR_P2P: no memory for %i encoders\n", nthreads);
+        free_encoders(ep, 0);
+        return 1;
+    }
+    for (int i=0; i < nthreads; i++){
+        if (pthread_create(&ep->threads[i], NULL, encoder_main, ep) != 0){
+            printf("ERR_P2P: could not start encoder %i\n", i);
+            free_encoders(ep, i);
+            return 1;
+        }
+        realtime_pool_thread(ep->threads[i], false);
+    }
+    for (int i=0; i < nthreads; i++){
+        pthread_detach(ep->threads[i]);}
+    plant->parallel_frame_min = min_frame_size;
+    plant->encoders = ep;
+    printf("P2P: started %i encoders for frames >= %u bytes\n", nthreads, min_frame_size);
+    return 0;
+}
+void plant_parallel_for(int njobs, void (*job)(void* ctx, int i), void* ctx){
+    /* Call job(ctx, i) for i = 0..njobs-1 on the encoder threads of the
+     * plant and on the calling thread, return when all calls are finished.
+     */
+    EncoderPool* ep = plant->encoders;
+    if (ep == NULL or njobs < 2){
+        for (int i=0; i < njobs; i++){
+            (*job)(ctx, i);}
+        return;
+    }
+    pthread_mutex_lock(&ep->lock);
+    while (ep->active != 0){// latecomers of the previous batch
+        pthread_cond_wait(&ep->done, &ep->lock);}
+    ep->job = job;
+    ep->ctx = ctx;
+    ep->njobs = njobs;
+    ep->next = 0;
+    ep->active = 1;// the caller
+    ep->generation++;
+    pthread_cond_broadcast(&ep->start);
+    pthread_mutex_unlock(&ep->lock);
+    run_jobs(ep);
+    pthread_mutex_lock(&ep->lock);
+    ep->active--;
+    while (ep->active != 0){
+        pthread_cond_wait(&ep->done, &ep->lock);}
+    pthread_mutex_unlock(&ep->lock);
+}
@@ -0,0 +1,56 @@
+/*``````````````````Binary tracing```````````````````````````````````````````````
+* The trace file is mapped into memory, each thread, which records an event,
+* claims one of its rings on the first event. See include/trace.h.
+*/
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../include/trace.h"
+
+#ifdef P2P_TRACE
+TRACE_HEADER* trace_map = NULL;
+thread_local TRACE_RING* trace_ring = NULL;
+
+TRACE_RING* trace_attach(){
+    // Claim a ring for the calling thread, NULL if all are taken
+    uint32_t i = __atomic_fetch_add(&trace_map->nrings, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_MAX_THREADS){
+        __atomic_fetch_sub(&trace_map->nrings, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    TRACE_RING* r = (TRACE_RING*)(trace_map + 1) + i;
+    r->tid = syscall(SYS_gettid);
+    trace_ring = r;
+    return r;
+}
+int trace_init(const char* path){
+    size_t size = sizeof(TRACE_HEADER) + TRACE_MAX_THREADS*sizeof(TRACE_RING);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        printf("ERR: Could not create trace file %s\n", path);
+        return 1;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0){
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);}
+    close(fd);
+    if (map == MAP_FAILED){
+        printf("ERR: Could not map trace file %s\n", path);
+        return 1;
+    }
+    TRACE_HEADER* h = (TRACE_HEADER*)map;
+    memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    h->ring_size = TRACE_RING_SIZE;
+    __atomic_store_n(&trace_map, h, __ATOMIC_RELEASE);
+    printf("Tracing into %s, %zu bytes\n", path, size);
+    return 0;
+}
+#else
+int trace_init(const char* path){
+    printf("ERR: Tracing is not compiled in, build with 'make TRACE=1'\n");
+    return 1;
+}
+#endif
@@ -5,6 +5,8 @@
 * space becomes available.
 */
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 
 //#include <sys/ipc.h> 
 #include <sys/msg.h>
@@ -12,26 +14,42 @@
 #include "../include/defines.h"
 
 //``````````````````Transport variables````````````````````````````````````````
+// The queues and buffers are kept in the plant context.
 // structure for message queue
 //#define MESG_BUFFER_SIZE 10000 //size of typical IP packet
 struct MESG_BUFFER {// For IPC communications
     long mesg_type; 
     uint8_t mesg_buf[];
 }; 
-static MESG_BUFFER *recvBuffer;
-
-static int msgid_rcv, msgid_snd;
-static int msglen = 1;
-static uint32_t recvBufSize = 0;
+//TODO Eliminate sendBuffer and extra copy
+#define sendBuffer_size 15000// initial, grows with the replies
 
 //``````````````````Transport functions````````````````````````````````````````
+static int fit_queue(size_t msgsz){
+    // A message larger than the queue would block msgsnd() forever
+    struct msqid_ds ds;
+    if (msgctl(plant->msgid_snd, IPC_STAT, &ds) != 0){
+        return -1;}
+    if (ds.msg_qbytes >= msgsz){
+        return 0;}
+    ds.msg_qbytes = 2*msgsz;// room for the next one
+    if (msgctl(plant->msgid_snd, IPC_SET, &ds) == 0){
+        return 0;}
+    ds.msg_qbytes = msgsz;
+    if (msgctl(plant->msgid_snd, IPC_SET, &ds) == 0){
+        return 0;}
+    printf("TrI:ERR. Could not enlarge the send queue to %zu bytes, check /proc/sys/kernel/msgmnb\n",
+      msgsz);
+    return -1;
+}
 int transport_init(uint8_t *buf, uint32_t bufsz){
-    recvBufSize = bufsz;
-    recvBuffer = (MESG_BUFFER*) buf;
+    plant->recv_bufsize = bufsz;
+    plant->recv_buf = buf;
+    MESG_BUFFER* recvBuffer = (MESG_BUFFER*) buf;
     
     key_t key; 
-    // ftok to generate unique key
-    key = ftok("/tmp/ipcbor.ftok", 65);
+    // ftok to generate unique key, each plant has its own pair of queues
+    key = ftok("/tmp/ipcbor.ftok", 65 + plant->id);
     if (key == -1){
         printf("TrI:ERR. Could not create IPC Message Key. Please do: 'touch  /tmp/ipcbor.ftok'\n");
         return 1;
@@ -40,9 +58,9 @@ int transport_init(uint8_t *buf, uint32_t bufsz){
     //recvBuffer->mesg_type = 27;// 27 is arbitrary
     recvBuffer->mesg_type = 1;// ISSUE: other than 1 does not work for msgsnd
     // msgget creates a recvBuffer queue and returns identifier 
-    msgid_rcv = msgget(key, 0666 | IPC_CREAT);
-    msgid_snd = msgget(key+1, 0666 | IPC_CREAT);
-    printf("TrI:IPC Message Output Queue id_rcv=%i, id_snd=%i \n", msgid_rcv, msgid_snd);
+    plant->msgid_rcv = msgget(key, 0666 | IPC_CREAT);
+    plant->msgid_snd = msgget(key+1, 0666 | IPC_CREAT);
+    printf("TrI:IPC Message Output Queue id_rcv=%i, id_snd=%i \n", plant->msgid_rcv, plant->msgid_snd);
 
     //Purge any pending messages
     uint8_t *msg = NULL;
@@ -57,24 +75,37 @@ int transport_init(uint8_t *buf, uint32_t bufsz){
     return 0;
 }
 int transport_recv(uint8_t **msg){
-    msglen = msgrcv(msgid_rcv, recvBuffer, recvBufSize, 1, IPC_NOWAIT);
+    MESG_BUFFER* recvBuffer = (MESG_BUFFER*) plant->recv_buf;
+    int msglen = msgrcv(plant->msgid_rcv, recvBuffer, plant->recv_bufsize, 1, IPC_NOWAIT);
     //printf("TrI:Transport Received %i bytes: `%s`\n", msglen, recvBuffer->mesg_buf);
     if (msglen == 0){
-        msgctl(msgid_rcv, IPC_RMID, NULL);
+        msgctl(plant->msgid_rcv, IPC_RMID, NULL);
         printf("TrI:Message queue destroyed\n");
         assert(msglen != 0 && "TrI:Message queue destroyed");
     }
     *msg = (recvBuffer->mesg_buf);
     return msglen; 
 }
-//TODO Eliminate sendBuffer and extra copy
-#define sendBuffer_size 15000
-struct {
-    long mesg_type = 1; // ISSUE: other than 1 does not work for msgsnd
-    uint8_t mesg_buf[sendBuffer_size];
-} sendBuffer;
 int transport_send(uint8_t *msg, size_t msgsz){
-    assert(msgsz < sendBuffer_size && "Send buffer overflow");
-    memcpy(sendBuffer.mesg_buf, msg, msgsz);
-    return msgsnd(msgid_snd, &sendBuffer, msgsz, 0);//, IPC_NOWAIT);
+    // Each session (thread) has its own send buffer
+    if (session->send_buf == NULL or msgsz > session->send_bufsize){
+        uint32_t size = session->send_bufsize? session->send_bufsize: sendBuffer_size;
+        while (size < msgsz) size *= 2;
+        if (fit_queue(msgsz) != 0){
+            return -1;}
+        uint8_t* buf = (uint8_t*) realloc(session->send_buf, sizeof(MESG_BUFFER) + size);
+        if (buf == NULL){
+            printf("TrI:ERR. No memory for send buffer of %u bytes\n", size);
+            return -1;
+        }
+        session->send_buf = buf;
+        session->send_bufsize = size;
+        ((MESG_BUFFER*)session->send_buf)->mesg_type = 1;// ISSUE: other than 1 does not work for msgsnd
+    }
+    MESG_BUFFER* sendBuffer = (MESG_BUFFER*) session->send_buf;
+    memcpy(sendBuffer->mesg_buf, msg, msgsz);
+    int r = msgsnd(plant->msgid_snd, sendBuffer, msgsz, 0);//, IPC_NOWAIT);
+    if (r != 0 and errno == EINVAL and msgsz > 8192){
+        printf("TrI:ERR. Message of %zu bytes is refused, check /proc/sys/kernel/msgmax\n", msgsz);}
+    return r;
 }
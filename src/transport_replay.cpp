@@ -0,0 +1,205 @@
+/*`````````````````````````````````````````````````````````````````````````````
+* Replay transport, a stand-in for transport_ipc.cpp. It feeds the requests
+* of a traffic capture (plant_traffic_capture()) to the plant, at the original
+* pace or faster, and measures the latency of each request: from its
+* scheduled arrival to the end of the sending of its reply.
+* Configured by the environment:
+*   P2P_REPLAY          capture file
+*   P2P_REPLAY_SPEED    pace relative to the original, 0: as fast as possible,
+*                       default 1
+*   P2P_REPLAY_REPORT   optional CSV file of per-request latencies
+* When the capture is exhausted and the replies have been sent, the summary is
+* printed and transport_recv() returns 0, which ends the main loop.
+* Replies are matched to requests: the thread, which runs the plant, replies
+* within plant_process_request(), so its first send after a request is the
+* reply; requests, which have been passed to workers, are matched to replies
+* of workers in order of arrival. Deferred replies of asynchronous setters
+* are not told apart from replies. Only one plant per process is supported.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../include/defines.h"
+
+//``````````````````Replay variables```````````````````````````````````````````
+#define REPLAY_DRAIN_MS 1000// wait for replies of workers at the end
+static uint8_t* data = NULL;    // the capture file
+static uint32_t nrequests = 0;
+static uint64_t* offsets;       // of requests in data
+static uint64_t* arrivals;      // original arrival, ns since the start
+static uint32_t* lengths;
+static uint64_t* due;           // scheduled arrival, CLOCK_MONOTONIC ns
+static int64_t* latencies;      // ns, -1 if no reply
+static double speed = 1;
+static const char* report_path = NULL;
+static uint32_t next = 0;       // next request to feed
+static uint64_t start = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t current = -1;    // request being processed by the writer
+static uint32_t* queued;        // requests passed to workers, FIFO
+static uint32_t queued_head = 0, queued_tail = 0;
+static uint64_t nframes = 0, frame_bytes = 0;
+
+//``````````````````Helper functions``````````````````````````````````````````
+static uint64_t now_ns(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+static int cmp_int64(const void* a, const void* b){
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+static int load_capture(const char* path){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 or fstat(fd, &st) != 0){
+        printf("TrR:ERR. Could not open capture %s\n", path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    data = (uint8_t*) malloc(st.st_size);
+    ssize_t n = data? read(fd, data, st.st_size): -1;
+    close(fd);
+    if (n != st.st_size or n < (ssize_t)sizeof(TRAFFIC_HEADER)
+      or memcmp(data, TRAFFIC_MAGIC, 8) != 0){
+        printf("TrR:ERR. %s is not a traffic capture\n", path);
+        return 1;
+    }
+    // Count the records, then index them
+    for (int pass=0; pass < 2; pass++){
+        uint64_t off = sizeof(TRAFFIC_HEADER);
+        uint32_t i = 0;
+        while (off + sizeof(TRAFFIC_RECORD) <= (uint64_t)n){
+            TRAFFIC_RECORD r;
+            memcpy(&r, data + off, sizeof(r));
+            off += sizeof(r);
+            if (off + r.length > (uint64_t)n){
+                break;}// truncated by a crash
+            if (pass == 1){
+                offsets[i] = off;
+                arrivals[i] = r.t;
+                lengths[i] = r.length;
+            }
+            off += r.length;
+            i++;
+        }
+        if (pass == 0){
+            nrequests = i;
+            offsets = (uint64_t*) malloc((i+1)*sizeof(uint64_t));
+            arrivals = (uint64_t*) malloc((i+1)*sizeof(uint64_t));
+            lengths = (uint32_t*) malloc((i+1)*sizeof(uint32_t));
+            due = (uint64_t*) calloc(i+1, sizeof(uint64_t));
+            latencies = (int64_t*) malloc((i+1)*sizeof(int64_t));
+            queued = (uint32_t*) malloc((i+1)*sizeof(uint32_t));
+            for (uint32_t k=0; k < i; k++){
+                latencies[k] = -1;}
+        }
+    }
+    printf("TrR:Replaying %u requests of %s at speed %g\n", nrequests, path, speed);
+    return 0;
+}
+static void report(){
+    uint64_t elapsed = now_ns() - start;
+    int64_t* sorted = (int64_t*) malloc((nrequests+1)*sizeof(int64_t));
+    uint32_t nreplies = 0;
+    for (uint32_t i=0; i < nrequests; i++){
+        if (latencies[i] >= 0){
+            sorted[nreplies++] = latencies[i];}
+    }
+    qsort(sorted, nreplies, sizeof(int64_t), cmp_int64);
+    #define PCT(p) (nreplies? sorted[(uint32_t)((nreplies - 1)*(p))]*1e-3: 0)
+    printf("TrR:Replayed %u requests in %.3f s, %u replies, %lu frames of %lu bytes\n",
+      nrequests, elapsed*1e-9, nreplies, nframes, frame_bytes);
+    printf("TrR:Latency [us] p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+      PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0));
+    #undef PCT
+    free(sorted);
+    if (report_path == NULL){
+        return;}
+    FILE* f = fopen(report_path, "w");
+    if (f == NULL){
+        printf("TrR:ERR. Could not create report %s\n", report_path);
+        return;
+    }
+    fprintf(f, "request,arrival_us,length,latency_us\n");
+    for (uint32_t i=0; i < nrequests; i++){
+        fprintf(f, "%u,%.3f,%u,%.3f\n", i, arrivals[i]*1e-3, lengths[i],
+          latencies[i] < 0? -1.: latencies[i]*1e-3);}
+    fclose(f);
+    printf("TrR:Per-request latencies are in %s\n", report_path);
+}
+//``````````````````Transport functions````````````````````````````````````````
+int transport_init(uint8_t *buf, uint32_t bufsz){
+    plant->recv_bufsize = bufsz;
+    plant->recv_buf = buf;
+    const char* path = getenv("P2P_REPLAY");
+    if (path == NULL){
+        printf("TrR:ERR. Set P2P_REPLAY to the traffic capture to replay\n");
+        return 1;
+    }
+    if (getenv("P2P_REPLAY_SPEED") != NULL){
+        speed = atof(getenv("P2P_REPLAY_SPEED"));}
+    report_path = getenv("P2P_REPLAY_REPORT");
+    return load_capture(path);
+}
+int transport_recv(uint8_t **msg){
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&lock);
+    if (current >= 0){// has not been replied by the writer, passed to a worker
+        queued[queued_tail++] = current;
+        current = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    if (start == 0){
+        start = now;}
+    if (next == nrequests){
+        // The end of the capture, wait for the replies of workers
+        while (__atomic_load_n(&queued_head, __ATOMIC_ACQUIRE) != queued_tail
+          and now_ns() - now < REPLAY_DRAIN_MS*1000000ull){
+            usleep(1000);}
+        report();
+        return 0;
+    }
+    uint64_t t = now;
+    if (speed > 0){
+        t = start + (uint64_t)((arrivals[next] - arrivals[0])/speed);
+        if (now < t){
+            return -1;}
+    }
+    pthread_mutex_lock(&lock);
+    due[next] = t;
+    current = next;
+    pthread_mutex_unlock(&lock);
+    *msg = data + offsets[next];
+    return lengths[next++];
+}
+int transport_send(uint8_t *msg, size_t msgsz){
+    // The reply is discarded, the time of its sending is taken
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&lock);
+    int64_t request = -1;
+    if (session->read_only){// reply of a worker
+        if (queued_head != queued_tail){
+            request = queued[queued_head];
+            __atomic_store_n(&queued_head, queued_head + 1, __ATOMIC_RELEASE);
+        }else{
+            request = current;
+            current = -1;
+        }
+    }else if (current >= 0){
+        request = current;
+        current = -1;
+    }else{
+        nframes++;
+        frame_bytes += msgsz;
+    }
+    if (request >= 0){
+        latencies[request] = now - due[request];}
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
@@ -0,0 +1,392 @@
+/*Loopback benchmark of P2Plant.
+ * A plant with a configurable set of PVs runs on a server thread, a native
+ * client on the main thread loads it over the local IPC transport and
+ * measures:
+ *  - round-trip latency of get/set requests (percentiles),
+ *  - streaming throughput: frames/s, MB/s and server CPU per frame.
+ * The client is the native client library, include/p2client.h, frames are
+ * decoded as they are received.
+ * The latency test is swept over the number of PVs and the request mix
+ * (percent of sets), the streaming test over the number of channels and
+ * samples per channel. Results are printed as CSV or, with -j, as JSON lines.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <new>// for placement new
+#include <sys/msg.h>
+#include "../include/defines.h"
+#include "../include/pv.h"
+#include "../include/p2client.h"
+//``````````````````Definitions```````````````````````````````````````````````
+#define BENCH_PLANT_ID 9// IPC queues of ftok id 74, apart from the demo
+#define BENCH_MAX_FRAME ENCODER_MAX_SIZE// larger replies are refused by the plant
+#define BENCH_MAX_LIST 16
+#define BENCH_MAX_SAMPLES 1000000// latency samples kept per point
+#define ENCODER_BUFSIZE 15000
+#define RECV_BUF_LENGTH 1500
+#define BENCH_MAX_ITEMS 64// decoded PVs of a reply or frame
+
+uint8_t DBG = 0;
+extern void plant_init(uint8_t *buf, uint32_t bufsize);
+extern void deliver_measurements();
+
+struct BenchConfig {
+    int nch;        // number of streamed channels, one u2 array PV each
+    int nsamples;   // samples per channel
+    int npv;        // number of scalar PVs
+    int set_pct;    // percent of sets in the request mix
+};
+struct BenchResult {
+    const char* test;
+    BenchConfig cfg;
+    long count;     // requests or frames
+    double p50_us, p90_us, p99_us, p999_us, max_us;
+    double frames_s, MB_s, frame_bytes, cpu_us_frame;
+};
+struct BenchServer {
+    BenchConfig cfg;
+    Plant* plant;
+    PV** pvs;
+    uint16_t npv;
+    PV* run;
+    PV* channels;
+    uint16_t* samples;
+    uint8_t encoder_buf[ENCODER_BUFSIZE];
+    uint8_t recv_buf[RECV_BUF_LENGTH];
+    bool ready;
+    bool failed;
+    bool stop;
+    uint64_t frames;        // delivered while streaming
+    uint64_t cpu_ns;        // server thread CPU time while streaming
+};
+static bool JSON = false;
+static FILE* Results = NULL;// stdout of the process, the server prints to /dev/null
+static double Duration = 0.5;// seconds per point
+static P2Item Items[BENCH_MAX_ITEMS];
+static P2Client Client(Items, BENCH_MAX_ITEMS);
+
+//``````````````````Helper functions``````````````````````````````````````````
+static double now_s(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+static uint64_t thread_cpu_ns(){
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+static uint32_t xorshift(){
+    static uint32_t x = 2463534242u;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+static int parse_list(const char* str, int* list){
+    // Parse comma-separated integers, return their number
+    int n = 0;
+    while (*str and n < BENCH_MAX_LIST){
+        char* end;
+        list[n++] = strtol(str, &end, 10);
+        if (*end != ',') break;
+        str = end + 1;
+    }
+    return n;
+}
+static long ipc_msgmax(){
+    // Largest IPC message of the kernel, frames above it are not delivered
+    long msgmax = 8192;
+    FILE* f = fopen("/proc/sys/kernel/msgmax", "r");
+    if (f != NULL){
+        if (fscanf(f, "%ld", &msgmax) != 1) msgmax = 8192;
+        fclose(f);
+    }
+    return msgmax < BENCH_MAX_FRAME? msgmax: BENCH_MAX_FRAME;
+}
+static int cmp_double(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+//``````````````````Server````````````````````````````````````````````````````
+static BenchServer* server_create(const BenchConfig* cfg){
+    BenchServer* bs = (BenchServer*) calloc(1, sizeof(BenchServer));
+    bs->cfg = *cfg;
+    bs->npv = cfg->npv + cfg->nch + 1;
+    bs->pvs = (PV**) malloc(bs->npv*sizeof(PV*));
+    bs->run = new (malloc(sizeof(PV))) PV("run", "Start/Stop streaming", T_str, F_WED);
+    bs->channels = (PV*) malloc(cfg->nch*sizeof(PV));
+    bs->samples = (uint16_t*) malloc(cfg->nch*cfg->nsamples*sizeof(uint16_t));
+    for (int i=0; i < cfg->nch*cfg->nsamples; i++){
+        bs->samples[i] = i;}
+    int n = 0;
+    bs->pvs[n++] = bs->run;
+    char name[32];
+    for (int i=0; i < cfg->nch; i++){
+        snprintf(name, sizeof(name), "adc%i", i);
+        PV* pv = new (&bs->channels[i]) PV(name, "Samples of ADC channel", T_u2ptr, F_M, "counts");
+        pv->set_shape(cfg->nsamples);
+        pv->value.u2ptr = bs->samples + i*cfg->nsamples;
+        bs->pvs[n++] = pv;
+    }
+    for (int i=0; i < cfg->npv; i++){
+        snprintf(name, sizeof(name), "pv%05i", i);
+        bs->pvs[n++] = new (malloc(sizeof(ScalarPV<uint32_t>))) ScalarPV<uint32_t>(
+          name, "Scalar PV", F_R | F_W | F_E, "", 0, 1000000);
+    }
+    bs->plant = plant_create(BENCH_PLANT_ID);
+    return bs;
+}
+static void server_free(BenchServer* bs){
+    // The plant itself is not freed, there is no plant_destroy()
+    for (int i=bs->cfg.nch + 1; i < bs->npv; i++){
+        free(bs->pvs[i]);}
+    free(bs->run);
+    free(bs->channels);
+    free(bs->samples);
+    free(bs->pvs);
+    free(bs);
+}
+static void* server_main(void* arg){
+    BenchServer* bs = (BenchServer*) arg;
+    plant_select(bs->plant);
+    plant_init(bs->encoder_buf, ENCODER_BUFSIZE);
+    plant->pvs = bs->pvs;
+    plant->npv = bs->npv;
+    bs->run->set("stop");
+    if (transport_init(bs->recv_buf, RECV_BUF_LENGTH)){
+        __atomic_store_n(&bs->failed, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    __atomic_store_n(&bs->ready, true, __ATOMIC_RELEASE);
+    bool streaming = false;
+    uint64_t cpu_start = 0;
+    uint8_t* request;
+    struct timespec t;
+    while (not __atomic_load_n(&bs->stop, __ATOMIC_ACQUIRE)){
+        int n = transport_recv(&request);
+        if (n > 0){
+            plant_process_request(request, n);
+            bool start = starts_with(bs->run->value.str, "start");
+            if (start and not streaming){
+                cpu_start = thread_cpu_ns();}
+            if (streaming and not start){
+                bs->cpu_ns += thread_cpu_ns() - cpu_start;}
+            streaming = start;
+            continue;
+        }
+        if (not streaming){
+            sched_yield();
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &t);
+        for (int i=0; i < bs->cfg.nch; i++){
+            bs->channels[i].write_begin();
+            bs->channels[i].update_timestamp(&t);
+        }
+        deliver_measurements();
+        bs->frames++;
+    }
+    return NULL;
+}
+//``````````````````Client````````````````````````````````````````````````````
+static void client_drain(double quiet_s){
+    // Receive until nothing arrives for quiet_s seconds
+    double last = now_s();
+    while (now_s() - last < quiet_s){
+        if (Client.receive(0) > 0) last = now_s();
+        else sched_yield();
+    }
+}
+static int client_set_run(const char* state){
+    P2Request r;
+    r.command("set").set("run", state);
+    return Client.send(&r);
+}
+//``````````````````Tests`````````````````````````````````````````````````````
+static BenchServer* start_server(const BenchConfig* cfg, pthread_t* thread){
+    BenchServer* bs = server_create(cfg);
+    if (pthread_create(thread, NULL, server_main, bs) != 0){
+        server_free(bs);
+        return NULL;
+    }
+    while (not __atomic_load_n(&bs->ready, __ATOMIC_ACQUIRE)){
+        if (__atomic_load_n(&bs->failed, __ATOMIC_ACQUIRE)){
+            pthread_join(*thread, NULL);
+            server_free(bs);
+            return NULL;
+        }
+        sched_yield();
+    }
+    client_drain(0.01);
+    return bs;
+}
+static void stop_server(BenchServer* bs, pthread_t thread){
+    __atomic_store_n(&bs->stop, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    client_drain(0.01);
+    server_free(bs);
+}
+static int test_latency(const BenchConfig* cfg, BenchResult* res){
+    pthread_t thread;
+    BenchServer* bs = start_server(cfg, &thread);
+    if (bs == NULL) return 1;
+    double* samples = (double*) malloc(BENCH_MAX_SAMPLES*sizeof(double));
+    char name[32];
+    long count = 0;
+    double end = now_s() + Duration;
+    for (double t = now_s(); t < end and count < BENCH_MAX_SAMPLES; ){
+        int ipv = xorshift() % cfg->npv;
+        snprintf(name, sizeof(name), "pv%05i", ipv);
+        bool set = (int)(xorshift() % 100) < cfg->set_pct;
+        P2Request r;
+        if (set) r.command("set").set(name, xorshift() % 1000);
+        else r.command("get").name(name);
+        double t0 = now_s();
+        if (Client.request(&r) <= 0 or Client.reply.nitems != (set? 0: 1)){
+            printf("ERR: request failed\n");
+            break;
+        }
+        t = now_s();
+        samples[count++] = (t - t0)*1e6;
+    }
+    stop_server(bs, thread);
+    qsort(samples, count, sizeof(double), cmp_double);
+    res->test = "latency";
+    res->cfg = *cfg;
+    res->count = count;
+    if (count != 0){
+        res->p50_us = samples[count*50/100];
+        res->p90_us = samples[count*90/100];
+        res->p99_us = samples[count*99/100];
+        res->p999_us = samples[count*999/1000];
+        res->max_us = samples[count-1];
+    }
+    free(samples);
+    return count == 0;
+}
+static int test_streaming(const BenchConfig* cfg, BenchResult* res){
+    pthread_t thread;
+    BenchServer* bs = start_server(cfg, &thread);
+    if (bs == NULL) return 1;
+    client_set_run("start");
+    Client.receive();// reply to set or the first frame
+    long frames = 0;
+    double bytes = 0;
+    double t0 = now_s();
+    double t = t0;
+    while (t - t0 < Duration){
+        int n = Client.receive();
+        if (n <= 0 or not Client.reply.subscription) break;
+        frames++;
+        bytes += n;
+        t = now_s();
+    }
+    client_set_run("stop");
+    client_drain(0.05);
+    __atomic_store_n(&bs->stop, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    client_drain(0.01);
+    res->cpu_us_frame = bs->frames? bs->cpu_ns/1e3/bs->frames: 0;
+    server_free(bs);
+    res->test = "streaming";
+    res->cfg = *cfg;
+    res->count = frames;
+    res->frames_s = frames/(t - t0);
+    res->MB_s = bytes/(t - t0)/1e6;
+    res->frame_bytes = frames? bytes/frames: 0;
+    return frames == 0;
+}
+//``````````````````Output````````````````````````````````````````````````````
+static void print_header(){
+    if (JSON) return;
+    fprintf(Results, "test,nch,nsamples,npv,set_pct,count,p50_us,p90_us,p99_us,p999_us,"
+      "max_us,frames_s,MB_s,frame_bytes,cpu_us_frame\n");
+}
+static void print_result(const BenchResult* r){
+    if (JSON){
+        fprintf(Results, "{\"test\":\"%s\",\"nch\":%i,\"nsamples\":%i,\"npv\":%i,"
+          "\"set_pct\":%i,\"count\":%li,\"p50_us\":%.2f,\"p90_us\":%.2f,"
+          "\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f,\"frames_s\":%.1f,"
+          "\"MB_s\":%.3f,\"frame_bytes\":%.0f,\"cpu_us_frame\":%.2f}\n",
+          r->test, r->cfg.nch, r->cfg.nsamples, r->cfg.npv, r->cfg.set_pct,
+          r->count, r->p50_us, r->p90_us, r->p99_us, r->p999_us, r->max_us,
+          r->frames_s, r->MB_s, r->frame_bytes, r->cpu_us_frame);
+    }else{
+        fprintf(Results, "%s,%i,%i,%i,%i,%li,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f,%.3f,%.0f,%.2f\n",
+          r->test, r->cfg.nch, r->cfg.nsamples, r->cfg.npv, r->cfg.set_pct,
+          r->count, r->p50_us, r->p90_us, r->p99_us, r->p999_us, r->max_us,
+          r->frames_s, r->MB_s, r->frame_bytes, r->cpu_us_frame);
+    }
+    fflush(Results);
+}
+//``````````````````Main```````````````````````````````````````````````````````
+int main(int argc, char** argv){
+    int channels[BENCH_MAX_LIST] = {1, 4, 8};
+    int nchannels = 3;
+    int nsamples[BENCH_MAX_LIST] = {64, 256, 800};
+    int nnsamples = 3;
+    int npvs[BENCH_MAX_LIST] = {10, 1000, 10000};
+    int nnpvs = 3;
+    int mixes[BENCH_MAX_LIST] = {0, 10, 50};
+    int nmixes = 3;
+    for (int ii=1; ii<argc; ii++){
+        if (strcmp(argv[ii], "-j") == 0){
+            JSON = true;
+        }else if (strcmp(argv[ii], "-d") == 0 and ii+1 < argc){
+            Duration = atof(argv[++ii]);
+        }else if (strcmp(argv[ii], "-c") == 0 and ii+1 < argc){
+            nchannels = parse_list(argv[++ii], channels);
+        }else if (strcmp(argv[ii], "-n") == 0 and ii+1 < argc){
+            nnsamples = parse_list(argv[++ii], nsamples);
+        }else if (strcmp(argv[ii], "-p") == 0 and ii+1 < argc){
+            nnpvs = parse_list(argv[++ii], npvs);
+        }else if (strcmp(argv[ii], "-m") == 0 and ii+1 < argc){
+            nmixes = parse_list(argv[++ii], mixes);
+        }else{
+            printf("Usage: %s [-j] [-d seconds_per_point] [-c channels,...]"
+              " [-n samples,...] [-p npv,...] [-m set_percent,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (Client.open_ipc(BENCH_PLANT_ID)){
+        return 1;}
+    // The plant prints transport messages, keep the results clean
+    Results = fdopen(dup(fileno(stdout)), "w");
+    if (Results == NULL or freopen("/dev/null", "w", stdout) == NULL){
+        printf("ERR: Could not redirect stdout\n");
+        return 1;
+    }
+    print_header();
+
+    BenchResult res;
+    for (int ip=0; ip < nnpvs; ip++){
+        for (int im=0; im < nmixes; im++){
+            BenchConfig cfg = {1, 16, npvs[ip], mixes[im]};
+            memset(&res, 0, sizeof(res));
+            if (test_latency(&cfg, &res) == 0){
+                print_result(&res);}
+        }
+    }
+    for (int ic=0; ic < nchannels; ic++){
+        for (int is=0; is < nnsamples; is++){
+            BenchConfig cfg = {channels[ic], nsamples[is], npvs[0], 0};
+            if (cfg.nch*(cfg.nsamples*2 + 64) > ipc_msgmax()){
+                fprintf(stderr, "Skipped %i channels of %i samples:"
+                  " frame exceeds the transport limit\n", cfg.nch, cfg.nsamples);
+                continue;
+            }
+            memset(&res, 0, sizeof(res));
+            if (test_streaming(&cfg, &res) == 0){
+                print_result(&res);}
+        }
+    }
+    Client.close();
+    key_t key = ftok("/tmp/ipcbor.ftok", 65 + BENCH_PLANT_ID);
+    msgctl(msgget(key, 0666), IPC_RMID, NULL);
+    msgctl(msgget(key+1, 0666), IPC_RMID, NULL);
+    return 0;
+}
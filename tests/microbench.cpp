@@ -0,0 +1,230 @@
+/*Microbenchmarks of the encode and parse hot paths of P2Plant.
+ * The functions are called directly, replies of requests go to a null
+ * transport, which is defined here instead of src/transport_ipc.cpp.
+ * For each operation the time, the encoded bytes and the heap allocations
+ * per call are reported, as CSV or, with -j, as JSON lines.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>// for placement new
+#include "../include/defines.h"
+#include "../include/pv.h"
+//``````````````````Definitions```````````````````````````````````````````````
+#define ENCODER_BUFSIZE (4*1024*1024)// fits info of 10000 PVs
+#define MAX_NPV 10000
+#define ARRAY_NSAMPLES 1000
+#define MEASURED_EVERY 10// every 10th PV of a table is measured
+
+uint8_t DBG = 0;
+extern void plant_init(uint8_t *buf, uint32_t bufsize);
+
+static bool JSON = false;
+static double MinTime = 0.2;// seconds per operation
+static uint8_t* encoder_buf;
+static uint64_t Bytes = 0;// encoded by the current operation
+static uint64_t Allocs = 0;// plant_heap_allocations() at the start
+
+//``````````````````Null transport````````````````````````````````````````````
+int transport_init(uint8_t *buf, uint32_t bufsz){
+    return 0;
+}
+int transport_recv(uint8_t **msg){
+    return -1;
+}
+int transport_send(uint8_t *msg, size_t msgsz){
+    Bytes += msgsz;
+    return 0;
+}
+//``````````````````PV tables`````````````````````````````````````````````````
+static uint16_t samples[ARRAY_NSAMPLES];
+static PV** tables[MAX_NPV+1];// tables[n] has n PVs
+static char names[MAX_NPV][16];
+
+static PV** make_table(int npv){
+    // Scalar u4 PVs, every MEASURED_EVERY-th is a measured u2 array
+    PV** pvs = (PV**) malloc(npv*sizeof(PV*));
+    for (int i=0; i < npv; i++){
+        snprintf(names[i], sizeof(names[i]), "pv%05i", i);
+        PV* pv;
+        if (i % MEASURED_EVERY == 0){
+            pv = new (malloc(sizeof(PV))) PV(names[i], "Measured array PV", T_u2ptr, F_M, "counts");
+            pv->set_shape(ARRAY_NSAMPLES);
+            pv->value.u2ptr = samples;
+        }else{
+            pv = new (malloc(sizeof(ScalarPV<uint32_t>))) ScalarPV<uint32_t>(
+              names[i], "Scalar PV", F_R | F_W | F_E, "", 0, 1000000);
+            pv->value.u4 = i;
+        }
+        pvs[i] = pv;
+    }
+    return pvs;
+}
+static void select_table(int npv){
+    if (tables[npv] == NULL){
+        tables[npv] = make_table(npv);}
+    plant->pvs = tables[npv];
+    plant->npv = npv;
+}
+//``````````````````Harness```````````````````````````````````````````````````
+static CborEncoder root, branch;
+static void reset_encoder(){
+    cbor_encoder_init(&root, encoder_buf, ENCODER_BUFSIZE, 0);
+    cbor_encoder_create_array(&root, &branch, CborIndefiniteLength);
+    session->reply_encoder = &branch;
+}
+static void count_encoded(){
+    cbor_encoder_close_container(&root, &branch);
+    Bytes += cbor_encoder_get_buffer_size(&root, encoder_buf);
+}
+static double now_s(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+static void print_header(){
+    if (not JSON){
+        printf("op,npv,iterations,ns_op,bytes_op,allocs_op\n");}
+}
+static void run(const char* op, int npv, void (*fn)(void* ctx), void* ctx){
+    // Call fn until MinTime has elapsed, report the cost per call
+    fn(ctx);// warm up, e.g. build the PV index
+    long iterations = 0;
+    long batch = 1;
+    Bytes = 0;
+    Allocs = plant_heap_allocations();
+    double t0 = now_s();
+    double dt = 0;
+    while (dt < MinTime){
+        for (long i=0; i < batch; i++){
+            fn(ctx);}
+        iterations += batch;
+        batch *= 2;
+        dt = now_s() - t0;
+    }
+    double ns = dt*1e9/iterations;
+    double bytes = (double)Bytes/iterations;
+    double allocs = (double)(plant_heap_allocations() - Allocs)/iterations;
+    if (JSON){
+        printf("{\"op\":\"%s\",\"npv\":%i,\"iterations\":%li,\"ns_op\":%.1f,"
+          "\"bytes_op\":%.1f,\"allocs_op\":%.3f}\n", op, npv, iterations, ns,
+          bytes, allocs);
+    }else{
+        printf("%s,%i,%li,%.1f,%.1f,%.3f\n", op, npv, iterations, ns, bytes, allocs);}
+    fflush(stdout);
+}
+//``````````````````Operations````````````````````````````````````````````````
+static void op_val2cbor(void* ctx){
+    reset_encoder();
+    ((PV*)ctx)->val2cbor(&branch);
+    count_encoded();
+}
+static void op_encode_ndarray(void* ctx){
+    uint32_t shape[MAX_DIMENSION] = {ARRAY_NSAMPLES, 0, 0, 0};
+    reset_encoder();
+    encode_ndarray(&branch, samples, T_u2ptr, shape);
+    count_encoded();
+}
+static void op_encode_measurements(void* ctx){
+    TD_timestamp archive_time = {0, 0};
+    reset_encoder();
+    encode_measurements(&archive_time);
+    count_encoded();
+}
+static void op_info2cbor(void* ctx){
+    reset_encoder();
+    ((PV*)ctx)->info2cbor(&branch);
+    count_encoded();
+}
+static void op_reply_info_all(void* ctx){
+    reset_encoder();
+    reply_info("*");
+    count_encoded();
+}
+static uint32_t xorshift(){
+    static uint32_t x = 2463534242u;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+static void op_pvof(void* ctx){
+    reset_encoder();
+    PV* pv = pvof(names[xorshift() % plant->npv]);
+    assert(pv != NULL);
+}
+struct Request {
+    uint8_t buf[256];
+    size_t len;
+};
+static void op_process_request(void* ctx){
+    Request* r = (Request*) ctx;
+    plant_process_request(r->buf, r->len);
+}
+static void make_request(Request* r, const char* cmd, int nnames, bool set){
+    // ["cmd", [names...]] or ["set", [[name, value], ...]]
+    CborEncoder enc, top, list, pair;
+    cbor_encoder_init(&enc, r->buf, sizeof(r->buf), 0);
+    cbor_encoder_create_array(&enc, &top, 2);
+    cbor_encode_text_stringz(&top, cmd);
+    cbor_encoder_create_array(&top, &list, nnames);
+    for (int i=0; i < nnames; i++){
+        const char* name = names[1 + i];// scalars
+        if (set){
+            cbor_encoder_create_array(&list, &pair, 2);
+            cbor_encode_text_stringz(&pair, name);
+            cbor_encode_int(&pair, 100 + i);
+            cbor_encoder_close_container(&list, &pair);
+        }else{
+            cbor_encode_text_stringz(&list, name);}
+    }
+    cbor_encoder_close_container(&top, &list);
+    cbor_encoder_close_container(&enc, &top);
+    r->len = cbor_encoder_get_buffer_size(&enc, r->buf);
+}
+//``````````````````Main```````````````````````````````````````````````````````
+int main(int argc, char** argv){
+    for (int ii=1; ii<argc; ii++){
+        if (strcmp(argv[ii], "-j") == 0){
+            JSON = true;
+        }else if (strcmp(argv[ii], "-t") == 0 and ii+1 < argc){
+            MinTime = atof(argv[++ii]);
+        }else{
+            printf("Usage: %s [-j] [-t seconds_per_op]\n", argv[0]);
+            return 1;
+        }
+    }
+    encoder_buf = (uint8_t*) malloc(ENCODER_BUFSIZE);
+    plant_init(encoder_buf, ENCODER_BUFSIZE);
+    for (int i=0; i < ARRAY_NSAMPLES; i++){
+        samples[i] = i;}
+    print_header();
+
+    const int npvs[] = {10, 100, 1000, 10000};
+    select_table(10);
+    run("val2cbor_u4", 10, op_val2cbor, plant->pvs[1]);
+    run("val2cbor_u2x1000", 10, op_val2cbor, plant->pvs[0]);
+    run("encode_ndarray_u2x1000", 10, op_encode_ndarray, NULL);
+    run("info2cbor", 10, op_info2cbor, plant->pvs[1]);
+    for (uint i=0; i < sizeof(npvs)/sizeof(npvs[0]); i++){
+        select_table(npvs[i]);
+        run("encode_measurements", npvs[i], op_encode_measurements, NULL);
+        run("reply_info_all", npvs[i], op_reply_info_all, NULL);
+        run("pvof", npvs[i], op_pvof, NULL);
+    }
+    // Requests, parsed by parse_cbor_buffer(), replies to the null transport
+    Request get1, get10, set1, set10, info1;
+    make_request(&get1, "get", 1, false);
+    make_request(&get10, "get", 9, false);
+    make_request(&set1, "set", 1, true);
+    make_request(&set10, "set", 9, true);
+    make_request(&info1, "info", 1, false);
+    for (uint i=0; i < sizeof(npvs)/sizeof(npvs[0]); i++){
+        select_table(npvs[i]);
+        run("request_get_1", npvs[i], op_process_request, &get1);
+        run("request_get_9", npvs[i], op_process_request, &get10);
+        run("request_set_1", npvs[i], op_process_request, &set1);
+        run("request_set_9", npvs[i], op_process_request, &set10);
+        run("request_info_1", npvs[i], op_process_request, &info1);
+    }
+    return 0;
+}
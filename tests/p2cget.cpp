@@ -0,0 +1,95 @@
+/*Example of the native client library, include/p2client.h.
+ * Gets PVs of a plant in one batched request and prints them, then,
+ * with -f n, prints the next n frames of measurements.
+ * Usage: p2cget [-p plant_id] [-f nframes] name...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/p2client.h"
+
+#define MAX_ITEMS 256
+
+static void print_item(const P2Item* item){
+    printf("%.*s", item->name_len, item->name);
+    switch (item->kind){
+    case P2K_INT: printf(" = %lld", (long long)item->i); break;
+    case P2K_FLOAT: printf(" = %g", item->f); break;
+    case P2K_TEXT: printf(" = '%.*s'", item->text_len, item->text); break;
+    case P2K_ERROR: printf(" ERR: %.*s", item->text_len, item->text); break;
+    case P2K_ARRAY:{
+        printf(" [");
+        for (int i=0; i < item->ndim; i++){
+            printf(i? ",%u": "%u", item->shape[i]);}
+        printf("] tag %llu:", (unsigned long long)item->tag);
+        // Typed views read the receive buffer in place
+        if (P2Array<uint16_t> a = p2c_array<uint16_t>(item)){
+            for (uint32_t i=0; i < a.size() and i < 8; i++) printf(" %u", a[i]);
+        }else if (P2Array<int16_t> a = p2c_array<int16_t>(item)){
+            for (uint32_t i=0; i < a.size() and i < 8; i++) printf(" %i", a[i]);
+        }else if (P2Array<uint32_t> a = p2c_array<uint32_t>(item)){
+            for (uint32_t i=0; i < a.size() and i < 8; i++) printf(" %u", a[i]);
+        }else if (P2Array<int32_t> a = p2c_array<int32_t>(item)){
+            for (uint32_t i=0; i < a.size() and i < 8; i++) printf(" %i", a[i]);
+        }else{
+            printf(" %u bytes", item->nbytes);}
+        break;
+    }
+    default: break;
+    }
+    if (item->ntimes != 0){
+        P2Timestamp t = item->time();
+        printf(" @%u.%09u", t.tv_sec, t.tv_nsec);
+    }
+    printf("\n");
+}
+int main(int argc, char** argv){
+    int plant_id = 0;
+    int nframes = 0;
+    P2Request r;
+    r.command("get");
+    int nnames = 0;
+    for (int ii=1; ii<argc; ii++){
+        if (strcmp(argv[ii], "-p") == 0 and ii+1 < argc){
+            plant_id = atoi(argv[++ii]);
+        }else if (strcmp(argv[ii], "-f") == 0 and ii+1 < argc){
+            nframes = atoi(argv[++ii]);
+        }else{
+            r.name(argv[ii]);
+            nnames++;
+        }
+    }
+    if (nnames == 0 and nframes == 0){
+        printf("Usage: %s [-p plant_id] [-f nframes] name...\n", argv[0]);
+        return 1;
+    }
+    static P2Item items[MAX_ITEMS];
+    P2Client client(items, MAX_ITEMS);
+    if (client.open_ipc(plant_id)){
+        return 1;}
+    if (nnames != 0){
+        r.id(1);
+        if (client.request(&r, 1000) <= 0){
+            printf("ERR: no reply from plant %i\n", plant_id);
+            return 1;
+        }
+        if (client.reply.error != NULL){
+            printf("%.*s\n", client.reply.error_len, client.reply.error);}
+        for (int i=0; i < client.reply.nitems; i++){
+            print_item(&items[i]);}
+    }
+    for (int n=0; n < nframes; ){
+        if (client.receive(1000) <= 0){
+            printf("ERR: no frames, is the plant running?\n");
+            return 1;
+        }
+        if (not client.reply.subscription) continue;
+        printf("Frame %i\n", n++);
+        for (int i=0; i < client.reply.nitems; i++){
+            printf("  ");
+            print_item(&items[i]);
+        }
+    }
+    client.close();
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*Protocol checks of the demo plant, bin/simulatedADCs, over the native client.
+ * Each check prints ok or FAIL, the exit status is the number of failures.
+ * `make check` starts the demo, runs the checks and stops it.
+ * Usage: p2check [-p plant_id] [-a archive_dir of the demo]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "../include/p2client.h"
+
+#define MAX_ITEMS 64
+
+static P2Item items[MAX_ITEMS];
+static P2Client client(items, MAX_ITEMS);
+static int failures = 0;
+static int64_t next_id = 1;
+static const char* archive_dir = NULL;
+
+static void check(bool ok, const char* what){
+    printf("%s %s\n", ok? "ok  ": "FAIL", what);
+    if (not ok) failures++;
+}
+static bool request(P2Request* r){
+    // Send r and receive its reply into client.items
+    r->id(next_id++);
+    if (client.request(r, 2000) <= 0){
+        printf("ERR: no reply, is the plant running?\n");
+        exit(1);
+    }
+    return client.reply.error == NULL;
+}
+static bool set(const char* pvname, const char* value){
+    P2Request r;
+    r.command("set").set(pvname, value);
+    request(&r);
+    return client.find(pvname) == NULL;
+}
+static bool set(const char* pvname, int64_t value){
+    P2Request r;
+    r.command("set").set(pvname, value);
+    request(&r);
+    return client.find(pvname) == NULL;// a reply entry of a set is an error
+}
+static bool has_feature(const char* pvname, char letter){
+    // Check the feature letter in the fbits of the info of the PV
+    P2Request r;
+    r.command("info").name(pvname);
+    request(&r);
+    const char* fbits;
+    uint32_t len;
+    if (not p2c_map_text(client.find(pvname), "fbits", &fbits, &len)){
+        return false;}
+    return memchr(fbits, letter, len) != NULL;
+}
+//``````````````````Checks`````````````````````````````````````````````````````
+static void check_reshape_features(){
+    // Streaming moves between adc0 and adcs, both stay readable
+    check(set("adc_nchannels", 8), "set adc_nchannels 8");
+    check(has_feature("adc0", 'R') and not has_feature("adc0", 'M'),
+      "adc0 is readable, not streamed, with 8 channels");
+    check(has_feature("adcs", 'R') and has_feature("adcs", 'M'),
+      "adcs is streamed with 8 channels");
+    check(set("adc_nchannels", 1), "set adc_nchannels 1");
+    check(has_feature("adc0", 'R') and has_feature("adc0", 'M'),
+      "adc0 is streamed with 1 channel");
+    check(has_feature("adcs", 'R') and not has_feature("adcs", 'M'),
+      "adcs is readable, not streamed, with 1 channel");
+}
+static uint64_t archived_records(){
+    // Records in the segments of the archive, see ARCHIVE_HEADER in defines.h
+    struct {char magic[8]; uint32_t header_size, nindex; uint64_t used, nrecords;} h;
+    uint64_t n = 0;
+    DIR* d = opendir(archive_dir);
+    if (d == NULL) return 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL){
+        if (strstr(e->d_name, ".p2a") == NULL) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", archive_dir, e->d_name);
+        FILE* f = fopen(path, "rb");
+        if (f == NULL) continue;
+        if (fread(&h, sizeof(h), 1, f) == 1) n += h.nrecords;
+        fclose(f);
+    }
+    closedir(d);
+    return n;
+}
+static void check_archive_channels(){
+    // Frames of a run are archived with 1 and with several channels
+    if (archive_dir == NULL) return;
+    for (int nch = 1; nch <= 8; nch += 7){
+        char what[64];
+        set("adc_nchannels", nch);
+        uint64_t before = archived_records();
+        set("run", "start");
+        usleep(500000);
+        set("run", "stop");
+        snprintf(what, sizeof(what), "a run with %i channels is archived", nch);
+        check(archived_records() > before, what);
+    }
+    set("adc_nchannels", 1);
+}
+static void check_request_id(){
+    // The id is echoed as the first element of the reply, even if it is last
+    P2Request r;
+    r.command("get").name("adc_nchannels").id(next_id++);
+    client.send(&r);
+    const uint8_t* msg;
+    int n;
+    do n = client.transport.recv(client.transport.ctx, &msg, 2000);
+    while (n > 13 and memcmp(msg + 2, "Subscription", 12) == 0);// frames
+    check(n > 4 and memcmp(msg + 1, "\x62id", 3) == 0,
+      "the id of a request is the first element of its reply");
+}
+static bool get_has(const char* pvname, const char* entry){
+    // Check that the reply of get pvname has the entry
+    P2Request r;
+    r.command("get").name(pvname);
+    request(&r);
+    return client.find(entry) != NULL;
+}
+static void check_group_flag(){
+    // [name, flag] changes the flag of a group and keeps its members
+    P2Request r;
+    r.command("group").set("p2check", "adc_nchannels");
+    request(&r);
+    check(get_has("p2check", "adc_nchannels") and not get_has("p2check", "p2check"),
+      "group of a client has its member, without a shared timestamp");
+    P2Request f;
+    f.command("group").set("p2check", (int64_t)1);
+    request(&f);
+    check(get_has("p2check", "adc_nchannels") and get_has("p2check", "p2check"),
+      "flag of the group is set, the member is kept");
+}
+static void check_array_set(){
+    // An array set is read back through a typed-array view
+    const int64_t offsets[] = {-3};
+    P2Request r;
+    r.command("set").set("adc_offsets", offsets, 1);
+    request(&r);
+    check(client.find("adc_offsets") == NULL, "set adc_offsets [-3]");
+    P2Request g;
+    g.command("get").name("adc_offsets");
+    request(&g);
+    P2Array<int16_t> a = client.array<int16_t>("adc_offsets");
+    check(a and a.size() == 1 and a[0] == -3, "adc_offsets is [-3]");
+}
+static void check_off_limit(){
+    // Sets of typed PVs are checked as 64-bit values, not truncated to int
+    P2Request r;
+    r.command("set").set("sleep", (int64_t)1 << 32 | 5);
+    request(&r);
+    const P2Item* e = client.find("sleep");
+    check(e != NULL and e->kind == P2K_ERROR and e->text_len == 17
+      and memcmp(e->text, "Off limit setting", 17) == 0,
+      "set sleep 2**32+5 is off limit");
+    P2Request g;
+    g.command("get").name("sleep");
+    request(&g);
+    e = client.find("sleep");
+    check(e != NULL and e->kind == P2K_INT and e->i != 5,
+      "sleep is not changed");
+}
+int main(int argc, char** argv){
+    int plant_id = 0;
+    for (int ii=1; ii<argc; ii++){
+        if (strcmp(argv[ii], "-p") == 0 and ii+1 < argc){
+            plant_id = atoi(argv[++ii]);
+        }else if (strcmp(argv[ii], "-a") == 0 and ii+1 < argc){
+            archive_dir = argv[++ii];
+        }else{
+            printf("Usage: %s [-p plant_id] [-a archive_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (client.open_ipc(plant_id)){
+        return 1;}
+    check_request_id();
+    check_group_flag();
+    check_array_set();
+    check_off_limit();
+    check_reshape_features();
+    check_archive_channels();
+    client.close();
+    printf("%i checks failed\n", failures);
+    return failures;
+}
@@ -1,16 +1,35 @@
 /*P2Plqnt implementation of simulated 8-channel ADC.
+ * The number of channels, record length, trigger rate and the synthetic
+ * signal are set at startup: -n, -l, -r, -g. With -r the records are
+ * triggered at a fixed rate, up to kHz, instead of once per main loop
+ * cycle, paced by the sleep PV. This is the reference workload for
+ * throughput testing.
  */
 #define _VERSION "1.0.1 2025-03-07"// deliver_measurements()
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
 #include "../include/defines.h"
 #include "../include/pv.h"
+#include "../include/capture.h"
+#include "../include/trace.h"
 //``````````````````Definitions```````````````````````````````````````````````
 #define mega 1000000
-#define ADC_Max_nChannels 1
-#define ADC_Max_nSamples 2000// 100 OK, 1500 too much
+#define ADC_Max_nChannels 64
+#define ADC_Max_nSamples 65535// adc_reclen is u2
 #define ADC_Max_value 4095
+#define ADC_Default_nChannels 1
+#define ADC_Default_nSamples 2000
+#define SineFrequency 1000// Hz, the period in samples depends on adc_srate
+#define NoiseTableSize 65536
+#define PulseLength 64
+#define FrameOverhead 1000// bytes of a frame besides the samples
+#define Capture_nRecords 16// ring of the waveform capture
+#define ArchiveSegmentSize (64*1024*1024)// bytes per archive segment file
+#define SnapshotIntervalMS 1000// changed settings are saved not more often
+#define ParallelFrameMin 16384// smaller frames are not worth the thread handoff
 
 //`````````````````Global variables```````````````````````````````````````````
 uint8_t DBG = 0; // Debugging verbosity level, 3 is highest.
@@ -24,6 +43,11 @@ static uint16_t LoopReportMS = 10000;
 static uint32_t requests_received = 0;
 static uint32_t requests_received_since_last_periodic = 0;
 static struct timespec ptimer_last_update, ptimer_now;
+static int ADC_nChannels = ADC_Default_nChannels;
+static int ADC_nSamples = ADC_Default_nSamples;
+static uint32_t ADC_TriggerRate = 0;// Hz, 0: once per main loop cycle
+static const char* ADC_Signal = "ramp";
+static struct timespec next_trigger;// of the fixed-rate trigger
 
 //``````````````````Helper functions``````````````````````````````````````````
 int mssleep(long miliseconds);// defined in helpers.
@@ -37,39 +61,58 @@ static bool has_periodic_interval_elapsed(){
     return true;
 }
 //``````````````````Memory for array parameters```````````````````````````````
-static int16_t adc_offsets[] = {1, 2, 3, 32000, -32000, 16, 17, 18};
-static uint32_t perf[] = {0, 0}; 
+// Arrays, which follow adc_nchannels and adc_reclen, are in the array pool
+// of the plant, see reshape_adcs()
+static const int16_t adc_offsets_pattern[] = {1, 2, 3, 32000, -32000, 16, 17, 18};
 enum PERFITEM {
     TRIG_COUNT,
     HOST_RPS,
+    PERF_NITEMS,
 };
 //``````````````````Definitions of PVs````````````````````````````````````````
 // Mandatory PVs
 static PV pv_version = {"version",
     "simulatedADCs version", T_str, F_R};
 static PV pv_run = 	{"run",
-    "Start/Stop the streaming of measurements", T_str, F_WED};
+    "Start/Stop the streaming of measurements", T_str, F_WED & ~F_r};
+// run is not restored: after restart the plant waits for a client to start it
 
 // Auxiliary PVs
 static PV pv_debug = {"debug",
     "Show debugging messages", 	T_B, F_WEI};
-static PV pv_sleep = 	{"sleep",
-    "Sleep in the program loop", T_u4, F_WE, "ms"};
-static PV pv_perf = {"perf",
-    "Performance counters. TrigCount, RPS in main loop", T_u4ptr, F_M};
+static ScalarPV<uint32_t> pv_sleep = {"sleep",
+    "Sleep in the program loop", F_WE, "ms", MinI32, MaxI32, NULL, 32};
+static ArrayPV<uint32_t, PERF_NITEMS> pv_perf = {"perf",
+    "Performance counters. TrigCount, RPS in main loop", F_M, "",
+    MinI32, MaxI32, NULL, 360};
 
 // ADC-related PVs
 static PV pv_adc_offsets = {"adc_offsets",// not implemented in MCUFEC
     "Offsets of all ADC channels", T_i2ptr, F_WE, "counts"};
+static PV pv_adc_nchannels = {"adc_nchannels",
+    "Number of ADC channels", T_u2, F_WE, "", 1, ADC_Max_nChannels};
 static PV pv_adc_reclen = {"adc_reclen",
-    "Record length. Number of samples of each ADC", T_u2, F_WE};
+    "Record length. Number of samples of each ADC", T_u2, F_WE, "", 1, ADC_Max_nSamples};
 static PV pv_adc_srate = {"adc_srate",
     "Sampling rate of ADCs", T_u4, F_WE, "Hz"};
+static PV pv_adc_trate = {"adc_trate",
+    "Trigger rate, 0: once per main loop cycle", T_u4, F_WE, "Hz"};
+static PV pv_adc_signal = {"adc_signal",
+    "Synthetic signal of the ADCs", T_str, F_WED};
 static PV pv_adc0 = {"adc0",
-    "Array of samples of the first ADC channel", T_u2ptr, F_M, "counts"};
+    "Array of samples of the first ADC channel", T_u2ptr, F_M|F_A, "counts"};
 static PV pv_adcs = {"adcs",
     "Two-dimentional array[adc#][samples] of all ADC channels", T_u2ptr, F_R, "counts"};
 
+// Waveform capture PVs
+static PV pv_cap_threshold = {"cap_threshold",
+    "Capture trigger threshold on the first ADC channel", T_i4, F_WE, "counts"};
+static PV pv_cap_trigger = {"cap_trigger",
+    "Software trigger of the waveform capture", T_B, F_R | F_W | F_E};
+static PV pv_cap_window = {"cap_window",
+    "Captured pre/post-trigger window of adcs[record][adc#][samples]", T_u2ptr, F_R, "counts"};
+static WaveformCapture capture(&pv_adcs, &pv_cap_window, Capture_nRecords, 1, 2);
+
 // List of active PVs
 static PV* _PVs[] = {
   &pv_version,
@@ -78,27 +121,119 @@ static PV* _PVs[] = {
   &pv_sleep,
   &pv_perf,
   &pv_adc_offsets,
+  &pv_adc_nchannels,
   &pv_adc_reclen,
   &pv_adc_srate,
+  &pv_adc_trate,
+  &pv_adc_signal,
   &pv_adc0,
   &pv_adcs,
+  &pv_cap_threshold,
+  &pv_cap_trigger,
+  &pv_cap_window,
 };
+#define N_APP_PVS (sizeof(_PVs)/sizeof(PV*))
+static PV* table[N_APP_PVS + STATS_NPV + RT_NPV];// application, statistics and cycle PVs
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
+//``````````````````Synthetic signals``````````````````````````````````````````
+/* Records are assembled from precomputed tables by block copies and simple
+ * loops, which the compiler vectorizes, instead of computing every sample.
+ * Channels are shifted in phase against each other.
+ */
+static uint16_t* sine_table;    // two periods, any period is contiguous
+static uint32_t sine_period = 0;
+static uint32_t sine_srate = 0; // adc_srate, for which the table was built
+static uint16_t* noise_table;   // NoiseTableSize + ADC_Max_nSamples
+static uint16_t pulse_table[PulseLength];
+static uint32_t xorshift(){
+    static uint32_t x = 2463534242u;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+static int init_signals(){
+    noise_table = (uint16_t*) malloc((NoiseTableSize + ADC_Max_nSamples)*sizeof(uint16_t));
+    sine_table = (uint16_t*) malloc(2*ADC_Max_nSamples*sizeof(uint16_t));
+    if (noise_table == NULL or sine_table == NULL){
+        printf("ERR: no memory for signal tables\n");
+        return 1;
+    }
+    for (int i=0; i < NoiseTableSize + ADC_Max_nSamples; i++){
+        noise_table[i] = ADC_Max_value/2 + xorshift() % 256 - 128;}
+    for (int i=0; i < PulseLength; i++){
+        pulse_table[i] = (ADC_Max_value/2)*exp(-i/8.);}
+    return 0;
+}
+static void build_sine(uint32_t srate){
+    uint32_t period = srate/SineFrequency;
+    if (period < 4) period = 4;
+    if (period > ADC_Max_nSamples) period = ADC_Max_nSamples;
+    for (uint32_t i=0; i < period; i++){
+        sine_table[i] = sine_table[i + period] =
+          ADC_Max_value/2*(1 + sin(2*M_PI*i/period));}
+    sine_period = period;
+    sine_srate = srate;
+}
+static void fill_ramp(uint16_t* out, uint32_t n, uint32_t start){
+    // (start + i) % n, in two runs
+    start %= n;
+    uint32_t first = n - start;
+    for (uint32_t i=0; i < first; i++) out[i] = start + i;
+    for (uint32_t i=first; i < n; i++) out[i] = i - first;
+}
+static void fill_sine(uint16_t* out, uint32_t n, uint32_t phase){
+    const uint16_t* src = sine_table + phase % sine_period;
+    for (uint32_t done=0; done < n; done += sine_period){
+        uint32_t k = n - done < sine_period? n - done: sine_period;
+        memcpy(out + done, src, k*sizeof(uint16_t));
+    }
+}
+static void fill_noise(uint16_t* out, uint32_t n){
+    memcpy(out, noise_table + xorshift() % NoiseTableSize, n*sizeof(uint16_t));
+}
+static void fill_pulse(uint16_t* out, uint32_t n, uint32_t position){
+    for (uint32_t i=0; i < n; i++) out[i] = ADC_Max_value/8;// baseline
+    position %= n;
+    for (uint32_t i=0; i < PulseLength and position + i < n; i++){
+        out[position + i] += pulse_table[i];}
+}
 // Update ADCs, Called every cycle.
-static uint16_t adc_samples[ADC_Max_nChannels*ADC_Max_nSamples];
 static void update_adcs(uint32_t base){
-    int nsamples = pv_adc_reclen.value.u2;
-    // Update ADC data
-    for (uint32_t iadc=0; iadc<pv_adcs.shape[0]; iadc++){
-        for (uint32_t ii=0; ii<pv_adcs.shape[1]; ii++){
-            adc_samples[iadc*nsamples + ii] = (base+iadc+ii) % pv_adcs.shape[1];
+    uint32_t nsamples = pv_adc_reclen.value.u2;
+    uint32_t nch = pv_adcs.shape[0];
+    char signal = pv_adc_signal.value.str[0];
+    if (signal == 's' and pv_adc_srate.value.u4 != sine_srate){
+        build_sine(pv_adc_srate.value.u4);}
+    // Update ADC data, directly in the capture ring
+    uint16_t* adc_samples = (uint16_t*)capture.next_record();
+    for (uint32_t iadc=0; iadc<nch; iadc++){
+        uint16_t* out = adc_samples + iadc*nsamples;
+        switch (signal){
+        case 's': fill_sine(out, nsamples, base*nsamples + iadc*sine_period/nch); break;
+        case 'n': fill_noise(out, nsamples); break;
+        case 'p': fill_pulse(out, nsamples, base*PulseLength + iadc*nsamples/nch); break;
+        default: fill_ramp(out, nsamples, base + iadc);
         }
     }
-    // Update ADC timestamp
-    pv_adc0.timestamp.tv_sec = ptimer_now.tv_sec;
-    pv_adc0.timestamp.tv_nsec = ptimer_now.tv_nsec;
-    pv_adcs.timestamp.tv_sec = ptimer_now.tv_sec;
-    pv_adcs.timestamp.tv_nsec = ptimer_now.tv_nsec;
+    // Publish the record and update ADC timestamp
+    capture.commit(&ptimer_now);
+    pv_adc0.value.u2ptr = pv_adcs.value.u2ptr;
+    pv_adc0.update_timestamp(&ptimer_now);
+}
+static void wait_trigger(uint32_t rate){
+    // Sleep until the next trigger of the fixed-rate trigger. If it is
+    // late by more than a period, the missed triggers are dropped.
+    uint64_t period = 1000000000ull/rate;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t tnow = now.tv_sec*1000000000ull + now.tv_nsec;
+    uint64_t t = next_trigger.tv_sec*1000000000ull + next_trigger.tv_nsec + period;
+    if (t + period < tnow or t > tnow + period){
+        t = tnow;}
+    next_trigger.tv_sec = t/1000000000;
+    next_trigger.tv_nsec = t%1000000000;
+    if (t > tnow){
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_trigger, NULL);}
+    clock_gettime(CLOCK_REALTIME, &ptimer_now);// timestamp of the trigger
 }
 // Periodic update. Called every 10 s.
 static uint32_t host_rps;
@@ -106,10 +241,10 @@ static uint32_t trig_count;
 static void periodic_update(){
     if(DBG>=1)printf("periodic_update @ %i s, host_rps=%i, run: %s\n",
         ptimer_now.tv_sec, host_rps, pv_run.value.str);
-    perf[TRIG_COUNT] = trig_count;
-    perf[HOST_RPS] = host_rps;
-    pv_perf.timestamp.tv_sec = ptimer_now.tv_sec;
-    pv_perf.timestamp.tv_nsec = ptimer_now.tv_nsec;
+    pv_perf.write_begin();// perf is modified in place
+    pv_perf.data[TRIG_COUNT] = trig_count;
+    pv_perf.data[HOST_RPS] = host_rps;
+    pv_perf.update_timestamp(&ptimer_now);
 }
 //``````````````````Setters```````````````````````````````````````````````````
 static int pv_debug_setter(){
@@ -117,6 +252,93 @@ static int pv_debug_setter(){
     printf(">pv_debug_setter %i \n", DBG);
     return 0;
 }
+static void* adc_srate_worker(void*){
+    // Reprogramming of the ADC clock takes time, it is done in a thread.
+    mssleep(200);
+    if(DBG>=1)printf("ADC sampling rate set to %u\n", pv_adc_srate.value.u4);
+    pv_adc_srate.setter_done(0);
+    return NULL;
+}
+static int pv_cap_threshold_setter(){
+    capture.threshold = pv_cap_threshold.value.i4;
+    capture.channel = 0;
+    return 0;
+}
+static int pv_cap_trigger_setter(){
+    if (pv_cap_trigger.value.B != 0){
+        capture.trigger();}
+    pv_cap_trigger.value.B = 0;
+    return 0;
+}
+static int pv_cap_window_getter(){
+    return capture.linearize();
+}
+static int reshape_adcs(){
+    /* Reshape the ADC PVs to adc_nchannels of adc_reclen samples. Their
+     * storage, adc_offsets and the capture ring, is reallocated from the
+     * array pool, so the memory follows the configuration.
+     */
+    uint32_t nch = pv_adc_nchannels.value.u2;
+    uint32_t nsamples = pv_adc_reclen.value.u2;
+    uint32_t nold = pv_adc_offsets.value.Bptr != NULL? pv_adc_offsets.shape[0]: 0;
+    if (pv_adc_offsets.reshape(nch)){
+        return 1;}
+    pv_adc_offsets.write_begin();// offsets of the new channels
+    for (uint32_t i=nold; i < nch; i++){
+        pv_adc_offsets.value.i2ptr[i] = adc_offsets_pattern[i % 8];}
+    pv_adc_offsets.update_timestamp();
+
+    uint32_t old_shape[MAX_DIMENSION];
+    memcpy(old_shape, pv_adcs.shape, sizeof(old_shape));
+    pv_adcs.write_begin();
+    pv_adc0.write_begin();
+    pv_adcs.set_shape(nch, nsamples);
+    pv_adc0.set_shape(nsamples);
+    if (capture.init()){// the old ring is kept
+        memcpy(pv_adcs.shape, old_shape, sizeof(old_shape));
+        pv_adc0.set_shape(old_shape[1]);
+        pv_adcs.write_end();
+        pv_adc0.write_end();
+        return 1;
+    }
+    // Stream and archive all channels, adc0 is a part of them, or only adc0
+    if (nch > 1){
+        pv_adcs.set_features(pv_adcs.fbits | F_M | F_A);
+        pv_adc0.set_features(pv_adc0.fbits & ~(F_Mbit | F_A));
+    }else{
+        pv_adcs.set_features(pv_adcs.fbits & ~(F_Mbit | F_A));
+        pv_adc0.set_features(pv_adc0.fbits | F_M | F_A);
+    }
+    update_adcs(trig_count);// ends the modification of adcs and adc0
+    ADC_nChannels = nch;
+    ADC_nSamples = nsamples;
+    size_t cached;
+    size_t used = plant_array_bytes(&cached);
+    printf("ADC: %u channels of %u samples, array storage %zu bytes, %zu cached\n",
+      nch, nsamples, used, cached);
+    return 0;
+}
+static int adc_shape_setter(PV* pv){
+    if (reshape_adcs() == 0){
+        return 0;}
+    encode_error(session->reply_encoder, pv->name, "No memory for the records");
+    pv_adc_nchannels.value.u2 = ADC_nChannels;
+    pv_adc_reclen.value.u2 = ADC_nSamples;
+    return 0;
+}
+static int pv_adc_nchannels_setter(){
+    return adc_shape_setter(&pv_adc_nchannels);
+}
+static int pv_adc_reclen_setter(){
+    return adc_shape_setter(&pv_adc_reclen);
+}
+static int pv_adc_srate_setter(){
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, adc_srate_worker, NULL) != 0)
+        return 0;
+    pthread_detach(thread);
+    return SETTER_PENDING;
+}
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
 // Parser storage in p2plant
 #define PARSER_BUFSIZE 15000
@@ -126,14 +348,13 @@ static uint8_t encoder_buf[PARSER_BUFSIZE];
 // Necessary functions, defined in p2plant
 extern void plant_init(uint8_t *buf, uint32_t bufsize);
 extern void deliver_measurements();
-extern bool plant_client_alive;
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
 //`````````````````Entries for main loop``````````````````````````````````````
 
 static int create_PVs(){
     // Called to initialize PVs, return number of PVs served.
     printf("simulatedADCs %s, %i[%i] channels\n",_VERSION,
-      ADC_Max_nChannels, ADC_Max_nSamples);
+      ADC_nChannels, ADC_nSamples);
     pv_version.set(_VERSION);
     printf("pv_version: %s\n", pv_version.value.str);
 
@@ -142,67 +363,143 @@ static int create_PVs(){
     pv_sleep.opLow = 0;
     pv_sleep.opHigh = 10000;
     pv_sleep.set(100);
-    pv_perf.set(perf);
-    pv_perf.set_shape(sizeof(perf)/sizeof(perf)[0]);
 
     pv_debug.setter = pv_debug_setter;
-
-    int nch = ADC_Max_nChannels;
-    pv_adc_offsets.set_shape(nch);
-    pv_adc_offsets.set(adc_offsets);
-    pv_adc_offsets.bufsize = sizeof(adc_offsets);
+    pv_adc_srate.setter = pv_adc_srate_setter;
+    pv_cap_threshold.setter = pv_cap_threshold_setter;
+    pv_cap_trigger.setter = pv_cap_trigger_setter;
+    pv_cap_window.getter = pv_cap_window_getter;
 
     // initialize ADCs
-    pv_adc_reclen.set(ADC_Max_nSamples);
-    pv_adc_srate.set(100000);
-    int nsamples = pv_adc_reclen.value.u2;
-    pv_adc0.set_shape(nsamples);
-    pv_adcs.set_shape(nch, nsamples);
-    update_adcs(0);
+    pv_adc_nchannels.set(ADC_nChannels);
+    pv_adc_reclen.set(ADC_nSamples);
+    pv_adc_srate.value.u4 = 100000;
+    pv_adc_trate.set(ADC_TriggerRate);
+    pv_adc_signal.legalValues = (char*)"ramp,sine,noise,pulse";
+    if (strstr(pv_adc_signal.legalValues, ADC_Signal) == NULL){
+        printf("ERR: signal %s is not one of %s\n", ADC_Signal, pv_adc_signal.legalValues);
+        return 0;
+    }
+    pv_adc_signal.set(ADC_Signal);
+    if (init_signals()) return 0;
+    if (reshape_adcs()) return 0;
+    pv_adc_nchannels.setter = pv_adc_nchannels_setter;
+    pv_adc_reclen.setter = pv_adc_reclen_setter;
+    pv_cap_threshold.set(ADC_Max_value+1);// above all samples: disabled
     if(DBG>=2){ 
         printf("ADC:\n");
-        int16_t* i2idx = (int16_t*)(adc_samples);
+        int16_t* i2idx = pv_adcs.value.i2ptr;
         for (uint32_t ii = 0; ii<(pv_adcs.shape[0]*pv_adcs.shape[1]); ii++){
             printf("%3i,",*i2idx++);
         }
         printf("\n");
     }
-    pv_adc0.set(adc_samples);
-    pv_adcs.set(adc_samples);
-    PVs = _PVs;
-    NPV = (sizeof(_PVs)/sizeof(PV*));
+    memcpy(table, _PVs, sizeof(_PVs));
+    plant->pvs = table;
+    plant->npv = N_APP_PVS + plant_stats_pvs(&table[N_APP_PVS]);
+    plant->npv += plant_realtime_pvs(&table[plant->npv]);
+
+    // Server-defined group of ADC configuration PVs
+    const char* adc_config[] = {"adc_offsets", "adc_reclen", "adc_srate"};
+    plant_define_group("adc_config", adc_config, 3);
     printf("`````````Hosting %02i of PVs:`````\n",9);
-    for (int ii=0; ii<NPV; ii++) printf("    %s\n",(*PVs[ii]).name);
+    for (int ii=0; ii<plant->npv; ii++) printf("    %s\n",(*plant->pvs[ii]).name);
     printf(",,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,\n");
-    return NPV;
+    return plant->npv;
 }
 static int plant_update()
 // Called to update PVs and stream them to client
 {
-    if (pv_sleep.value.u2 != 0){
-        mssleep(pv_sleep.value.u2);}
-    if (not plant_client_alive){
-        return 0;}
+    if (pv_adc_trate.value.u4 != 0){
+        wait_trigger(pv_adc_trate.value.u4);
+    }else if (pv_sleep.get() != 0){
+        mssleep(pv_sleep.get());}
+    if (not plant->client_alive and not archive_active()){
+        return 0;}// the archive is written without a client too
     
     //if (is_triggered(10)){
     if (true){
         if(starts_with(pv_run.value.str, "start")){
             trig_count++;
             //if(DBG>=1)printf("Trigger %u\n",trig_count);
+            plant_cycle_begin();
 
             update_adcs(trig_count);
 
             //`````Stream out continuously-measured PVs to client`````````````
             deliver_measurements();
+            plant_cycle_end();
         }
     }
     return 0;
 }
 //,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,
 //`````````````````Main loop``````````````````````````````````````````````````
-int main(){
+int main(int argc, char** argv){
 {
     printf("Plant version %s\n",VERSION);
+    const char* archive_dir = NULL;
+    const char* snapshot_file = NULL;
+    const char* mirror_name = NULL;
+    int nworkers = 0;
+    int nencoders = 0;
+    const char* trace_file = NULL;
+    const char* traffic_file = NULL;
+    bool realtime = false;
+    RealtimeConfig rt_config;
+    for (int ii=1; ii<argc; ii++){
+        if (strcmp(argv[ii], "-a") == 0 and ii+1 < argc){
+            archive_dir = argv[++ii];// archive streamed F_A PVs to this dir
+        }else if (strcmp(argv[ii], "-s") == 0 and ii+1 < argc){
+            snapshot_file = argv[++ii];// save/restore settings to this file
+        }else if (strcmp(argv[ii], "-m") == 0 and ii+1 < argc){
+            mirror_name = argv[++ii];// publish PVs in this shared memory
+        }else if (strcmp(argv[ii], "-w") == 0 and ii+1 < argc){
+            nworkers = atoi(argv[++ii]);// workers for read-only requests
+        }else if (strcmp(argv[ii], "-e") == 0 and ii+1 < argc){
+            nencoders = atoi(argv[++ii]);// threads for encoding large frames
+        }else if (strcmp(argv[ii], "-t") == 0 and ii+1 < argc){
+            trace_file = argv[++ii];// binary trace, needs make TRACE=1
+        }else if (strcmp(argv[ii], "-c") == 0 and ii+1 < argc){
+            traffic_file = argv[++ii];// capture requests for replay
+        }else if (strcmp(argv[ii], "-n") == 0 and ii+1 < argc){
+            ADC_nChannels = atoi(argv[++ii]);
+        }else if (strcmp(argv[ii], "-l") == 0 and ii+1 < argc){
+            ADC_nSamples = atoi(argv[++ii]);// record length
+        }else if (strcmp(argv[ii], "-r") == 0 and ii+1 < argc){
+            ADC_TriggerRate = atoi(argv[++ii]);
+        }else if (strcmp(argv[ii], "-g") == 0 and ii+1 < argc){
+            ADC_Signal = argv[++ii];
+        }else if (strcmp(argv[ii], "-R") == 0 and ii+1 < argc){
+            realtime = true;// SCHED_FIFO priority, 0: only pin and lock
+            rt_config.priority = atoi(argv[++ii]);
+        }else if (strcmp(argv[ii], "-C") == 0 and ii+1 < argc){
+            realtime = true;// CPUs: plant thread, then workers and encoders
+            for (char* c = strtok(argv[++ii], ","); c != NULL and
+              rt_config.ncpus < RT_MAX_CPUS; c = strtok(NULL, ",")){
+                rt_config.cpus[rt_config.ncpus++] = atoi(c);}
+        }else{
+            printf("Usage: %s [-a archive_dir] [-s snapshot_file] [-m shm_name]"
+              " [-w nworkers] [-e nencoders] [-t trace_file]"
+              " [-c capture_file] [-n nchannels] [-l nsamples] [-r trigger_rate]"
+              " [-g ramp|sine|noise|pulse] [-R rt_priority] [-C cpu,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ADC_nChannels < 1 or ADC_nChannels > ADC_Max_nChannels
+      or ADC_nSamples < 1 or ADC_nSamples > ADC_Max_nSamples){
+        printf("ERR: up to %i channels of up to %i samples are supported\n",
+          ADC_Max_nChannels, ADC_Max_nSamples);
+        return 1;
+    }
+    // The encoder buffer grows for larger frames, see encoder_retry()
+    if (ADC_nChannels*ADC_nSamples*2 + FrameOverhead > ENCODER_MAX_SIZE){
+        printf("ERR: a record of %i channels of %i samples does not fit into"
+          " a frame of %i bytes\n", ADC_nChannels, ADC_nSamples, ENCODER_MAX_SIZE);
+        return 1;
+    }
+    if (trace_file != NULL and trace_init(trace_file)){
+        return 1;}
     int msglen = 1;
     uint8_t *msg = NULL;
     int cycle_count = 0;
@@ -211,13 +508,24 @@ int main(){
     plant_init(encoder_buf, PARSER_BUFSIZE);
 
     create_PVs();
-    if (NPV == 0){
+    if (plant->npv == 0){
         printf("ERR: no parameters served\n");
         return 1;
     }
 
     //printf("Defined %i parameters\n", NPV);
+    if (snapshot_file != NULL){
+        plant_snapshot_init(snapshot_file, SnapshotIntervalMS);}
+    if (mirror_name != NULL and plant_mirror_init(mirror_name)){
+        return 1;}
+    if (archive_dir != NULL and archive_init(archive_dir, ArchiveSegmentSize)){
+        return 1;}
     if (transport_init(recv_buf, RECV_BUF_LENGTH)) exit(1);
+    if (traffic_file != NULL and plant_traffic_capture(traffic_file)) exit(1);
+    if (realtime and plant_realtime(&rt_config)){
+        printf("WARNING: real-time mode is incomplete, see above\n");}
+    if (nworkers > 0 and plant_start_workers(nworkers)) exit(1);
+    if (nencoders > 0 and plant_start_encoders(nencoders, ParallelFrameMin)) exit(1);
     clock_gettime(CLOCK_REALTIME, &ptimer_last_update);
 
     // Main loop
@@ -226,16 +534,30 @@ int main(){
         clock_gettime(CLOCK_REALTIME, &ptimer_now);// latch time
         if (has_periodic_interval_elapsed()){
             host_rps = (cycle_count - cycle_count_prev)*1000/LoopReportMS;
-            printf("ADC:rps=%i reqs:%u, trig:%u client:%i, DBG:%i\n",host_rps, requests_received, trig_count, plant_client_alive, DBG);
+            printf("ADC:rps=%i reqs:%u, trig:%u client:%i, DBG:%i\n",host_rps, requests_received, trig_count, plant->client_alive, DBG);
+            if (realtime){
+                uint32_t* rt = plant->rt->values;
+                printf("ADC:worst cycle %.1f us of %u, heap allocations in cycles: %u\n",
+                  rt[RT_WORST_CYCLE]*1e-3, rt[RT_CYCLES], rt[RT_ALLOCATIONS]);
+            }
             periodic_update();
             cycle_count_prev = cycle_count;
             if (requests_received == requests_received_since_last_periodic){
-                if (plant_client_alive == true){
+                if (plant->client_alive == true){
                     printf("ADC:Client have been disconnected.\n");}
-                plant_client_alive = false;
+                plant->client_alive = false;
             }            requests_received_since_last_periodic = requests_received;
         }
 
+        // send replies of asynchronous setters, which have been completed
+        plant_deliver_completions();
+
+        // free memory retired by the acquisition, which workers are done with
+        plant_reclaim();
+
+        // save changed settings
+        plant_snapshot_update();
+
         // check if request arrived from the client
         msglen = transport_recv(&msg);
         if (msglen == -1){ // no requests
@@ -245,10 +567,14 @@ int main(){
 
         //printf("request[%i] %i received: %s\n", msglen, requests_received, msg);
         requests_received++;
-        if (plant_client_alive == false){
+        if (plant->client_alive == false){
             printf("ADC:Client is re-connected.\n");}
-        plant_client_alive = true;
+        plant->client_alive = true;
         plant_process_request(msg, msglen);
     }
+    archive_close();
+    plant_traffic_close();
+    plant_snapshot_update(true);
+    plant_mirror_close();
 return 0;
 }}
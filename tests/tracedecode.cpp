@@ -0,0 +1,90 @@
+/*Decoder of P2Plant trace files, see include/trace.h.
+ * Events of all threads are merged by time and printed one per line:
+ * time since the first event [us], delta to the previous event of the same
+ * thread [us], thread id, event name and arguments.
+ * Usage: tracedecode trace_file [-s]; -s prints only the counts per event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/trace.h"
+
+struct Event {
+    TRACE_EVENT e;
+    uint32_t tid;
+    uint64_t prev;// time of the previous event of the thread
+};
+static int cmp_time(const void* a, const void* b){
+    uint64_t x = ((const Event*)a)->e.t, y = ((const Event*)b)->e.t;
+    return (x > y) - (x < y);
+}
+int main(int argc, char** argv){
+    if (argc < 2){
+        printf("Usage: %s trace_file [-s]\n", argv[0]);
+        return 1;
+    }
+    bool summary = argc > 2 and strcmp(argv[2], "-s") == 0;
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 or fstat(fd, &st) != 0 or st.st_size < (off_t)sizeof(TRACE_HEADER)){
+        printf("ERR: Could not open %s\n", argv[1]);
+        return 1;
+    }
+    const TRACE_HEADER* h = (const TRACE_HEADER*) mmap(NULL, st.st_size,
+      PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED or memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0
+      or h->ring_size != TRACE_RING_SIZE){
+        printf("ERR: %s is not a trace file of this version\n", argv[1]);
+        return 1;
+    }
+    uint32_t nrings = h->nrings < TRACE_MAX_THREADS? h->nrings: TRACE_MAX_THREADS;
+    const TRACE_RING* rings = (const TRACE_RING*)(h + 1);
+    size_t n = 0;
+    for (uint32_t r=0; r < nrings; r++){
+        uint64_t head = rings[r].head;
+        n += head < TRACE_RING_SIZE? head: TRACE_RING_SIZE;
+    }
+    Event* events = (Event*) malloc((n + 1)*sizeof(Event));
+    size_t count = 0;
+    for (uint32_t r=0; r < nrings; r++){
+        uint64_t head = __atomic_load_n(&rings[r].head, __ATOMIC_ACQUIRE);
+        uint64_t first = head < TRACE_RING_SIZE? 0: head - TRACE_RING_SIZE;
+        uint64_t prev = 0;
+        for (uint64_t i=first; i < head and count < n; i++){
+            Event* ev = &events[count++];
+            ev->e = rings[r].events[i & (TRACE_RING_SIZE - 1)];
+            ev->tid = rings[r].tid;
+            ev->prev = prev? prev: ev->e.t;
+            prev = ev->e.t;
+        }
+    }
+    qsort(events, count, sizeof(Event), cmp_time);
+    if (summary){
+        uint64_t counts[TR_NIDS] = {0};
+        for (size_t i=0; i < count; i++){
+            if (events[i].e.id < TR_NIDS) counts[events[i].e.id]++;}
+        printf("%zu events of %u threads\n", count, nrings);
+        for (int id=1; id < TR_NIDS; id++){
+            if (counts[id]) printf("%-14s %lu\n", trace_names[id], counts[id]);}
+        return 0;
+    }
+    uint64_t t0 = count? events[0].e.t: 0;
+    for (size_t i=0; i < count; i++){
+        const Event* ev = &events[i];
+        char tag[9] = {0};
+        memcpy(tag, &ev->e.b, 8);
+        bool printable = tag[0] >= ' ' and tag[0] < 127;
+        printf("%12.3f %10.3f %7u %-14s %10u ", (ev->e.t - t0)*1e-3,
+          (ev->e.t - ev->prev)*1e-3, ev->tid,
+          ev->e.id < TR_NIDS? trace_names[ev->e.id]: "?", ev->e.a);
+        if (printable) printf("%s\n", tag);
+        else if (ev->e.b) printf("%lu\n", ev->e.b);
+        else printf("\n");
+    }
+    return 0;
+}